@@ -0,0 +1,215 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "cmdlib.h"
+#include "bitset.h"
+
+/*
+==============================================================================
+
+BIT VECTOR KERNELS
+
+The vis flow spends most of its time and-ing, or-ing and counting portal
+bit vectors.  Each kernel has a plain C version plus SSE2 and AVX2 versions
+on x86 gcc/clang builds.  The function pointers start out on a resolver
+that checks the cpu once and swaps in the best version.  Loads are
+unaligned, and the tail past the last full vector is done by the next
+smaller kernel.
+
+==============================================================================
+*/
+
+static bool BitsAndAny_C(uint32_t *dest, const uint32_t *a, const uint32_t *b,
+                         const uint32_t *vis, int32_t longs) {
+    uint32_t more = 0;
+    int32_t j;
+
+    for (j = 0; j < longs; j++) {
+        dest[j] = a[j] & b[j];
+        more |= dest[j] & ~vis[j];
+    }
+    return more != 0;
+}
+
+static void BitsOr_C(uint32_t *dest, const uint32_t *src, int32_t longs) {
+    int32_t j;
+
+    for (j = 0; j < longs; j++)
+        dest[j] |= src[j];
+}
+
+static int32_t Popcount_C(const uint8_t *bits, int32_t numbytes) {
+    int32_t i, c = 0;
+    uint8_t b;
+
+    for (i = 0; i < numbytes; i++)
+        for (b = bits[i]; b; b &= b - 1)
+            c++;
+    return c;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITSET_X86
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) static bool BitsAndAny_SSE2(uint32_t *dest, const uint32_t *a, const uint32_t *b,
+                                                            const uint32_t *vis, int32_t longs) {
+    __m128i more = _mm_setzero_si128(), m;
+    int32_t j;
+
+    for (j = 0; j + 4 <= longs; j += 4) {
+        m    = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + j)), _mm_loadu_si128((const __m128i *)(b + j)));
+        _mm_storeu_si128((__m128i *)(dest + j), m);
+        more = _mm_or_si128(more, _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(vis + j)), m));
+    }
+    return BitsAndAny_C(dest + j, a + j, b + j, vis + j, longs - j) ||
+           _mm_movemask_epi8(_mm_cmpeq_epi8(more, _mm_setzero_si128())) != 0xffff;
+}
+
+__attribute__((target("sse2"))) static void BitsOr_SSE2(uint32_t *dest, const uint32_t *src, int32_t longs) {
+    int32_t j;
+
+    for (j = 0; j + 4 <= longs; j += 4)
+        _mm_storeu_si128((__m128i *)(dest + j), _mm_or_si128(_mm_loadu_si128((const __m128i *)(dest + j)),
+                                                             _mm_loadu_si128((const __m128i *)(src + j))));
+    BitsOr_C(dest + j, src + j, longs - j);
+}
+
+__attribute__((target("avx2"))) static bool BitsAndAny_AVX2(uint32_t *dest, const uint32_t *a, const uint32_t *b,
+                                                            const uint32_t *vis, int32_t longs) {
+    __m256i more = _mm256_setzero_si256(), m;
+    int32_t j;
+
+    for (j = 0; j + 8 <= longs; j += 8) {
+        m    = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + j)), _mm256_loadu_si256((const __m256i *)(b + j)));
+        _mm256_storeu_si256((__m256i *)(dest + j), m);
+        more = _mm256_or_si256(more, _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(vis + j)), m));
+    }
+    return BitsAndAny_SSE2(dest + j, a + j, b + j, vis + j, longs - j) || !_mm256_testz_si256(more, more);
+}
+
+__attribute__((target("avx2"))) static void BitsOr_AVX2(uint32_t *dest, const uint32_t *src, int32_t longs) {
+    int32_t j;
+
+    for (j = 0; j + 8 <= longs; j += 8)
+        _mm256_storeu_si256((__m256i *)(dest + j), _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(dest + j)),
+                                                                   _mm256_loadu_si256((const __m256i *)(src + j))));
+    BitsOr_SSE2(dest + j, src + j, longs - j);
+}
+
+__attribute__((target("popcnt"))) static int32_t Popcount_POPCNT(const uint8_t *bits, int32_t numbytes) {
+    uint64_t w;
+    int32_t i, c = 0;
+
+    for (i = 0; i + 8 <= numbytes; i += 8) {
+        memcpy(&w, bits + i, 8);
+        c += __builtin_popcountll(w);
+    }
+    return c + Popcount_C(bits + i, numbytes - i);
+}
+
+// nibble lookup popcount, summed per 64 bit lane with sad
+__attribute__((target("avx2"))) static int32_t Popcount_AVX2(const uint8_t *bits, int32_t numbytes) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low   = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256(), v, c;
+    int64_t lanes[4];
+    int32_t i;
+
+    for (i = 0; i + 32 <= numbytes; i += 32) {
+        v     = _mm256_loadu_si256((const __m256i *)(bits + i));
+        c     = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                                _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(c, _mm256_setzero_si256()));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return (int32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + Popcount_POPCNT(bits + i, numbytes - i);
+}
+#endif
+
+/*
+=============
+ResolveBitset
+
+Picks the kernels for this cpu.  Threads may race here, but they all store
+the same pointers.
+=============
+*/
+static void ResolveBitset(void);
+static int32_t (*Popcount)(const uint8_t *bits, int32_t numbytes);
+
+static bool BitsAndAny_Resolve(uint32_t *dest, const uint32_t *a, const uint32_t *b,
+                               const uint32_t *vis, int32_t longs) {
+    ResolveBitset();
+    return BitsAndAny(dest, a, b, vis, longs);
+}
+
+static void BitsOr_Resolve(uint32_t *dest, const uint32_t *src, int32_t longs) {
+    ResolveBitset();
+    BitsOr(dest, src, longs);
+}
+
+static int32_t Popcount_Resolve(const uint8_t *bits, int32_t numbytes) {
+    ResolveBitset();
+    return Popcount(bits, numbytes);
+}
+
+bool (*BitsAndAny)(uint32_t *dest, const uint32_t *a, const uint32_t *b,
+                   const uint32_t *vis, int32_t longs)               = BitsAndAny_Resolve;
+void (*BitsOr)(uint32_t *dest, const uint32_t *src, int32_t longs) = BitsOr_Resolve;
+static int32_t (*Popcount)(const uint8_t *bits, int32_t numbytes)  = Popcount_Resolve;
+
+static void ResolveBitset(void) {
+    BitsAndAny = BitsAndAny_C;
+    BitsOr     = BitsOr_C;
+    Popcount   = Popcount_C;
+
+#ifdef BITSET_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        BitsAndAny = BitsAndAny_SSE2;
+        BitsOr     = BitsOr_SSE2;
+    }
+    if (__builtin_cpu_supports("popcnt"))
+        Popcount = Popcount_POPCNT;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        BitsAndAny = BitsAndAny_AVX2;
+        BitsOr     = BitsOr_AVX2;
+        Popcount   = Popcount_AVX2;
+    }
+#endif
+}
+
+/*
+=============
+CountBits
+=============
+*/
+int32_t CountBits(uint8_t *bits, int32_t numbits) {
+    int32_t c, i;
+
+    c = Popcount(bits, numbits >> 3);
+    for (i = numbits & ~7; i < numbits; i++)
+        if (bits[i >> 3] & (1 << (i & 7)))
+            c++;
+
+    return c;
+}
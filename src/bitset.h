@@ -0,0 +1,76 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+// bit vector kernels, see bitset.c
+
+#ifndef _BITSET_H
+#define _BITSET_H
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// dest = a & b, returns true if dest has any bit not set in vis
+extern bool (*BitsAndAny)(uint32_t *dest, const uint32_t *a, const uint32_t *b,
+                          const uint32_t *vis, int32_t longs);
+
+// dest |= src
+extern void (*BitsOr)(uint32_t *dest, const uint32_t *src, int32_t longs);
+
+// number of set bits in the first numbits bits
+int32_t CountBits(uint8_t *bits, int32_t numbits);
+
+// index of the lowest set bit, bits must not be 0
+static inline int32_t LowestBit(uint32_t bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+
+    _BitScanForward(&index, bits);
+    return index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+// bits[bit] = 1, safe against other threads setting bits in the same byte
+static inline void SetBitAtomic(uint8_t *bits, int32_t bit) {
+#ifdef _MSC_VER
+    _InterlockedOr8((char *)&bits[bit >> 3], (char)(1 << (bit & 7)));
+#else
+    __atomic_fetch_or(&bits[bit >> 3], (uint8_t)(1 << (bit & 7)), __ATOMIC_RELAXED);
+#endif
+}
+
+// dest |= src, safe against other threads setting bits in dest
+static inline void BitsOrAtomic(uint32_t *dest, const uint32_t *src, int32_t longs) {
+    int32_t i;
+
+    for (i = 0; i < longs; i++) {
+        if (!src[i])
+            continue;
+#ifdef _MSC_VER
+        _InterlockedOr((volatile long *)&dest[i], (long)src[i]);
+#else
+        __atomic_fetch_or(&dest[i], src[i], __ATOMIC_RELAXED);
+#endif
+    }
+}
+
+#endif
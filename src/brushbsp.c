@@ -20,9 +20,18 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "qbsp.h"
 
-int32_t c_nodes;
-int32_t c_nonvis;
-int32_t c_active_brushes;
+THREAD_LOCAL int32_t c_nodes; // per thread, submodels build in parallel
+THREAD_LOCAL int32_t c_nonvis;
+
+#define BRUSH_SIZE(numsides) ((int32_t)(myoffsetof(bspbrush_t, sides) + (numsides) * sizeof(side_t)))
+
+pool_t nodepool = POOL("node", sizeof(node_t));
+pool_t brushpools[NUM_BRUSH_POOLS] = {
+    POOL("brush6", BRUSH_SIZE(6)),
+    POOL("brush12", BRUSH_SIZE(12)),
+    POOL("brush24", BRUSH_SIZE(24)),
+    POOL("brush48", BRUSH_SIZE(48)),
+    POOL("brush96", BRUSH_SIZE(96))};
 
 #define PSIDE_FRONT  1
 #define PSIDE_BACK   2
@@ -209,12 +218,7 @@ AllocNode
 ================
 */
 node_t *AllocNode(void) {
-    node_t *node;
-
-    node = malloc(sizeof(*node));
-    memset(node, 0, sizeof(*node));
-
-    return node;
+    return PoolAlloc(&nodepool, sizeof(node_t));
 }
 
 /*
@@ -223,15 +227,17 @@ AllocBrush
 ================
 */
 bspbrush_t *AllocBrush(int32_t numsides) {
-    bspbrush_t *bb;
-    int32_t c;
+    pool_t *pool;
+    int32_t i;
 
-    c  = (intptr_t) & (((bspbrush_t *)0)->sides[numsides]);
-    bb = malloc(c);
-    memset(bb, 0, c);
-    if (numthreads == 1)
-        c_active_brushes++;
-    return bb;
+    pool = NULL;
+    for (i = 0; i < NUM_BRUSH_POOLS; i++) {
+        if (numsides <= (6 << i)) {
+            pool = &brushpools[i];
+            break;
+        }
+    }
+    return PoolAlloc(pool, BRUSH_SIZE(numsides));
 }
 
 /*
@@ -245,9 +251,7 @@ void FreeBrush(bspbrush_t *brushes) {
     for (i = 0; i < brushes->numsides; i++)
         if (brushes->sides[i].winding)
             FreeWinding(brushes->sides[i].winding);
-    free(brushes);
-    if (numthreads == 1)
-        c_active_brushes--;
+    PoolFree(brushes);
 }
 
 /*
@@ -724,10 +728,8 @@ side_t *SelectSplitSide(bspbrush_t *brushes, node_t *node) {
         // if we found a good plane, don't bother trying any
         // other passes
         if (bestside) {
-            if (pass > 1) {
-                if (numthreads == 1)
-                    c_nonvis++;
-            }
+            if (pass > 1)
+                c_nonvis++;
             if (pass > 0)
                 node->detail_seperator = true; // not needed for vis
             break;
@@ -1025,8 +1027,7 @@ node_t *BuildTree_r(node_t *node, bspbrush_t *brushes) {
     int32_t i;
     bspbrush_t *children[2];
 
-    if (numthreads == 1)
-        c_nodes++;
+    c_nodes++;
 
     // find the best plane to use as a splitter
     bestside = SelectSplitSide(brushes, node);
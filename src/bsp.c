@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "qbsp.h"
+#include "texcache.h"
 
 extern float subdivide_size;
 extern float sublight_size;
@@ -50,6 +51,7 @@ int32_t entity_num;
 int32_t max_entities = MAX_MAP_ENTITIES; // qb: from kmqbsp3- Knightmare- adjustable entity limit
 int32_t max_bounds   = DEFAULT_MAP_SIZE; // Knightmare- adjustable max bounds
 int32_t block_size   = 1024;             // Knightmare- adjustable block size
+int32_t model_threads = 1;               // threads for building submodels, bsp runs the rest on one
 
 node_t *block_nodes[10][10];
 
@@ -285,6 +287,109 @@ void ProcessSubModel(void) {
     FreeTree(tree);
 }
 
+/*
+==============================================================================
+
+PARALLEL SUBMODELS
+
+Submodels don't share brushes, so their trees, portals and faces can be
+built at the same time.  What has to match a serial run is kept serial:
+
+The only planes a submodel makes are the clip planes of MakeBspBrushList
+and the BrushFromBounds volume, both at max_bounds and the same for every
+submodel.  The brush lists are made in model order up front and one volume
+is made and thrown away, so every plane already exists, in serial order,
+before the threads only look planes up.
+
+FixTjuncs and WriteBSP number vertexes, edges and faces, so they run after
+the threads, in model order.  Each thread's qprintf output is held back and
+printed there too.
+==============================================================================
+*/
+
+typedef struct
+{
+    int32_t entity;
+    bspbrush_t *list;
+    tree_t *tree;
+    char *log;
+} submodel_t;
+
+static submodel_t *submodels;
+
+void BuildSubModel_Thread(int32_t num) {
+    submodel_t *sm = &submodels[num];
+    entity_t *e    = &entities[sm->entity];
+    vec3_t mins, maxs;
+
+    mins[0] = mins[1] = mins[2] = -max_bounds;
+    maxs[0] = maxs[1] = maxs[2] = max_bounds;
+
+    BeginQprintfCapture();
+    if (!nocsg)
+        sm->list = ChopBrushes(sm->list);
+    sm->tree = BrushBSP(sm->list, mins, maxs);
+    MakeTreePortals(sm->tree);
+    MarkVisibleSides(sm->tree, e->firstbrush, e->firstbrush + e->numbrushes);
+    MakeFaces(sm->tree->headnode);
+    sm->log = EndQprintfCapture();
+}
+
+/*
+============
+ProcessSubModels
+
+Builds every submodel from entity first on, then writes them in order.
+============
+*/
+void ProcessSubModels(int32_t first) {
+    int32_t i, count;
+    submodel_t *sm;
+    entity_t *e;
+    vec3_t mins, maxs;
+
+    submodels = malloc((num_entities - first) * sizeof(submodel_t));
+    count     = 0;
+
+    mins[0] = mins[1] = mins[2] = -max_bounds;
+    maxs[0] = maxs[1] = maxs[2] = max_bounds;
+    for (i = first; i < num_entities; i++) {
+        e = &entities[i];
+        if (!e->numbrushes)
+            continue;
+        sm         = &submodels[count++];
+        sm->entity = i;
+        sm->list   = MakeBspBrushList(e->firstbrush, e->firstbrush + e->numbrushes, mins, maxs);
+        sm->tree   = NULL;
+        sm->log    = NULL;
+    }
+    if (count)
+        FreeBrush(BrushFromBounds(mins, maxs)); // the volume planes
+
+    numthreads = model_threads;
+    RunThreadsOnIndividual(count, false, BuildSubModel_Thread);
+    numthreads = 1;
+
+    for (i = 0; i < count; i++) {
+        sm         = &submodels[i];
+        entity_num = sm->entity;
+
+        qprintf("############### model %i ###############\n", nummodels);
+        BeginModel();
+        if (sm->log) {
+            qprintf("%s", sm->log);
+            free(sm->log);
+        }
+        FixTjuncs(sm->tree->headnode);
+        WriteBSP(sm->tree->headnode);
+        FreeTree(sm->tree);
+        EndModel();
+    }
+
+    free(submodels);
+    submodels = NULL;
+}
+
 /*
 ============
 ProcessModels
@@ -297,6 +402,11 @@ void ProcessModels(void) {
         if (!entities[entity_num].numbrushes)
             continue;
 
+        if (entity_num && model_threads != 1) {
+            ProcessSubModels(entity_num);
+            break;
+        }
+
         qprintf("############### model %i ###############\n", nummodels);
         BeginModel();
         if (entity_num == 0)
@@ -340,12 +450,13 @@ void BSP_ProcessArgument(const char * arg) {
         num_entities = 0;
 
         LoadMapFile(name);
+        SaveTextureCache();
         SetModelNumbers();
         SetLightStyles();
 
         UnparseEntities();
 
-        WriteBSPFile(out);
+        WriteChainedBSPFile(out);
     } else {
         extern void ProcessModels();
 
@@ -353,10 +464,12 @@ void BSP_ProcessArgument(const char * arg) {
         // start from scratch
         //
         LoadMapFile(name);
+        SaveTextureCache();
         SetModelNumbers();
         SetLightStyles();
 
         ProcessModels();
+        PrintPoolStats();
     }
 
     PrintBSPFileSizes();
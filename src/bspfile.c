@@ -26,6 +26,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 bool use_qbsp  = false; // qb: huge map support
 bool noskipfix = false; // qb: warn about SURF_SKIP contents rather than silently changing to zero
 
+// qb: -chain.  When another pass follows in the same run, the lumps and the
+// portals are handed over in memory instead of through the .bsp and .prt.
+bool hold_bsp;          // the running pass leaves its bsp in memory
+bool bsp_in_memory;     // the lumps hold the previous pass's bsp
+uint8_t *heldportals;   // .prb image of the portals bsp built
+int32_t heldportalsize;
+
 void GetLeafNums(void);
 
 //=============================================================================
@@ -96,8 +103,12 @@ dareaportal_t *dareaportals; //[MAX_MAP_AREAPORTALS];
 
 uint8_t dpop[256];
 
+static void ReleaseMappedBSP(bool keep);
+
 void InitBSPFile(void) {
     static bool init = false;
+
+    ReleaseMappedBSP(false);
     if (!init) {
         init          = true;
         dmodels       = (dmodel_t *)malloc(sizeof(*dmodels) * MAX_MAP_MODELS_QBSP);
@@ -133,6 +144,8 @@ void InitBSPFile(void) {
 ===============
 CompressVis
 
+Zero bytes are stored as a 0 and a run length up to 255.  Zero runs are
+skipped 8 bytes at a time.
 ===============
 */
 int32_t CompressVis(uint8_t *vis, uint8_t *dest) {
@@ -140,24 +153,32 @@ int32_t CompressVis(uint8_t *vis, uint8_t *dest) {
     int32_t rep;
     int32_t visrow;
     uint8_t *dest_p;
+    uint64_t word;
 
     dest_p = dest;
     //	visrow = (r_numvisleafs + 7)>>3;
     visrow = (dvis->numclusters + 7) >> 3;
 
-    for (j = 0; j < visrow; j++) {
-        *dest_p++ = vis[j];
-        if (vis[j])
+    for (j = 0; j < visrow;) {
+        if (vis[j]) {
+            *dest_p++ = vis[j++];
             continue;
+        }
 
-        rep = 1;
-        for (j++; j < visrow; j++)
-            if (vis[j] || rep == 255)
+        rep = 0;
+        while (rep <= 255 - 8 && j + 8 <= visrow) {
+            memcpy(&word, vis + j, 8);
+            if (word)
                 break;
-            else
-                rep++;
+            rep += 8;
+            j += 8;
+        }
+        while (rep < 255 && j < visrow && !vis[j]) {
+            rep++;
+            j++;
+        }
+        *dest_p++ = 0;
         *dest_p++ = rep;
-        j--;
     }
 
     return dest_p - dest;
@@ -422,20 +443,118 @@ int32_t CopyLump(int32_t lump, void *dest, int32_t size) {
     return length / size;
 }
 
+/*
+==============================================================================
+
+MAPPED BSP
+
+Vis and rad read most lumps and write few.  MapBSPFile maps the file
+copy-on-write and points the lump arrays straight into it.  The lumps a
+pass rebuilds and grows (visibility, lighting, entities) are still copied
+into their arrays.  A write into a mapped lump, like rad setting the face
+lightofs, only copies the pages it touches.
+
+The tree only builds for little-endian hosts (LittleLong is a cast), so
+a mapped lump needs no swapping.  Before the bsp is written or another
+one is loaded, the mapped lumps go back into their own arrays and the
+file is unmapped.
+
+==============================================================================
+*/
+
+typedef struct
+{
+    void **array; // the lump's global pointer
+    void *owned;  // its own array from InitBSPFile
+    int32_t length;
+} mappedlump_t;
+
+static uint8_t *mappedbsp;
+static int32_t mappedbsplength;
+static mappedlump_t mappedlumps[HEADER_LUMPS];
+static int32_t nummappedlumps;
+
 /*
 =============
-LoadBSPFile
+ReadLump
+
+Points *array into the mapped file, or copies the lump into it.
 =============
 */
-void LoadBSPFile(char *filename) {
+static int32_t ReadLump(int32_t lump, void **array, int32_t size) {
+    int32_t length, ofs;
+    mappedlump_t *m;
+
+    length = header->lumps[lump].filelen;
+    ofs    = header->lumps[lump].fileofs;
+
+    // lumps are padded to 4 bytes, but not every tool does it
+    if (!mappedbsp || (ofs & 3))
+        return CopyLump(lump, *array, size);
+
+    if (length < 0 || ofs < 0 || ofs > mappedbsplength - length)
+        Error("LoadBSPFile: lump %i is outside the file", lump);
+    if (length % size)
+        Error("LoadBSPFile: odd lump size  (length: %i  size: %i  remainder: %i)", length, size, length % size);
+
+    m         = &mappedlumps[nummappedlumps++];
+    m->array  = array;
+    m->owned  = *array;
+    m->length = length;
+    *array    = mappedbsp + ofs;
+
+    return length / size;
+}
+
+/*
+=============
+ReleaseMappedBSP
+
+keep copies the mapped lumps into their own arrays first.
+=============
+*/
+static void ReleaseMappedBSP(bool keep) {
+    mappedlump_t *m;
     int32_t i;
 
-    InitBSPFile();
+    if (!mappedbsp)
+        return;
 
-    //
-    // load the file header
-    //
-    LoadFile(filename, (void **)&header);
+    for (i = 0; i < nummappedlumps; i++) {
+        m = &mappedlumps[i];
+        if (keep)
+            memcpy(m->owned, *m->array, m->length);
+        *m->array = m->owned;
+    }
+    nummappedlumps = 0;
+
+    UnmapFile(mappedbsp, mappedbsplength);
+    mappedbsp = NULL;
+    header    = NULL;
+}
+
+/*
+=============
+UnmapBSPFile
+
+Moves the mapped lumps into their own arrays.  Pointers into the lumps
+taken before this are left dangling, so do it before the pass starts if
+the bsp is written more than once.
+=============
+*/
+void UnmapBSPFile(void) {
+    ReleaseMappedBSP(true);
+}
+
+/*
+=============
+ReadBSPFile
+
+The header is in place, take the lumps from it.
+=============
+*/
+static void ReadBSPFile(char *filename) {
+    int32_t i;
 
     // swap the header
     for (i = 0; i < sizeof(dheader_t) / 4; i++)
@@ -458,48 +577,64 @@ void LoadBSPFile(char *filename) {
     if (header->version != BSPVERSION)
         Error("%s is version %i, not %i", filename, header->version, BSPVERSION);
 
-    nummodels   = CopyLump(LUMP_MODELS, dmodels, sizeof(dmodel_t));
-    numvertexes = CopyLump(LUMP_VERTEXES, dvertexes, sizeof(dvertex_t));
-    numplanes   = CopyLump(LUMP_PLANES, dplanes, sizeof(dplane_t));
+    nummodels   = ReadLump(LUMP_MODELS, (void **)&dmodels, sizeof(dmodel_t));
+    numvertexes = ReadLump(LUMP_VERTEXES, (void **)&dvertexes, sizeof(dvertex_t));
+    numplanes   = ReadLump(LUMP_PLANES, (void **)&dplanes, sizeof(dplane_t));
 
     if (use_qbsp) {
-        numleafs       = CopyLump(LUMP_LEAFS, dleafsX, sizeof(dleaf_tx));
-        numnodes       = CopyLump(LUMP_NODES, dnodesX, sizeof(dnode_tx));
-        numtexinfo     = CopyLump(LUMP_TEXINFO, texinfo, sizeof(texinfo_t));
-        numfaces       = CopyLump(LUMP_FACES, dfacesX, sizeof(dface_tx));
-        numleaffaces   = CopyLump(LUMP_LEAFFACES, dleaffacesX, sizeof(dleaffacesX[0]));
-        numleafbrushes = CopyLump(LUMP_LEAFBRUSHES, dleafbrushesX, sizeof(dleafbrushesX[0]));
+        numleafs       = ReadLump(LUMP_LEAFS, (void **)&dleafsX, sizeof(dleaf_tx));
+        numnodes       = ReadLump(LUMP_NODES, (void **)&dnodesX, sizeof(dnode_tx));
+        numtexinfo     = ReadLump(LUMP_TEXINFO, (void **)&texinfo, sizeof(texinfo_t));
+        numfaces       = ReadLump(LUMP_FACES, (void **)&dfacesX, sizeof(dface_tx));
+        numleaffaces   = ReadLump(LUMP_LEAFFACES, (void **)&dleaffacesX, sizeof(dleaffacesX[0]));
+        numleafbrushes = ReadLump(LUMP_LEAFBRUSHES, (void **)&dleafbrushesX, sizeof(dleafbrushesX[0]));
     } else {
-        numleafs       = CopyLump(LUMP_LEAFS, dleafs, sizeof(dleaf_t));
-        numnodes       = CopyLump(LUMP_NODES, dnodes, sizeof(dnode_t));
-        numtexinfo     = CopyLump(LUMP_TEXINFO, texinfo, sizeof(texinfo_t));
-        numfaces       = CopyLump(LUMP_FACES, dfaces, sizeof(dface_t));
-        numleaffaces   = CopyLump(LUMP_LEAFFACES, dleaffaces, sizeof(dleaffaces[0]));
-        numleafbrushes = CopyLump(LUMP_LEAFBRUSHES, dleafbrushes, sizeof(dleafbrushes[0]));
+        numleafs       = ReadLump(LUMP_LEAFS, (void **)&dleafs, sizeof(dleaf_t));
+        numnodes       = ReadLump(LUMP_NODES, (void **)&dnodes, sizeof(dnode_t));
+        numtexinfo     = ReadLump(LUMP_TEXINFO, (void **)&texinfo, sizeof(texinfo_t));
+        numfaces       = ReadLump(LUMP_FACES, (void **)&dfaces, sizeof(dface_t));
+        numleaffaces   = ReadLump(LUMP_LEAFFACES, (void **)&dleaffaces, sizeof(dleaffaces[0]));
+        numleafbrushes = ReadLump(LUMP_LEAFBRUSHES, (void **)&dleafbrushes, sizeof(dleafbrushes[0]));
     }
 
-    numsurfedges = CopyLump(LUMP_SURFEDGES, dsurfedges, sizeof(dsurfedges[0]));
+    numsurfedges = ReadLump(LUMP_SURFEDGES, (void **)&dsurfedges, sizeof(dsurfedges[0]));
 
     if (use_qbsp)
-        numedges = CopyLump(LUMP_EDGES, dedgesX, sizeof(dedge_tx));
+        numedges = ReadLump(LUMP_EDGES, (void **)&dedgesX, sizeof(dedge_tx));
     else
-        numedges = CopyLump(LUMP_EDGES, dedges, sizeof(dedge_t));
+        numedges = ReadLump(LUMP_EDGES, (void **)&dedges, sizeof(dedge_t));
 
-    numbrushes = CopyLump(LUMP_BRUSHES, dbrushes, sizeof(dbrush_t));
+    numbrushes = ReadLump(LUMP_BRUSHES, (void **)&dbrushes, sizeof(dbrush_t));
 
     if (use_qbsp)
-        numbrushsides = CopyLump(LUMP_BRUSHSIDES, dbrushsidesX, sizeof(dbrushside_tx));
+        numbrushsides = ReadLump(LUMP_BRUSHSIDES, (void **)&dbrushsidesX, sizeof(dbrushside_tx));
     else
-        numbrushsides = CopyLump(LUMP_BRUSHSIDES, dbrushsides, sizeof(dbrushside_t));
+        numbrushsides = ReadLump(LUMP_BRUSHSIDES, (void **)&dbrushsides, sizeof(dbrushside_t));
 
-    numareas       = CopyLump(LUMP_AREAS, dareas, sizeof(darea_t));
-    numareaportals = CopyLump(LUMP_AREAPORTALS, dareaportals, sizeof(dareaportal_t));
+    numareas       = ReadLump(LUMP_AREAS, (void **)&dareas, sizeof(darea_t));
+    numareaportals = ReadLump(LUMP_AREAPORTALS, (void **)&dareaportals, sizeof(dareaportal_t));
 
+    // rebuilt by vis and rad, and they can grow
     visdatasize    = CopyLump(LUMP_VISIBILITY, dvisdata, 1);
     lightdatasize  = CopyLump(LUMP_LIGHTING, dlightdata, 1);
     entdatasize    = CopyLump(LUMP_ENTITIES, dentdata, 1);
 
     CopyLump(LUMP_POP, dpop, 1);
+}
+
+/*
+=============
+LoadBSPFile
+=============
+*/
+void LoadBSPFile(char *filename) {
+    InitBSPFile();
+
+    //
+    // load the file header
+    //
+    LoadFile(filename, (void **)&header);
+    ReadBSPFile(filename);
 
     free(header); // everything has been copied out
 
@@ -509,6 +644,24 @@ void LoadBSPFile(char *filename) {
     SwapBSPFile(false);
 }
 
+/*
+=============
+MapBSPFile
+
+LoadBSPFile for vis and rad, most lumps stay in the mapped file.
+=============
+*/
+void MapBSPFile(char *filename) {
+    InitBSPFile();
+
+    mappedbsp = MapFileCopyOnWrite(filename, &mappedbsplength);
+    if (mappedbsplength < sizeof(dheader_t))
+        Error("%s is not a recognized BSP file (IBSP or QBSP).", filename);
+
+    header = (dheader_t *)mappedbsp;
+    ReadBSPFile(filename);
+}
+
 /*
 =============
 LoadBSPFileTexinfo
@@ -521,6 +674,7 @@ void LoadBSPFileTexinfo(char *filename) {
     FILE *f;
     int32_t length, ofs;
 
+    ReleaseMappedBSP(true);
     header = malloc(sizeof(dheader_t));
 
     f      = fopen(filename, "rb");
@@ -575,6 +729,8 @@ Swaps the bsp file in place, so it should not be referenced again
 */
 void WriteBSPFile(char *filename) {
 
+    ReleaseMappedBSP(true); // filename may be the mapped file
+
     header = &outheader;
     memset(header, 0, sizeof(dheader_t));
 
@@ -644,6 +800,40 @@ void WriteBSPFile(char *filename) {
     fclose(wadfile);
 }
 
+/*
+=============
+LoadChainedBSPFile
+
+Takes the lumps the previous pass left in memory, or maps filename.
+=============
+*/
+void LoadChainedBSPFile(char *filename) {
+    if (!bsp_in_memory) {
+        MapBSPFile(filename);
+        return;
+    }
+
+    printf("using %s from the previous pass\n", filename);
+    bsp_in_memory = false;
+}
+
+/*
+=============
+WriteChainedBSPFile
+
+Keeps the lumps in memory for the next pass, or writes filename.
+=============
+*/
+void WriteChainedBSPFile(char *filename) {
+    if (!hold_bsp) {
+        WriteBSPFile(filename);
+        return;
+    }
+
+    printf("keeping %s in memory for the next pass\n", filename);
+    bsp_in_memory = true;
+}
+
 //============================================================================
 
 /*
@@ -714,6 +904,8 @@ ParseEpair
 */
 epair_t *ParseEpair(void) {
     epair_t *e;
+    char *value;
+    int32_t length;
 
     e = malloc(sizeof(epair_t));
     memset(e, 0, sizeof(epair_t));
@@ -721,10 +913,12 @@ epair_t *ParseEpair(void) {
     if (strlen(token) >= MAX_KEY - 1)
         Error("ParseEpar: token too long");
     e->key = copystring(token);
-    GetToken(false);
-    if (strlen(token) >= MAX_VALUE - 1)
+    GetTokenView(false, &value, &length);
+    if (length >= MAX_VALUE - 1)
         Error("ParseEpar: token too long");
-    e->value = copystring(token);
+    e->value = malloc(length + 1);
+    memcpy(e->value, value, length);
+    e->value[length] = 0;
 
     // strip trailing spaces
     StripTrailing(e->key);
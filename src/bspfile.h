@@ -34,6 +34,25 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define ON_EPSILON 0.1 // qb: was 0.1
 #endif
 
+// qb: binary portal file, written by bsp with -binportals next to the
+// text .prt.  Header, a prbportal_t per portal, then numpoints * 3 floats.
+#define PRBFILE "PRB1"
+
+typedef struct
+{
+    char ident[4];
+    int32_t numclusters;
+    int32_t numportals;
+    int32_t numpoints;
+} prbheader_t;
+
+typedef struct
+{
+    int32_t numpoints;
+    int32_t leafs[2];   // front, back cluster
+    int32_t firstpoint; // into the points
+} prbportal_t;
+
 extern int32_t nummodels;
 extern dmodel_t * dmodels;//[MAX_MAP_MODELS_QBSP];
 
@@ -103,10 +122,21 @@ int32_t CompressVis(uint8_t *vis, uint8_t *dest);
 
 void InitBSPFile(void);
 void LoadBSPFile(char *filename);
+void MapBSPFile(char *filename);
+void UnmapBSPFile(void);
 void LoadBSPFileTexinfo(char *filename); // just for data2
 void WriteBSPFile(char *filename);
 void PrintBSPFileSizes(void);
 
+// qb: -chain, passes in one run hand the bsp and portals over in memory
+extern bool hold_bsp;
+extern bool bsp_in_memory;
+extern uint8_t *heldportals;
+extern int32_t heldportalsize;
+
+void LoadChainedBSPFile(char *filename);
+void WriteChainedBSPFile(char *filename);
+
 //===============
 
 typedef struct epair_s {
@@ -0,0 +1,516 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "qrad.h"
+#include "mdfour.h"
+
+#if defined(USE_PTHREADS) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+/*
+==============================================================================
+
+RAD CHECKPOINTS
+
+Two files are kept next to the output bsp while rad runs:
+
+name_rad.ckp    facelights and per-patch direct light, written once after
+                BuildFacelights.  Nothing in it changes during the bounces.
+name_bounce.ckp patch totallight and radiosity, rewritten after each bounce.
+
+Both start with a header carrying a checksum of the bsp lumps, the patch
+layout and the settings that feed direct lighting, so a checkpoint from a
+different map or command line is ignored rather than loaded.  Files are
+written to a .tmp name on a background thread and renamed into place, so
+a run killed mid-write leaves the previous checkpoint intact.
+
+Data is stored in native byte order; a checkpoint is only meant to be
+resumed on the machine that wrote it.
+==============================================================================
+*/
+
+#define CHECKPOINT_VERSION 1
+#define FACELIGHT_ID       (('F' << 24) + ('K' << 16) + ('C' << 8) + 'R') // "RCKF"
+#define BOUNCE_ID          (('B' << 24) + ('K' << 16) + ('C' << 8) + 'R') // "RCKB"
+
+typedef struct
+{
+    int32_t ident;
+    int32_t version;
+    uint8_t checksum[16];
+    int32_t numfaces;
+    int32_t num_patches;
+    int32_t bounce; // bounces completed, bounce file only
+} checkpoint_header_t;
+
+typedef struct
+{
+    char path[1024];
+    checkpoint_header_t header;
+    uint8_t *data; // serialized bounce state, NULL for the facelight dump
+    size_t size;
+} checkpoint_job_t;
+
+bool checkpoint = true; // qb: disable with -nocheckpoint
+
+extern char outbase[32];
+extern char source[1024];
+extern float patch_cutoff;
+extern bool nopvs;
+
+static char facelight_path[1024];
+static char bounce_path[1024];
+static uint8_t state_checksum[16];
+
+/*
+=============
+ChecksumRadState
+
+Everything that BuildFacelights and the bounces depend on.  Final lightmap
+settings (scale, ambient, maxlight...) are left out so they can be changed
+on a resumed run.  The light cache leaves out the entity string, it tracks
+lights one by one.
+=============
+*/
+void ChecksumRadState(uint8_t *checksum, bool withentities) {
+    struct mdfour md;
+    int32_t i;
+    float settings[8];
+    int32_t flags[7];
+
+    mdfour_begin(&md);
+
+    mdfour_update(&md, (uint8_t *)dplanes, numplanes * sizeof(dplane_t));
+    mdfour_update(&md, (uint8_t *)dvertexes, numvertexes * sizeof(dvertex_t));
+    mdfour_update(&md, (uint8_t *)dsurfedges, numsurfedges * sizeof(int32_t));
+    mdfour_update(&md, (uint8_t *)texinfo, numtexinfo * sizeof(texinfo_t));
+    if (withentities)
+        mdfour_update(&md, (uint8_t *)dentdata, entdatasize);
+    mdfour_update(&md, dvisdata, visdatasize);
+    mdfour_update(&md, (uint8_t *)face_offset, numfaces * sizeof(vec3_t));
+    if (use_qbsp) {
+        mdfour_update(&md, (uint8_t *)dnodesX, numnodes * sizeof(dnode_tx));
+        mdfour_update(&md, (uint8_t *)dleafsX, numleafs * sizeof(dleaf_tx));
+        mdfour_update(&md, (uint8_t *)dfacesX, numfaces * sizeof(dface_tx));
+        mdfour_update(&md, (uint8_t *)dedgesX, numedges * sizeof(dedge_tx));
+    } else {
+        mdfour_update(&md, (uint8_t *)dnodes, numnodes * sizeof(dnode_t));
+        mdfour_update(&md, (uint8_t *)dleafs, numleafs * sizeof(dleaf_t));
+        mdfour_update(&md, (uint8_t *)dfaces, numfaces * sizeof(dface_t));
+        mdfour_update(&md, (uint8_t *)dedges, numedges * sizeof(dedge_t));
+    }
+
+    // patch layout covers subdiv, dice and texture reflectivity
+    for (i = 0; i < num_patches; i++) {
+        mdfour_update(&md, (uint8_t *)patches[i].origin, sizeof(vec3_t));
+        mdfour_update(&md, (uint8_t *)&patches[i].area, sizeof(float));
+        mdfour_update(&md, (uint8_t *)patches[i].reflectivity, sizeof(vec3_t));
+        mdfour_update(&md, (uint8_t *)patches[i].baselight, sizeof(vec3_t));
+    }
+
+    settings[0] = sample_nudge;
+    settings[1] = smoothing_value;
+    settings[2] = direct_scale;
+    settings[3] = entity_scale;
+    settings[4] = sunradscale;
+    settings[5] = patch_cutoff;
+    settings[6] = subdiv;
+    settings[7] = 0;
+    flags[0]    = extrasamples;
+    flags[1]    = noblock;
+    flags[2]    = nopvs;
+    flags[3]    = use_qbsp;
+    flags[4]    = noedgefix;
+    flags[5]    = numbounce > 0; // AddSampleToPatch skips patches without bounces
+    flags[6]    = sunmask_step;
+    mdfour_update(&md, (uint8_t *)settings, sizeof(settings));
+    mdfour_update(&md, (uint8_t *)flags, sizeof(flags));
+
+    mdfour_result(&md, checksum);
+}
+
+/*
+=============
+InitRadCheckpoint
+
+Call after the patches and direct lights are built.  Without -resume any
+checkpoint left over from an earlier run is removed.
+=============
+*/
+void InitRadCheckpoint(void) {
+    char base[1024];
+
+    sprintf(base, "%s%s", outbase, source);
+    StripExtension(base);
+    sprintf(facelight_path, "%s_rad.ckp", base);
+    sprintf(bounce_path, "%s_bounce.ckp", base);
+
+    ChecksumRadState(state_checksum, true);
+
+    if (!resume) {
+        remove(facelight_path);
+        remove(bounce_path);
+    }
+}
+
+static void InitHeader(checkpoint_header_t *header, int32_t ident, int32_t bounce) {
+    memset(header, 0, sizeof(*header));
+    header->ident       = ident;
+    header->version     = CHECKPOINT_VERSION;
+    header->numfaces    = numfaces;
+    header->num_patches = num_patches;
+    header->bounce      = bounce;
+    memcpy(header->checksum, state_checksum, sizeof(state_checksum));
+}
+
+/*
+=============
+OpenCheckpoint
+
+Returns NULL if the file is missing or was written for different input.
+=============
+*/
+static FILE *OpenCheckpoint(char *path, int32_t ident, checkpoint_header_t *header) {
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    if (fread(header, sizeof(*header), 1, f) != 1 ||
+        header->ident != ident ||
+        header->version != CHECKPOINT_VERSION ||
+        header->numfaces != numfaces ||
+        header->num_patches != num_patches ||
+        memcmp(header->checksum, state_checksum, sizeof(state_checksum))) {
+        printf("%s does not match this map or its settings, ignored\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+/*
+==============================================================================
+
+BACKGROUND WRITER
+
+==============================================================================
+*/
+
+/*
+=============
+WriteFacelight
+
+Also used by the light cache.
+=============
+*/
+void WriteFacelight(FILE *f, int32_t facenum) {
+    facelight_t *fl = &facelight[facenum];
+    int32_t j;
+
+    SafeWrite(f, &fl->numsamples, sizeof(int32_t));
+    SafeWrite(f, &fl->numstyles, sizeof(int32_t));
+    if (!fl->numsamples)
+        return;
+    SafeWrite(f, fl->stylenums, fl->numstyles * sizeof(int32_t));
+    SafeWrite(f, fl->origins, fl->numsamples * sizeof(vec3_t));
+    for (j = 0; j < fl->numstyles; j++)
+        SafeWrite(f, fl->samples[j], fl->numsamples * sizeof(vec3_t));
+}
+
+/*
+=============
+ReadFacelight
+
+With keep false the record is skipped over.
+=============
+*/
+void ReadFacelight(FILE *f, int32_t facenum, bool keep) {
+    facelight_t fl;
+    int32_t j;
+
+    SafeRead(f, &fl.numsamples, sizeof(int32_t));
+    SafeRead(f, &fl.numstyles, sizeof(int32_t));
+    if (!fl.numsamples) {
+        if (keep)
+            facelight[facenum].numsamples = facelight[facenum].numstyles = 0;
+        return;
+    }
+    if (fl.numsamples < 0 || fl.numstyles < 0 || fl.numstyles > MAX_STYLES)
+        Error("ReadFacelight: bad facelight on face %i", facenum);
+
+    if (!keep) {
+        fseek(f, fl.numstyles * sizeof(int32_t) + (fl.numstyles + 1) * fl.numsamples * sizeof(vec3_t), SEEK_CUR);
+        return;
+    }
+
+    SafeRead(f, fl.stylenums, fl.numstyles * sizeof(int32_t));
+    fl.origins = malloc(fl.numsamples * sizeof(vec3_t));
+    SafeRead(f, fl.origins, fl.numsamples * sizeof(vec3_t));
+    for (j = 0; j < fl.numstyles; j++) {
+        fl.samples[j] = malloc(fl.numsamples * sizeof(vec3_t));
+        SafeRead(f, fl.samples[j], fl.numsamples * sizeof(vec3_t));
+    }
+    facelight[facenum] = fl;
+}
+
+static void WriteFacelights(FILE *f) {
+    int32_t i;
+    patch_t *patch;
+
+    for (i = 0; i < numfaces; i++)
+        WriteFacelight(f, i);
+
+    for (i = 0, patch = patches; i < num_patches; i++, patch++) {
+        SafeWrite(f, patch->samplelight, sizeof(vec3_t));
+        SafeWrite(f, &patch->samples, sizeof(int32_t));
+    }
+}
+
+static void *CheckpointWriter(void *arg) {
+    checkpoint_job_t *job = arg;
+    char tmppath[1040];
+    FILE *f;
+
+    sprintf(tmppath, "%s.tmp", job->path);
+    f = SafeOpenWrite(tmppath);
+    SafeWrite(f, &job->header, sizeof(job->header));
+    if (job->data)
+        SafeWrite(f, job->data, job->size);
+    else
+        WriteFacelights(f);
+    fclose(f);
+
+    remove(job->path); // rename won't replace an existing file on win32
+    if (rename(tmppath, job->path))
+        printf("WARNING: couldn't rename %s to %s\n", tmppath, job->path);
+
+    free(job->data);
+    free(job);
+    return NULL;
+}
+
+#if defined(USE_PTHREADS) && defined(_WIN32)
+
+static HANDLE writer_handle;
+static bool writer_active;
+
+static DWORD WINAPI CheckpointWriterWin32(LPVOID arg) {
+    CheckpointWriter(arg);
+    return 0;
+}
+
+static void StartWriter(checkpoint_job_t *job) {
+    writer_handle = CreateThread(NULL, 0, CheckpointWriterWin32, job, 0, NULL);
+    if (!writer_handle) {
+        CheckpointWriter(job);
+        return;
+    }
+    writer_active = true;
+}
+
+void WaitRadCheckpoint(void) {
+    if (!writer_active)
+        return;
+    WaitForSingleObject(writer_handle, INFINITE);
+    CloseHandle(writer_handle);
+    writer_active = false;
+}
+
+#elif defined(USE_PTHREADS)
+
+static pthread_t writer_thread;
+static bool writer_active;
+
+static void StartWriter(checkpoint_job_t *job) {
+    if (pthread_create(&writer_thread, NULL, CheckpointWriter, job)) {
+        CheckpointWriter(job);
+        return;
+    }
+    writer_active = true;
+}
+
+void WaitRadCheckpoint(void) {
+    if (!writer_active)
+        return;
+    pthread_join(writer_thread, NULL);
+    writer_active = false;
+}
+
+#else
+
+static void StartWriter(checkpoint_job_t *job) {
+    CheckpointWriter(job);
+}
+
+void WaitRadCheckpoint(void) {
+}
+
+#endif
+
+/*
+=============
+SaveFacelightCheckpoint
+
+The facelights are left alone until FinalLightFace, which waits for the
+writer, so they are streamed out without a copy.  Any bounce checkpoint
+still on disk belongs to other facelights and is removed.
+=============
+*/
+void SaveFacelightCheckpoint(void) {
+    checkpoint_job_t *job;
+
+    if (!checkpoint)
+        return;
+
+    WaitRadCheckpoint();
+    remove(bounce_path);
+
+    job = malloc(sizeof(*job));
+    memset(job, 0, sizeof(*job));
+    strcpy(job->path, facelight_path);
+    InitHeader(&job->header, FACELIGHT_ID, 0);
+    StartWriter(job);
+}
+
+/*
+=============
+SaveBounceCheckpoint
+
+totallight and radiosity change with every bounce, so they are copied
+before handing them to the writer.
+=============
+*/
+void SaveBounceCheckpoint(int32_t bounce) {
+    checkpoint_job_t *job;
+    vec_t *out;
+    int32_t i;
+
+    if (!checkpoint)
+        return;
+
+    WaitRadCheckpoint();
+
+    job = malloc(sizeof(*job));
+    memset(job, 0, sizeof(*job));
+    strcpy(job->path, bounce_path);
+    InitHeader(&job->header, BOUNCE_ID, bounce);
+
+    job->size = (size_t)num_patches * 2 * sizeof(vec3_t);
+    job->data = malloc(job->size);
+    if (!job->data)
+        Error("SaveBounceCheckpoint: out of memory");
+
+    out = (vec_t *)job->data;
+    for (i = 0; i < num_patches; i++, out += 3)
+        VectorCopy(patches[i].totallight, out);
+    memcpy(out, radiosity, num_patches * sizeof(vec3_t));
+
+    StartWriter(job);
+}
+
+/*
+==============================================================================
+
+RESUME
+
+==============================================================================
+*/
+
+/*
+=============
+LoadFacelightCheckpoint
+
+Restores what BuildFacelights would have produced.  Returns false if there
+is no usable checkpoint.
+=============
+*/
+bool LoadFacelightCheckpoint(void) {
+    checkpoint_header_t header;
+    patch_t *patch;
+    int32_t i;
+    FILE *f;
+
+    f = OpenCheckpoint(facelight_path, FACELIGHT_ID, &header);
+    if (!f)
+        return false;
+
+    for (i = 0; i < numfaces; i++)
+        ReadFacelight(f, i, true);
+
+    for (i = 0, patch = patches; i < num_patches; i++, patch++) {
+        SafeRead(f, patch->samplelight, sizeof(vec3_t));
+        SafeRead(f, &patch->samples, sizeof(int32_t));
+    }
+
+    fclose(f);
+    printf("resumed direct lighting from %s\n", facelight_path);
+    return true;
+}
+
+/*
+=============
+LoadBounceCheckpoint
+
+Restores patch totallight and radiosity.  Returns the number of bounces
+already done, 0 if there is no usable checkpoint.  A checkpoint past the
+requested -bounce can't be undone and is ignored.
+=============
+*/
+int32_t LoadBounceCheckpoint(void) {
+    checkpoint_header_t header;
+    int32_t i;
+    FILE *f;
+
+    f = OpenCheckpoint(bounce_path, BOUNCE_ID, &header);
+    if (!f)
+        return 0;
+    if (header.bounce > numbounce) {
+        fclose(f);
+        printf("%s has %i bounces, more than -bounce %i, ignored\n", bounce_path, header.bounce, numbounce);
+        return 0;
+    }
+
+    for (i = 0; i < num_patches; i++)
+        SafeRead(f, patches[i].totallight, sizeof(vec3_t));
+    SafeRead(f, radiosity, num_patches * sizeof(vec3_t));
+
+    fclose(f);
+    printf("resumed after bounce %i from %s\n", header.bounce, bounce_path);
+    return header.bounce;
+}
+
+/*
+=============
+RemoveRadCheckpoint
+
+Called once the bsp has been written.
+=============
+*/
+void RemoveRadCheckpoint(void) {
+    WaitRadCheckpoint();
+    if (facelight_path[0]) {
+        remove(facelight_path);
+        remove(bounce_path);
+    }
+}
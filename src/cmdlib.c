@@ -26,11 +26,18 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #ifdef _WIN32
 #include <direct.h>
+#include <windows.h>
 #endif
 
 #ifdef __unix__
 #include <unistd.h>
 #endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
 #define PATHSEPERATOR '/'
 
 // set these before calling CheckParm
@@ -43,6 +50,9 @@ bool com_eof;
 bool archive;
 char archivedir[1024];
 
+bool resume; // qb: continue an interrupted vis or rad run from its state file
+bool incremental; // qb: reuse results of the previous run where the input allows
+
 char inbase[32];
 char outbase[32];
 char source[1024];
@@ -148,18 +158,71 @@ void Error(char *error, ...) {
 
 // only qprintf if in verbose mode
 bool verbose = false;
+// qb: a thread can hold its qprintf output back, so work done in parallel
+// still prints in order
+static THREAD_LOCAL char *qcapture;
+static THREAD_LOCAL int32_t qcapturelen, qcapturemax;
+static THREAD_LOCAL bool qcapturing;
+
 void qprintf(char *format, ...) {
     va_list argptr;
+    int32_t len;
 
     if (!verbose)
         return;
 
+    if (qcapturing) {
+        va_start(argptr, format);
+        len = vsnprintf(NULL, 0, format, argptr);
+        va_end(argptr);
+        if (qcapturelen + len + 1 > qcapturemax) {
+            qcapturemax = (qcapturelen + len + 1) * 2;
+            qcapture    = realloc(qcapture, qcapturemax);
+            if (!qcapture)
+                Error("qprintf: out of memory");
+        }
+        va_start(argptr, format);
+        vsnprintf(qcapture + qcapturelen, len + 1, format, argptr);
+        va_end(argptr);
+        qcapturelen += len;
+        return;
+    }
+
     va_start(argptr, format);
     vprintf(format, argptr);
     va_end(argptr);
     fflush(stdout);
 }
 
+/*
+=================
+BeginQprintfCapture
+
+qprintf on this thread collects into a buffer until EndQprintfCapture.
+=================
+*/
+void BeginQprintfCapture(void) {
+    qcapture    = NULL;
+    qcapturelen = qcapturemax = 0;
+    qcapturing  = true;
+}
+
+/*
+=================
+EndQprintfCapture
+
+Returns the text, NULL if there was none.  The caller frees it.
+=================
+*/
+char *EndQprintfCapture(void) {
+    char *text;
+
+    text       = qcapture;
+    qcapture   = NULL;
+    qcapturing = false;
+    return text;
+}
+
 // qb: similar to AAtools, except basedir defaults to moddir
 /*
  * Path determination
@@ -580,6 +643,95 @@ int32_t LoadFile(char *filename, void **bufferptr) {
     return length;
 }
 
+/*
+==============
+MapFileView
+
+Maps a file without copying it.  A writable view is private: written pages
+are copied on first touch and never reach the file.  Falls back to
+LoadFile where there is no mmap.
+==============
+*/
+static void *MapFileView(char *filename, int32_t *length, bool writable) {
+#if defined(USE_MMAP)
+    struct stat st;
+    void *buffer;
+    int32_t fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        Error("Error opening %s: %s", filename, strerror(errno));
+    if (fstat(fd, &st) || !st.st_size)
+        Error("MapFile: %s is empty", filename);
+
+    buffer = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED)
+        Error("MapFile: couldn't map %s: %s", filename, strerror(errno));
+
+    *length = st.st_size;
+    return buffer;
+#elif defined(_WIN32)
+    HANDLE file, mapping;
+    void *buffer;
+
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        Error("Error opening %s", filename);
+    *length = GetFileSize(file, NULL);
+    if (!*length)
+        Error("MapFile: %s is empty", filename);
+
+    mapping = CreateFileMappingA(file, NULL, writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    buffer  = mapping ? MapViewOfFile(mapping, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (mapping)
+        CloseHandle(mapping); // the view keeps both alive
+    CloseHandle(file);
+    if (!buffer)
+        Error("MapFile: couldn't map %s", filename);
+
+    return buffer;
+#else
+    void *buffer;
+
+    *length = LoadFile(filename, &buffer);
+    return buffer;
+#endif
+}
+
+/*
+==============
+MapFile
+
+Maps a file read-only.  Release with UnmapFile.
+==============
+*/
+void *MapFile(char *filename, int32_t *length) {
+    return MapFileView(filename, length, false);
+}
+
+/*
+==============
+MapFileCopyOnWrite
+
+Maps a file that may be written in memory; only the pages written are
+copied.  Release with UnmapFile.
+==============
+*/
+void *MapFileCopyOnWrite(char *filename, int32_t *length) {
+    return MapFileView(filename, length, true);
+}
+
+void UnmapFile(void *buffer, int32_t length) {
+#if defined(USE_MMAP)
+    munmap(buffer, length);
+#elif defined(_WIN32)
+    UnmapViewOfFile(buffer);
+#else
+    free(buffer);
+#endif
+}
+
 /*
 ==============
 TryLoadFile
@@ -615,12 +767,21 @@ int32_t TryLoadFile(char *filename, void **bufferptr, int32_t print_error) {
 }
 
 /*
-==============
-TryLoadFileFromPak  //qb: GDD tools
+==============================================================================
 
-Allows failure
-==============
+PAK INDEX  //qb: GDD tools
+
+The pak<n>.pak files of a game directory are mapped on first use and
+their directories go into one hash on the lower-cased name, so a lookup
+is a probe instead of reading every directory again.  Earlier paks and
+earlier entries win, as they did when the paks were scanned in turn.
+The paks stay mapped until exit.
+
+Lookups come from the serial parts of bsp and rad; the index is not
+built under a lock.
+==============================================================================
 */
+
 typedef struct
 {
     uint8_t magic[4];   // Name of the new WAD format
@@ -638,79 +799,198 @@ typedef struct
     uint32_t size;   // Size of the entry in PACK file
 } pakentry_t;
 
-int32_t TryLoadFileFromPak(char *filename, void **bufferptr, char *gd) {
-    FILE *f;
-    int32_t pakn, n, i, ret_len;  
-    uint32_t dir_ents;
-    void *buffer;
-    pakheader_t pak_header;
-    pakentry_t *pak_entry;
-    char file[1024];
+#define PAK_NAME_LENGTH sizeof(((pakentry_t *)0)->filename)
 
-    for (n = 0; filename[n] != 0; n++) {
-        if (filename[n] == '\\')
-            filename[n] = '/';
+typedef struct
+{
+    char name[PAK_NAME_LENGTH + 1]; // lower case, '/' separated
+    uint8_t *pak;
+    int32_t paklength;
+    uint32_t offset, size;
+} pakfile_t;
+
+typedef struct pakindex_s {
+    char gamedir[1024];
+    pakfile_t *files;
+    int32_t numfiles;
+    int32_t *hash; // files index + 1, 0 is empty
+    int32_t hashmask;
+    struct pakindex_s *next;
+} pakindex_t;
+
+static pakindex_t *pakindexes;
+
+/*
+==============
+PakFileName
+
+The name a pak lookup compares: lower case, '/' separated and cut where
+the directory cuts it.
+==============
+*/
+static uint32_t PakFileName(const char *in, int32_t maxlength, char *out) {
+    uint32_t hash;
+    int32_t i;
+    char c;
+
+    hash = 2166136261u;
+    for (i = 0; i < maxlength && in[i]; i++) {
+        c = in[i];
+        if (c == '\\')
+            c = '/';
+        else if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        out[i] = c;
+        hash   = (hash ^ (uint8_t)c) * 16777619u;
     }
+    out[i] = 0;
 
-    *bufferptr = NULL;
+    return hash;
+}
 
-    ret_len    = -1;
-    for (pakn = 0;; pakn++) { //qb: was n.  Bugfix by Dennis Katsonis 
-        if (ret_len != -1)
+static pakfile_t *FindPakFile(pakindex_t *index, const char *name, uint32_t hash) {
+    int32_t slot, f;
+
+    for (slot = hash & index->hashmask; (f = index->hash[slot]); slot = (slot + 1) & index->hashmask)
+        if (!strcmp(index->files[f - 1].name, name))
+            return &index->files[f - 1];
+    return NULL;
+}
+
+/*
+==============
+IndexPaks
+==============
+*/
+static pakindex_t *IndexPaks(char *gd) {
+    pakindex_t *index;
+    pakheader_t header;
+    pakentry_t *dir;
+    pakfile_t *file;
+    uint8_t *pak;
+    char path[1040];
+    int32_t pakn, length, i, size, numpaks, maxfiles;
+    uint32_t hash;
+
+    for (index = pakindexes; index; index = index->next)
+        if (!strcmp(index->gamedir, gd))
+            return index;
+
+    index = malloc(sizeof(*index));
+    memset(index, 0, sizeof(*index));
+    strcpy(index->gamedir, gd);
+
+    maxfiles = 0;
+    numpaks  = 0;
+    for (pakn = 0;; pakn++) { //qb: was n.  Bugfix by Dennis Katsonis
+        sprintf(path, "%spak%d.pak", gd, pakn);
+        if (!FileExists(path))
             break;
 
-        sprintf(file, "%spak%d.pak", gd, pakn);
+        pak = MapFile(path, &length);
+        if (length < sizeof(pakheader_t))
+            Error("File read failure: %s", path);
+        memcpy(&header, pak, sizeof(header));
+        header.diroffset = LittleLong(header.diroffset);
+        header.dirsize   = LittleLong(header.dirsize);
+        if (header.diroffset > length || header.dirsize > length - header.diroffset)
+            Error("File read failure: %s", path);
+        numpaks++;
+
+        dir = (pakentry_t *)(pak + header.diroffset);
+        for (i = 0; i < header.dirsize / sizeof(pakentry_t); i++) {
+            if (index->numfiles == maxfiles) {
+                maxfiles     = maxfiles * 2 + 1024;
+                index->files = realloc(index->files, maxfiles * sizeof(pakfile_t));
+            }
+            file = &index->files[index->numfiles++];
+            memcpy(file->name, dir[i].filename, PAK_NAME_LENGTH);
+            file->name[PAK_NAME_LENGTH] = 0;
+            file->pak                   = pak;
+            file->paklength             = length;
+            file->offset                = LittleLong(dir[i].offset);
+            file->size                  = LittleLong(dir[i].size);
+        }
+    }
 
-        f = fopen(file, "rb");
+    for (size = 1024; size < index->numfiles * 2; size <<= 1)
+        ;
+    index->hash     = malloc(size * sizeof(int32_t));
+    index->hashmask = size - 1;
+    memset(index->hash, 0, size * sizeof(int32_t));
+
+    for (i = 0; i < index->numfiles; i++) {
+        file = &index->files[i];
+        hash = PakFileName(file->name, PAK_NAME_LENGTH, file->name);
+        if (FindPakFile(index, file->name, hash))
+            continue; // an earlier pak or entry has it
+        while (index->hash[hash & index->hashmask])
+            hash++;
+        index->hash[hash & index->hashmask] = i + 1;
+    }
 
-        if (!f) {
-            // if(errno == ENOENT) jit
-            return -1;
+    if (numpaks)
+        qprintf("indexed %i files in %i paks of %s\n", index->numfiles, numpaks, gd);
 
-            continue;
-        }
+    index->next = pakindexes;
+    pakindexes  = index;
+    return index;
+}
 
-        SafeRead(f, &pak_header, sizeof(pakheader_t));
+/*
+==============
+TryMapFileFromPak
 
-        dir_ents  = pak_header.dirsize / sizeof(pakentry_t);
+Points *bufferptr straight into the mapped pak.  The data is read-only,
+not terminated and stays valid until exit; don't free it.  Returns -1 if
+no pak of gd has filename.
+==============
+*/
+int32_t TryMapFileFromPak(char *filename, void **bufferptr, char *gd) {
+    char name[PAK_NAME_LENGTH + 1];
+    pakindex_t *index;
+    pakfile_t *file;
+    uint32_t hash;
 
-        pak_entry = malloc(pak_header.dirsize);
+    *bufferptr = NULL;
 
-        if (pak_entry != NULL) {
-            if (!fseek(f, pak_header.diroffset, SEEK_SET)) {
-                memset(pak_entry, 0, pak_header.dirsize);
+    index      = IndexPaks(gd);
+    if (!index->numfiles)
+        return -1;
 
-                SafeRead(f, pak_entry, pak_header.dirsize);
+    hash = PakFileName(filename, PAK_NAME_LENGTH, name);
+    file = FindPakFile(index, name, hash);
+    if (!file)
+        return -1;
 
-                for (i = 0; i < dir_ents; i++) {
-                    for (n = 0; pak_entry[i].filename[n] != 0; n++) {
-                        if (pak_entry[i].filename[n] == '\\')
-                            pak_entry[i].filename[n] = '/';
-                    }
+    if (file->offset > file->paklength || file->size > file->paklength - file->offset)
+        Error("File read failure: %s in %spak", filename, gd);
 
-                    if (!Q_strncasecmp((char *)pak_entry[i].filename, filename, 56)) {
-                        if (!fseek(f, pak_entry[i].offset, SEEK_SET)) {
-                            buffer                              = malloc(pak_entry[i].size + 1);
-                            ((char *)buffer)[pak_entry[i].size] = 0;
-                            SafeRead(f, buffer, pak_entry[i].size);
-                            *bufferptr = buffer;
+    *bufferptr = file->pak + file->offset;
+    return file->size;
+}
 
-                            ret_len    = pak_entry[i].size;
-                        }
+/*
+==============
+TryLoadFileFromPak
 
-                        break;
-                    }
-                }
-            }
-        }
+Allows failure.  The buffer is a terminated copy, free it.
+==============
+*/
+int32_t TryLoadFileFromPak(char *filename, void **bufferptr, char *gd) {
+    void *data, *buffer;
+    int32_t length;
 
-        if (pak_entry != NULL)
-            free(pak_entry);
+    length = TryMapFileFromPak(filename, &data, gd);
+    if (length == -1)
+        return -1;
 
-        fclose(f);
-    }
+    buffer                   = malloc(length + 1);
+    ((char *)buffer)[length] = 0;
+    memcpy(buffer, data, length);
+    *bufferptr = buffer;
 
-    return ret_len;
+    return length;
 }
 /*
  */
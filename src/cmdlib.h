@@ -36,6 +36,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // the dec offsetof macro doesnt work very well...
 #define myoffsetof(type, identifier) ((size_t) & ((type *)0)->identifier)
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 // set these before calling CheckParm
 extern int32_t myargc;
 extern char **myargv;
@@ -73,7 +79,11 @@ void SafeWrite(FILE *f, void *buffer, int32_t count);
 
 int32_t LoadFile(char *filename, void **bufferptr);
 int32_t TryLoadFile(char *filename, void **bufferptr, int32_t print_error);
+void *MapFile(char *filename, int32_t *length);
+void *MapFileCopyOnWrite(char *filename, int32_t *length);
+void UnmapFile(void *buffer, int32_t length);
 int32_t TryLoadFileFromPak(char *filename, void **bufferptr, char *gamedir);
+int32_t TryMapFileFromPak(char *filename, void **bufferptr, char *gamedir);
 void SaveFile(char *filename, void *buffer, int32_t count);
 bool FileExists(char *filename);
 
@@ -113,8 +123,13 @@ void QCopyFile(char *from, char *to);
 extern bool archive;
 extern char archivedir[1024];
 
+extern bool resume;
+extern bool incremental;
+
 extern bool verbose;
 void qprintf(char *format, ...);
+void BeginQprintfCapture(void);
+char *EndQprintfCapture(void);
 
 void ExpandWildcards(int32_t *argc, char ***argv);
 
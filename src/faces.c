@@ -38,8 +38,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define OFF_EPSILON 0.5
 
 extern brush_texture_t side_brushtextures[MAX_MAP_SIDES]; // qb: kmbsp3: caulk
-int32_t c_merge;
-int32_t c_subdivide;
+THREAD_LOCAL int32_t c_merge; // per thread, submodels make faces in parallel
+THREAD_LOCAL int32_t c_subdivide;
 
 int32_t c_totalverts;
 int32_t c_uniqueverts;
@@ -80,24 +80,44 @@ typedef struct hashvert_s {
 
 #define HASH_SIZE MAX_POINTS_HASH // qb: per kmbsp3. Was 64
 
+// qb: vertexes are hashed on 128 unit cubes rather than x/y columns, so tall
+// maps don't put every height in one chain.  The cube key is hashed into
+// VERTEX_HASH chains; vertexcell tells cubes sharing a chain apart.
+#define VERTEX_HASH_BITS 16
+#define VERTEX_HASH      (1 << VERTEX_HASH_BITS)
+
 int32_t vertexchain[MAX_MAP_VERTS_QBSP];  // the next vertex in a hash chain
-int32_t hashverts[HASH_SIZE * HASH_SIZE]; // a vertex number, or 0 for no verts
+int32_t vertexcell[MAX_MAP_VERTS_QBSP];   // cube the vertex was hashed in
+int32_t hashverts[VERTEX_HASH];           // a vertex number, or 0 for no verts
 
 //============================================================================
 
-unsigned HashVec(vec3_t vec) {
-    int32_t x, y;
+static int32_t HashCoord(vec_t v) {
+    int32_t c;
+
+    c = (max_bounds + (int32_t)(v + 0.5)) >> 7;
+    if (c < 0 || c >= HASH_SIZE)
+        Error("HashCoord: point outside valid range");
+    return c;
+}
+
+static int32_t ClampCoord(vec_t v) {
+    int32_t c;
+
+    c = (max_bounds + (int32_t)(v + 0.5)) >> 7;
+    return c < 0 ? 0 : c >= HASH_SIZE ? HASH_SIZE - 1 : c;
+}
 
-    x = (max_bounds + (int32_t)(vec[0] + 0.5)) >> 7;
-    y = (max_bounds + (int32_t)(vec[1] + 0.5)) >> 7;
-    if (x < 0 || x >= HASH_SIZE || y < 0 || y >= HASH_SIZE)
-        Error("HashVec: point outside valid range");
+static inline int32_t CellKey(int32_t x, int32_t y, int32_t z) {
+    return (z * HASH_SIZE + y) * HASH_SIZE + x;
+}
 
-    return y * HASH_SIZE + x;
+static inline unsigned HashCell(int32_t cell) {
+    return ((uint32_t)cell * 2654435761u) >> (32 - VERTEX_HASH_BITS);
 }
+
 vec_t g_min_vertex_diff_sq = BOGUS_RANGE; // jitdebug
 vec3_t g_min_vertex_pos;               // jitdebug
-
 /*
 =============
 GetVertex
@@ -110,7 +130,8 @@ int32_t GetVertexnum(vec3_t in) {
     int32_t i;
     float *p;
     vec3_t vert;
-    int32_t vnum;
+    int32_t vnum, best;
+    int32_t x, y, z, zc, cell;
 
     c_totalverts++;
 
@@ -121,23 +142,37 @@ int32_t GetVertexnum(vec3_t in) {
             vert[i] = in[i];
     }
 
-    h = HashVec(vert);
-
-    for (vnum = hashverts[h]; vnum; vnum = vertexchain[vnum]) {
-        vec3_t diff;
-        vec_t length_sq; // jit
-        p = dvertexes[vnum].point;
-        VectorSubtract(p, vert, diff);    // jit
-        length_sq = VectorLengthSq(diff); // jit
-
-        if (length_sq < POINT_EPSILON * POINT_EPSILON)
-            return vnum;
-        if (length_sq < g_min_vertex_diff_sq) // jitdebug
-        {
-            g_min_vertex_diff_sq = length_sq; // jitdebug
-            VectorCopy(p, g_min_vertex_pos);
+    x = HashCoord(vert[0]);
+    y = HashCoord(vert[1]);
+    z = HashCoord(vert[2]);
+
+    // a match can sit in the cube above or below.  The newest match wins,
+    // the same one a single x/y column chain used to find first.
+    best = 0;
+    for (zc = ClampCoord(vert[2] - POINT_EPSILON); zc <= ClampCoord(vert[2] + POINT_EPSILON); zc++) {
+        cell = CellKey(x, y, zc);
+        for (vnum = hashverts[HashCell(cell)]; vnum > best; vnum = vertexchain[vnum]) {
+            vec3_t diff;
+            vec_t length_sq; // jit
+            if (vertexcell[vnum] != cell)
+                continue;
+            p = dvertexes[vnum].point;
+            VectorSubtract(p, vert, diff);    // jit
+            length_sq = VectorLengthSq(diff); // jit
+
+            if (length_sq < POINT_EPSILON * POINT_EPSILON) {
+                best = vnum;
+                break;
+            }
+            if (length_sq < g_min_vertex_diff_sq) // jitdebug
+            {
+                g_min_vertex_diff_sq = length_sq; // jitdebug
+                VectorCopy(p, g_min_vertex_pos);
+            }
         }
     }
+    if (best)
+        return best;
 
     // emit a vertex
     if (use_qbsp) {
@@ -150,8 +185,11 @@ int32_t GetVertexnum(vec3_t in) {
     dvertexes[numvertexes].point[1] = vert[1];
     dvertexes[numvertexes].point[2] = vert[2];
 
+    cell                     = CellKey(x, y, z);
+    h                        = HashCell(cell);
+    vertexcell[numvertexes]  = cell;
     vertexchain[numvertexes] = hashverts[h];
-    hashverts[h] = numvertexes;
+    hashverts[h]             = numvertexes;
 
     c_uniqueverts++;
 
@@ -268,18 +306,26 @@ void EmitVertexes_r(node_t *node) {
 ==========
 FindEdgeVerts
 
-Uses the hash tables to cut down to a small number
+Uses the hash tables to cut down to a small number.  Only cubes within
+OFF_EPSILON of the edge's z range are visited.  Each x/y column is listed
+newest vertex first, the order TestEdge has always seen them in.
 ==========
 */
+static int32_t CompareVertnumsDown(const void *a, const void *b) {
+    return *(const int32_t *)b - *(const int32_t *)a;
+}
+
 void FindEdgeVerts(vec3_t v1, vec3_t v2) {
-    int32_t x1, x2, y1, y2, t;
-    int32_t x, y;
+    int32_t x1, x2, y1, y2, z1, z2, t;
+    int32_t x, y, z, cell, column;
     int32_t vnum;
 
     x1 = (max_bounds + (int32_t)(v1[0] + 0.5)) >> 7;
     y1 = (max_bounds + (int32_t)(v1[1] + 0.5)) >> 7;
     x2 = (max_bounds + (int32_t)(v2[0] + 0.5)) >> 7;
     y2 = (max_bounds + (int32_t)(v2[1] + 0.5)) >> 7;
+    z1 = ClampCoord((v1[2] < v2[2] ? v1[2] : v2[2]) - OFF_EPSILON - 1);
+    z2 = ClampCoord((v1[2] > v2[2] ? v1[2] : v2[2]) + OFF_EPSILON + 1);
 
     if (x1 > x2) {
         t = x1;
@@ -295,9 +341,16 @@ void FindEdgeVerts(vec3_t v1, vec3_t v2) {
     num_edge_verts = 0;
     for (x = x1; x <= x2; x++) {
         for (y = y1; y <= y2; y++) {
-            for (vnum = hashverts[y * HASH_SIZE + x]; vnum; vnum = vertexchain[vnum]) {
-                edge_verts[num_edge_verts++] = vnum;
+            column = num_edge_verts;
+            for (z = z1; z <= z2; z++) {
+                cell = CellKey(x, y, z);
+                for (vnum = hashverts[HashCell(cell)]; vnum; vnum = vertexchain[vnum]) {
+                    if (vertexcell[vnum] == cell)
+                        edge_verts[num_edge_verts++] = vnum;
+                }
             }
+            if (z2 > z1 && num_edge_verts - column > 1)
+                qsort(edge_verts + column, num_edge_verts - column, sizeof(int32_t), CompareVertnumsDown);
         }
     }
 }
@@ -471,16 +524,10 @@ void FixTjuncs(node_t *headnode) {
 
 //========================================================
 
-int32_t c_faces;
+pool_t facepool = POOL("face", sizeof(face_t));
 
 face_t *AllocFace(void) {
-    face_t *f;
-
-    f = malloc(sizeof(face_t));
-    memset(f, 0, sizeof(face_t));
-    c_faces++;
-
-    return f;
+    return PoolAlloc(&facepool, sizeof(face_t));
 }
 
 face_t *NewFaceFromFace(face_t *f) {
@@ -497,8 +544,7 @@ face_t *NewFaceFromFace(face_t *f) {
 void FreeFace(face_t *f) {
     if (f->w)
         FreeWinding(f->w);
-    free(f);
-    c_faces--;
+    PoolFree(f);
 }
 
 //========================================================
@@ -713,35 +759,222 @@ face_t *TryMerge(face_t *f1, face_t *f2, vec3_t planenormal) {
 /*
 ===============
 MergeNodeFaces
+
+Every face that is still whole has its edges hashed by the cells of their
+two points, along with the texinfo, plane and contents that TryMerge wants
+to match.  A face only tries the earlier faces that have one of its edges
+reversed, lowest first, which is the same pair the plain n^2 walk over the
+list would have merged first.  Merged faces go on a worklist in the order
+they are made and are linked to the end of node->faces like before.
 ===============
 */
+#define MERGE_HASH_BITS 10
+
+typedef struct
+{
+    int32_t key[9]; // texinfo, planenum, contents, cells of the first and second point
+    int32_t face;   // index into the worklist
+    int32_t next;
+} mergeedge_t;
+
+typedef struct
+{
+    face_t **work;
+    int32_t numwork;
+    int32_t *tried; // last worklist index each face was tried against
+
+    mergeedge_t *edges;
+    int32_t numedges, maxedges;
+    int32_t *buckets;
+    int32_t hashmask;
+} mergehash_t;
+
+static inline int32_t MergeCell(vec_t v) {
+    return (int32_t)floor(v + 0.5);
+}
+
+static uint32_t MergeKeyHash(const int32_t *key) {
+    uint32_t h = 2166136261u;
+    int32_t i;
+
+    for (i = 0; i < 9; i++)
+        h = (h ^ (uint32_t)key[i]) * 16777619u;
+    return h;
+}
+
+static void MergeEdgeKey(face_t *f, vec_t *a, vec_t *b, int32_t *key) {
+    int32_t i;
+
+    key[0] = f->texinfo;
+    key[1] = f->planenum;
+    key[2] = f->contents;
+    for (i = 0; i < 3; i++) {
+        key[3 + i] = MergeCell(a[i]);
+        key[6 + i] = MergeCell(b[i]);
+    }
+}
+
+static void HashMergeFace(mergehash_t *mh, int32_t facenum) {
+    face_t *f = mh->work[facenum];
+    winding_t *w = f->w;
+    mergeedge_t *e;
+    int32_t i, h;
+
+    if (!w)
+        return;
+
+    for (i = 0; i < w->numpoints; i++) {
+        if (mh->numedges == mh->maxedges) {
+            mh->maxedges *= 2;
+            mh->edges = realloc(mh->edges, mh->maxedges * sizeof(mergeedge_t));
+            if (!mh->edges)
+                Error("HashMergeFace: out of memory");
+        }
+        e = &mh->edges[mh->numedges];
+        MergeEdgeKey(f, w->p[i], w->p[(i + 1) % w->numpoints], e->key);
+        e->face = facenum;
+        h = MergeKeyHash(e->key) & mh->hashmask;
+        e->next = mh->buckets[h];
+        mh->buckets[h] = mh->numedges++;
+    }
+}
+
+static int CompareMergeFaces(const void *a, const void *b) {
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+/*
+===============
+FindMergeFaces
+
+Fills list with the earlier faces holding an edge that could be f1's edge
+p1 -> p2 reversed.  Points within EQUAL_EPSILON of a cell boundary look in
+the neighbouring cell as well.
+===============
+*/
+static int32_t FindMergeFaces(mergehash_t *mh, int32_t facenum, int32_t *list) {
+    face_t *f1 = mh->work[facenum];
+    winding_t *w = f1->w;
+    int32_t key[9], lo[6], hi[6], c[6];
+    int32_t i, j, k, count;
+    vec_t *p1, *p2;
+    mergeedge_t *e;
+
+    count = 0;
+    for (i = 0; i < w->numpoints; i++) {
+        p1 = w->p[i];
+        p2 = w->p[(i + 1) % w->numpoints];
+        for (k = 0; k < 3; k++) {
+            // the matching edge runs p2 -> p1
+            lo[k]     = MergeCell(p2[k] - EQUAL_EPSILON);
+            hi[k]     = MergeCell(p2[k] + EQUAL_EPSILON);
+            lo[3 + k] = MergeCell(p1[k] - EQUAL_EPSILON);
+            hi[3 + k] = MergeCell(p1[k] + EQUAL_EPSILON);
+        }
+        key[0] = f1->texinfo;
+        key[1] = f1->planenum;
+        key[2] = f1->contents;
+
+        memcpy(c, lo, sizeof(c));
+        while (1) {
+            memcpy(key + 3, c, sizeof(c));
+            for (j = mh->buckets[MergeKeyHash(key) & mh->hashmask]; j != -1; j = e->next) {
+                e = &mh->edges[j];
+                if (memcmp(e->key, key, sizeof(key)) || mh->tried[e->face] == facenum)
+                    continue;
+                mh->tried[e->face] = facenum;
+                list[count++]      = e->face;
+            }
+
+            // step to the next cell combination
+            for (k = 0; k < 6; k++) {
+                if (c[k] < hi[k]) {
+                    c[k]++;
+                    break;
+                }
+                c[k] = lo[k];
+            }
+            if (k == 6)
+                break;
+        }
+    }
+
+    qsort(list, count, sizeof(int32_t), CompareMergeFaces);
+    return count;
+}
+
 void MergeNodeFaces(node_t *node) {
-    face_t *f1, *f2, *end;
+    mergehash_t mh;
+    face_t *f, *f1, *f2, *tail;
     face_t *merged;
-    plane_t *plane;
+    int32_t *list;
+    int32_t i, j, count, numfaces, numpoints;
 
-    merged = NULL;
+    numfaces = numpoints = 0;
+    tail = NULL;
+    for (f = node->faces; f; f = f->next) {
+        numfaces++;
+        if (f->w)
+            numpoints += f->w->numpoints;
+        tail = f;
+    }
+    if (numfaces < 2)
+        return;
 
-    for (f1 = node->faces; f1; f1 = f1->next) {
-        if (f1->merged || f1->split[0] || f1->split[1])
+    // every merge takes two faces and gives back one
+    mh.work  = malloc(2 * numfaces * sizeof(face_t *));
+    mh.tried = malloc(2 * numfaces * sizeof(int32_t));
+    list     = malloc(2 * numfaces * sizeof(int32_t));
+    mh.numwork = 0;
+    for (f = node->faces; f; f = f->next) {
+        mh.tried[mh.numwork]  = -1;
+        mh.work[mh.numwork++] = f;
+    }
+
+    mh.numedges = 0;
+    mh.maxedges = numpoints + 16;
+    mh.edges    = malloc(mh.maxedges * sizeof(mergeedge_t));
+    for (i = 1 << MERGE_HASH_BITS; i < numpoints * 2; i <<= 1)
+        ;
+    mh.hashmask = i - 1;
+    mh.buckets  = malloc(i * sizeof(int32_t));
+    memset(mh.buckets, -1, i * sizeof(int32_t));
+
+    for (i = 0; i < mh.numwork; i++) {
+        f1 = mh.work[i];
+        if (f1->merged || f1->split[0] || f1->split[1] || !f1->w)
             continue;
-        for (f2 = node->faces; f2 != f1; f2 = f2->next) {
+
+        merged = NULL;
+        count  = FindMergeFaces(&mh, i, list);
+        for (j = 0; j < count; j++) {
+            f2 = mh.work[list[j]];
             if (f2->merged || f2->split[0] || f2->split[1])
                 continue;
-            plane = &mapplanes[f1->planenum];
-            merged = TryMerge(f1, f2, plane->normal);
-            if (!merged)
-                continue;
+            merged = TryMerge(f1, f2, mapplanes[f1->planenum].normal);
+            if (merged)
+                break;
+        }
 
-            // add merged to the end of the node face list
-            // so it will be checked against all the faces again
-            for (end = node->faces; end->next; end = end->next)
-                ;
-            merged->next = NULL;
-            end->next = merged;
-            break;
+        if (!merged) {
+            HashMergeFace(&mh, i);
+            continue;
         }
+
+        // add merged to the end of the node face list
+        // so it will be checked against all the faces again
+        merged->next = NULL;
+        tail->next   = merged;
+        tail         = merged;
+        mh.tried[mh.numwork]  = -1;
+        mh.work[mh.numwork++] = merged;
     }
+
+    free(mh.work);
+    free(mh.tried);
+    free(list);
+    free(mh.edges);
+    free(mh.buckets);
 }
 
 //=====================================================================
@@ -836,7 +1069,7 @@ void SubdivideNodeFaces(node_t *node) {
 
 //===========================================================================
 
-int32_t c_nodefaces;
+THREAD_LOCAL int32_t c_nodefaces;
 
 /*
 ============
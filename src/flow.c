@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 ===========================================================================
 */
 #include "vis.h"
+#include "threads.h"
 
 /*
 
@@ -38,16 +39,36 @@ with this program; if not, write to the Free Software Foundation, Inc.,
   void CalcMightSee (leaf_t *leaf,
 */
 
-int32_t CountBits(uint8_t *bits, int32_t numbits) {
-    int32_t i;
-    int32_t c;
+/*
+==============
+StackMightsee
 
-    c = 0;
-    for (i = 0; i < numbits; i++)
-        if (bits[i >> 3] & (1 << (i & 7)))
-            c++;
+The mightsee bits for one recursion level.  Levels come from chunks that
+live for one PortalFlow, so each level costs portalbytes rather than a
+MAX_PORTALS_QBSP sized array on the C stack.
+==============
+*/
+#define MIGHTSEE_CHUNK 64
 
-    return c;
+uint8_t *StackMightsee(threaddata_t *thread, int32_t depth) {
+    int32_t chunk = depth / MIGHTSEE_CHUNK;
+
+    if (chunk >= thread->num_mightsee_chunks) {
+        thread->mightsee_chunks = realloc(thread->mightsee_chunks, (chunk + 1) * sizeof(uint8_t *));
+        thread->mightsee_chunks[chunk] = malloc(MIGHTSEE_CHUNK * portalbytes);
+        thread->num_mightsee_chunks    = chunk + 1;
+    }
+    return thread->mightsee_chunks[chunk] + (depth % MIGHTSEE_CHUNK) * portalbytes;
+}
+
+void FreeStackMightsee(threaddata_t *thread) {
+    int32_t i;
+
+    for (i = 0; i < thread->num_mightsee_chunks; i++)
+        free(thread->mightsee_chunks[i]);
+    free(thread->mightsee_chunks);
+    thread->mightsee_chunks     = NULL;
+    thread->num_mightsee_chunks = 0;
 }
 
 int32_t c_fullskip;
@@ -338,6 +359,34 @@ winding_t *ClipToSeperators(winding_t *source, winding_t *pass, winding_t *targe
     return target;
 }
 
+static inline void MarkPortalVis(threaddata_t *thread, int32_t pnum) {
+    if (thread->shared)
+        SetBitAtomic(thread->base->portalvis, pnum);
+    else
+        thread->base->portalvis[pnum >> 3] |= (1 << (pnum & 7));
+}
+
+void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstack);
+
+/*
+==================
+FlowDeeper
+
+At the BetterPortalVis depth limit, everything still in mightsee is taken
+as visible instead of being clipped further.
+==================
+*/
+static void FlowDeeper(portal_t *p, threaddata_t *thread, pstack_t *stack) {
+    if (thread->maxdepth && stack->depth >= thread->maxdepth) {
+        if (thread->shared)
+            BitsOrAtomic((uint32_t *)thread->base->portalvis, (uint32_t *)stack->mightsee, portallongs);
+        else
+            BitsOr((uint32_t *)thread->base->portalvis, (uint32_t *)stack->mightsee, portallongs);
+        return;
+    }
+    RecursiveLeafFlow(p->leaf, thread, stack);
+}
+
 /*
 ==================
 RecursiveLeafFlow
@@ -351,8 +400,8 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
     portal_t *p;
     plane_t backplane;
     leaf_t *leaf;
-    int32_t i, j;
-    uint32_t *test, *might, *vis, more;
+    int32_t i;
+    uint32_t *test, *might, *vis;
     int32_t pnum;
 
     thread->c_chains++;
@@ -365,6 +414,8 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
     stack.next      = NULL;
     stack.leaf      = leaf;
     stack.portal    = NULL;
+    stack.depth     = prevstack->depth + 1;
+    stack.mightsee  = StackMightsee(thread, stack.depth);
 
     might           = (uint32_t *)stack.mightsee;
     vis             = (uint32_t *)thread->base->portalvis;
@@ -374,6 +425,9 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
         p    = leaf->portals[i];
         pnum = p - portals;
 
+        if (!prevstack->depth && thread->leafportal >= 0 && i != thread->leafportal)
+            continue; // another work item of a split portal
+
         if (!(prevstack->mightsee[pnum >> 3] & (1 << (pnum & 7)))) {
             continue; // can't possibly see it
         }
@@ -385,13 +439,7 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
             test = (uint32_t *)p->portalflood;
         }
 
-        more = 0;
-        for (j = 0; j < portallongs; j++) {
-            might[j] = ((uint32_t *)prevstack->mightsee)[j] & test[j];
-            more |= (might[j] & ~vis[j]);
-        }
-
-        if (!more &&
+        if (!BitsAndAny(might, (uint32_t *)prevstack->mightsee, test, vis, portallongs) &&
             (thread->base->portalvis[pnum >> 3] & (1 << (pnum & 7)))) { // can't see anything new
             continue;
         }
@@ -459,9 +507,9 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
         if (!prevstack->pass) { // the second leaf can only be blocked if coplanar
 
             // mark the portal as visible
-            thread->base->portalvis[pnum >> 3] |= (1 << (pnum & 7));
+            MarkPortalVis(thread, pnum);
 
-            RecursiveLeafFlow(p->leaf, thread, &stack);
+            FlowDeeper(p, thread, &stack);
             continue;
         }
 
@@ -474,11 +522,230 @@ void RecursiveLeafFlow(int32_t leafnum, threaddata_t *thread, pstack_t *prevstac
             continue;
 
         // mark the portal as visible
-        thread->base->portalvis[pnum >> 3] |= (1 << (pnum & 7));
+        MarkPortalVis(thread, pnum);
 
         // flow through it for real
-        RecursiveLeafFlow(p->leaf, thread, &stack);
+        FlowDeeper(p, thread, &stack);
+    }
+}
+
+/*
+===============
+BuildFlowWork
+
+The portals are sorted by nummightsee, so the last few are the heaviest
+and would leave one thread busy at the end of the run.  Each of those is
+split into one work item per portal of its first leaf; the items fill the
+same portalvis and the last one to finish marks the portal done.
+===============
+*/
+typedef struct
+{
+    int32_t portalnum;  // into sorted_portals
+    int32_t leafportal; // -1 for the whole portal
+} flowwork_t;
+
+static flowwork_t *flowwork;
+static int32_t *flowparts;  // per sorted portal, work items still running
+static int32_t *flowchains; // per sorted portal
+
+int32_t c_chains;
+
+/*
+===============
+-reuse
+
+Everything a portal sees goes through the portals of the leaf it looks
+into, so its mightsee can be cut down to those portals plus what they see
+(their portalvis when done, else their portalflood).  Whenever a portal
+finishes, the portals looking into its leaf that haven't started get that
+bound, and the ones that shrank move up the queue.  The work items before
+numdynamic are handed out smallest nummightsee first from a heap.
+===============
+*/
+bool reuse_vis;
+
+typedef struct
+{
+    int32_t key;
+    int32_t portalnum; // into portals
+} flowheap_t;
+
+static flowheap_t *flowheap;
+static int32_t flowheap_size, flowheap_max;
+static bool *flowqueued; // per portal, handed out from the heap
+static int32_t numdynamic;
+static int32_t c_tightened, c_tightenbits;
+
+static void PushFlowHeap(int32_t key, int32_t portalnum) {
+    int32_t i, parent;
+    flowheap_t t;
+
+    if (flowheap_size == flowheap_max) {
+        flowheap_max = flowheap_max ? flowheap_max * 2 : 1024;
+        flowheap     = realloc(flowheap, flowheap_max * sizeof(flowheap_t));
+    }
+    i                     = flowheap_size++;
+    flowheap[i].key       = key;
+    flowheap[i].portalnum = portalnum;
+    while (i) {
+        parent = (i - 1) / 2;
+        if (flowheap[parent].key <= flowheap[i].key)
+            break;
+        t                = flowheap[parent];
+        flowheap[parent] = flowheap[i];
+        flowheap[i]      = t;
+        i                = parent;
+    }
+}
+
+static int32_t PopFlowHeap(void) {
+    int32_t i, child, portalnum;
+    flowheap_t t;
+
+    while (flowheap_size) {
+        portalnum   = flowheap[0].portalnum;
+        t           = flowheap[0];
+        flowheap[0] = flowheap[--flowheap_size];
+        for (i = 0; (child = i * 2 + 1) < flowheap_size; i = child) {
+            if (child + 1 < flowheap_size && flowheap[child + 1].key < flowheap[child].key)
+                child++;
+            if (flowheap[i].key <= flowheap[child].key)
+                break;
+            t               = flowheap[i];
+            flowheap[i]     = flowheap[child];
+            flowheap[child] = t;
+        }
+        // stale entries are left behind when a portal's bound shrinks
+        if (portals[portalnum].status == stat_none && !flowqueued[portalnum]) {
+            flowqueued[portalnum] = true;
+            return portalnum;
+        }
     }
+    return -1;
+}
+
+/*
+===============
+TightenNeighbours
+
+p just finished.  Bound the unstarted portals that look into the leaf p
+leaves from.
+===============
+*/
+static void TightenNeighbours(portal_t *p) {
+    leaf_t *leaf;
+    portal_t *r, *a;
+    uint32_t *bound, *flood;
+    int32_t i, j, n, rnum, anum;
+
+    // portals come in pairs, p's twin looks into the leaf that lists p
+    leaf = &leafs[portals[(p - portals) ^ 1].leaf];
+
+    bound = malloc(portalbytes);
+    memset(bound, 0, portalbytes);
+    for (i = 0; i < leaf->numportals; i++) {
+        r    = leaf->portals[i];
+        rnum = r - portals;
+        BitsOr(bound, (uint32_t *)(r->status == stat_done ? r->portalvis : r->portalflood), portallongs);
+        bound[rnum >> 5] |= 1u << (rnum & 31);
+    }
+
+    // the heap hands portals out under the same lock
+    ThreadLock();
+    for (i = 0; i < leaf->numportals; i++) {
+        anum = (leaf->portals[i] - portals) ^ 1;
+        a    = &portals[anum];
+        if (a->status != stat_none || flowqueued[anum])
+            continue;
+
+        flood = (uint32_t *)a->portalflood;
+        for (j = 0; j < portallongs; j++)
+            flood[j] &= bound[j];
+        n = CountBits(a->portalflood, numportals * 2);
+        if (n == a->nummightsee)
+            continue;
+
+        c_tightened++;
+        c_tightenbits += a->nummightsee - n;
+        a->nummightsee = n;
+        PushFlowHeap(n, anum);
+    }
+    ThreadUnlock();
+
+    free(bound);
+}
+
+int32_t BuildFlowWork(void) {
+    int32_t i, j, split, numwork;
+    portal_t *p;
+
+    split = numthreads > 1 ? numthreads * 4 : 0;
+    if (split > numportals * 2)
+        split = numportals * 2;
+
+    c_chains = c_tightened = c_tightenbits = 0;
+    if (reuse_vis) {
+        numdynamic    = numportals * 2 - split;
+        flowheap_size = 0;
+        flowqueued    = malloc(numportals * 2 * sizeof(bool));
+        for (i = 0; i < numportals * 2; i++)
+            flowqueued[i] = true;
+        for (i = 0; i < numdynamic; i++) {
+            if (sorted_portals[i]->status == stat_done)
+                continue; // resumed
+            flowqueued[sorted_portals[i] - portals] = false;
+            PushFlowHeap(sorted_portals[i]->nummightsee, sorted_portals[i] - portals);
+        }
+    }
+
+    numwork = numportals * 2;
+    for (i = numportals * 2 - split; i < numportals * 2; i++)
+        numwork += leafs[sorted_portals[i]->leaf].numportals - 1;
+
+    flowwork   = malloc(numwork * sizeof(flowwork_t));
+    flowparts  = malloc(numportals * 2 * sizeof(int32_t));
+    flowchains = malloc(numportals * 2 * sizeof(int32_t));
+    memset(flowchains, 0, numportals * 2 * sizeof(int32_t));
+
+    numwork = 0;
+    for (i = 0; i < numportals * 2; i++) {
+        p = sorted_portals[i];
+        if (i < numportals * 2 - split || leafs[p->leaf].numportals < 2) {
+            flowwork[numwork].portalnum  = i;
+            flowwork[numwork].leafportal = -1;
+            numwork++;
+            flowparts[i] = 1;
+            continue;
+        }
+        for (j = 0; j < leafs[p->leaf].numportals; j++) {
+            flowwork[numwork].portalnum  = i;
+            flowwork[numwork].leafportal = j;
+            numwork++;
+        }
+        flowparts[i] = j;
+    }
+
+    return numwork;
+}
+
+void FreeFlowWork(void) {
+    free(flowwork);
+    free(flowparts);
+    free(flowchains);
+    flowwork   = NULL;
+    flowparts  = NULL;
+    flowchains = NULL;
+
+    if (reuse_vis) {
+        printf("reuse: %i mightsee bits cut from %i portals\n", c_tightenbits, c_tightened);
+        free(flowheap);
+        free(flowqueued);
+        flowheap     = NULL;
+        flowqueued   = NULL;
+        flowheap_max = 0;
+    }
+    printf("%i chains\n", c_chains);
 }
 
 /*
@@ -488,33 +755,76 @@ PortalFlow
 generates the portalvis bit vector
 ===============
 */
-void PortalFlow(int32_t portalnum) {
+void PortalFlow(int32_t work) {
     threaddata_t data;
-    int32_t i;
     portal_t *p;
+    int32_t i, portalnum, parts, chains;
     int32_t c_might, c_can;
 
-    p         = sorted_portals[portalnum];
+    portalnum = flowwork[work].portalnum;
+    if (reuse_vis && work < numdynamic) {
+        ThreadLock();
+        i = PopFlowHeap();
+        ThreadUnlock();
+        if (i < 0)
+            return; // resumed portals leave the heap short
+        p = &portals[i];
+    } else {
+        p = sorted_portals[portalnum];
+        if (p->status == stat_done)
+            return; // resumed
+    }
     p->status = stat_working;
 
-    c_might   = CountBits(p->portalflood, numportals * 2);
-
     memset(&data, 0, sizeof(data));
     data.base                    = p;
+    data.leafportal              = flowwork[work].leafportal;
+    data.shared                  = data.leafportal >= 0;
+    data.maxdepth                = flow_depth;
 
     data.pstack_head.portal      = p;
     data.pstack_head.source      = p->winding;
     data.pstack_head.portalplane = p->plane;
-    for (i = 0; i < portallongs; i++)
-        ((uint32_t *)data.pstack_head.mightsee)[i] = ((uint32_t *)p->portalflood)[i];
-    RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
+    if (!p->cachedvis) {
+        data.pstack_head.mightsee = StackMightsee(&data, 0);
+        memcpy(data.pstack_head.mightsee, p->portalflood, portalbytes);
+        RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
+        FreeStackMightsee(&data);
+    }
 
+    if (data.shared) {
+        ThreadLock();
+        // every part entered the first leaf, count that once
+        flowchains[portalnum] += data.leafportal ? data.c_chains - 1 : data.c_chains;
+        parts  = --flowparts[portalnum];
+        chains = flowchains[portalnum];
+        ThreadUnlock();
+        if (parts)
+            return;
+    } else
+        chains = data.c_chains;
+
+    if (p->cachedvis) {
+        // -incremental, done at the same point a full vis would finish it
+        memcpy(p->portalvis, p->cachedvis, portalbytes);
+        free(p->cachedvis);
+        p->cachedvis = NULL;
+    }
     p->status = stat_done;
+    SaveVisPortal(p);
+
+    ThreadLock();
+    c_chains += chains;
+    ThreadUnlock();
 
+    if (reuse_vis)
+        TightenNeighbours(p);
+
+    c_might   = CountBits(p->portalflood, numportals * 2);
     c_can     = CountBits(p->portalvis, numportals * 2);
 
     qprintf("portal:%4i  mightsee:%4i  cansee:%4i (%i chains)\n",
-            (int32_t)(p - portals), c_might, c_can, data.c_chains);
+            (int32_t)(p - portals), c_might, c_can, chains);
 }
 
 /*
@@ -650,67 +960,65 @@ void BasePortalVis(int32_t portalnum) {
 
 This is a second order aproximation
 
-Calculates portalvis bit vector
-
-WAAAAAAY too slow.
+The full flow clipped to a limited depth: past better_depth leafs, whatever
+is left in mightsee is taken as visible.  The result is a subset of
+portalflood and a superset of what the full flow finds, so it can stand in
+for either.
 
 ===============================================================================
 */
 
-/*
-==================
-RecursiveLeafBitFlow
+int32_t better_depth; // prepass limit, see TightenPortalFlood
+int32_t flow_depth;   // PortalFlow limit, 0 for the full flow
 
-==================
+/*
+==============
+BetterPortalVis
+==============
 */
-void RecursiveLeafBitFlow(int32_t leafnum, uint8_t *mightsee, uint8_t *cansee) {
+void BetterPortalVis(int32_t portalnum) {
+    threaddata_t data;
     portal_t *p;
-    leaf_t *leaf;
-    int32_t i, j;
-    uint32_t more;
-    int32_t pnum;
-    uint8_t newmight[MAX_MAP_PORTALS_QBSP / 8];
 
-    leaf = &leafs[leafnum];
-
-    // check all portals for flowing into other leafs
-    for (i = 0; i < leaf->numportals; i++) {
-        p    = leaf->portals[i];
-        pnum = p - portals;
-
-        // if some previous portal can't see it, skip
-        if (!(mightsee[pnum >> 3] & (1 << (pnum & 7))))
-            continue;
-
-        // if this portal can see some portals we mightsee, recurse
-        more = 0;
-        for (j = 0; j < portallongs; j++) {
-            ((uint32_t *)newmight)[j] = ((uint32_t *)mightsee)[j] & ((uint32_t *)p->portalflood)[j];
-            more |= ((uint32_t *)newmight)[j] & ~((uint32_t *)cansee)[j];
-        }
-
-        if (!more)
-            continue; // can't see anything new
+    p = portals + portalnum;
 
-        cansee[pnum >> 3] |= (1 << (pnum & 7));
+    memset(&data, 0, sizeof(data));
+    data.base                    = p;
+    data.leafportal              = -1;
+    data.maxdepth                = better_depth;
 
-        RecursiveLeafBitFlow(p->leaf, newmight, cansee);
+    data.pstack_head.portal      = p;
+    data.pstack_head.source      = p->winding;
+    data.pstack_head.portalplane = p->plane;
+    if (!p->cachedvis) {
+        data.pstack_head.mightsee = StackMightsee(&data, 0);
+        memcpy(data.pstack_head.mightsee, p->portalflood, portalbytes);
+        RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
+        FreeStackMightsee(&data);
     }
 }
 
 /*
 ==============
-BetterPortalVis
+TightenPortalFlood
+
+Makes the BetterPortalVis results the new portalflood.  Run after every
+portal is done, since they all read each other's portalflood.
 ==============
 */
-void BetterPortalVis(int32_t portalnum) {
+void TightenPortalFlood(void) {
+    int32_t i;
+    uint8_t *swap;
     portal_t *p;
 
-    p = portals + portalnum;
-
-    RecursiveLeafBitFlow(p->leaf, p->portalflood, p->portalvis);
+    c_vis = 0;
+    for (i = 0, p = portals; i < numportals * 2; i++, p++) {
+        swap           = p->portalflood;
+        p->portalflood = p->portalvis;
+        p->portalvis   = swap;
+        memset(p->portalvis, 0, portalbytes);
 
-    // build leaf vis information
-    p->nummightsee = CountBits(p->portalvis, numportals * 2);
-    c_vis += p->nummightsee;
+        p->nummightsee = CountBits(p->portalflood, numportals * 2);
+        c_vis += p->nummightsee;
+    }
 }
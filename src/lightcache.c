@@ -0,0 +1,505 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "qrad.h"
+#include "mdfour.h"
+
+/*
+==============================================================================
+
+LIGHT CACHE
+
+With -incremental, name_light.cache keeps the direct lighting of every face
+together with the lights that reached it and the clusters its samples were
+in.  Lights are identified by a hash of everything that goes into their
+contribution, so moving or editing a light entity shows up as one light
+removed and one added.
+
+On the next run a face is rebuilt only if a light it depended on is gone,
+or if one of its sample clusters can see a light that wasn't there before.
+Every other face gets its facelight and patch direct light back from the
+cache and the bounces run on that as usual.
+
+Geometry, vis and the direct-lighting settings are covered by a checksum;
+any change there throws the whole cache away.
+==============================================================================
+*/
+
+#define LIGHTCACHE_ID      (('1' << 24) + ('C' << 16) + ('L' << 8) + 'R') // "RLC1"
+#define LIGHTCACHE_VERSION 1
+
+typedef struct
+{
+    int32_t ident;
+    int32_t version;
+    uint8_t checksum[16];
+    int32_t numfaces;
+    int32_t num_patches;
+    int32_t numlights;
+} lightcache_header_t;
+
+typedef struct
+{
+    int32_t numkeys;
+    uint64_t *keys;
+    int32_t numclusters;
+    int32_t *clusters;
+} facedeps_t;
+
+// hashed fields of a directlight_t
+typedef struct
+{
+    int32_t type;
+    int32_t style;
+    int32_t falloff;
+    float intensity;
+    float wait;
+    float adjangle;
+    float stopdot;
+    vec3_t origin;
+    vec3_t color;
+    vec3_t normal;
+    float planedist;
+    float sun[4]; // sky lights pick up the worldspawn sun keys
+    vec3_t sun_pos;
+    vec3_t sun_color;
+} lightkey_t;
+
+static char cache_path[1024];
+static uint8_t cache_checksum[16];
+static uint64_t *lightkeys;  // by directlight_t index
+static facedeps_t *facedeps; // by face
+static bool *facecached;
+
+extern char outbase[32];
+extern char source[1024];
+
+static int32_t CompareKeys(const void *a, const void *b) {
+    uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+    return (ka > kb) - (ka < kb);
+}
+
+static bool KeyInList(uint64_t key, uint64_t *list, int32_t count) {
+    return bsearch(&key, list, count, sizeof(uint64_t), CompareKeys) != NULL;
+}
+
+static uint64_t HashLight(directlight_t *dl) {
+    lightkey_t k;
+    uint8_t digest[16];
+    uint64_t key;
+
+    memset(&k, 0, sizeof(k));
+    k.type      = dl->type;
+    k.style     = dl->style;
+    k.falloff   = dl->falloff;
+    k.intensity = dl->intensity;
+    k.wait      = dl->wait;
+    k.adjangle  = dl->adjangle;
+    k.stopdot   = dl->stopdot;
+    VectorCopy(dl->origin, k.origin);
+    VectorCopy(dl->color, k.color);
+    VectorCopy(dl->normal, k.normal);
+    if (dl->type == emit_sky) {
+        k.planedist = dl->plane->dist;
+        k.sun[0]    = sun_main;
+        k.sun[1]    = sun_ambient;
+        k.sun[2]    = sun_alt_color;
+        k.sun[3]    = sunradscale;
+        VectorCopy(sun_pos, k.sun_pos);
+        VectorCopy(sun_color, k.sun_color);
+    }
+
+    mdfour(digest, (uint8_t *)&k, sizeof(k));
+    memcpy(&key, digest, sizeof(key));
+    return key;
+}
+
+/*
+=============
+HashLights
+
+Fills lightkeys and returns them sorted.  Identical lights get their
+ordinal mixed in so that removing one of a pair is still noticed.
+=============
+*/
+typedef struct
+{
+    uint64_t key;
+    int32_t index;
+} keyindex_t;
+
+static int32_t CompareKeyIndex(const void *a, const void *b) {
+    const keyindex_t *ka = a, *kb = b;
+
+    if (ka->key != kb->key)
+        return (ka->key > kb->key) - (ka->key < kb->key);
+    return ka->index - kb->index;
+}
+
+static uint64_t *HashLights(int32_t *lightcluster) {
+    keyindex_t *order;
+    uint64_t *sorted;
+    directlight_t *dl;
+    int32_t i, dup;
+
+    lightkeys = malloc(numdlights * sizeof(uint64_t));
+    order     = malloc(numdlights * sizeof(keyindex_t));
+    for (i = 0; i < numdlights; i++) {
+        order[i].key   = 0;
+        order[i].index = i;
+        lightcluster[i] = -1;
+    }
+
+    // lights in solid were never linked into a cluster and light nothing
+    for (i = 0; i < dvis->numclusters; i++) {
+        for (dl = directlights[i]; dl; dl = dl->next) {
+            order[dl->index].key = HashLight(dl);
+            lightcluster[dl->index] = i;
+        }
+    }
+
+    qsort(order, numdlights, sizeof(keyindex_t), CompareKeyIndex);
+    for (i = 0, dup = 0; i < numdlights; i++) {
+        if (i > 0 && order[i].key == order[i - 1].key)
+            dup++;
+        else
+            dup = 0;
+        lightkeys[order[i].index] = order[i].key;
+        if (dup)
+            lightkeys[order[i].index] += dup * 0x9E3779B97F4A7C15ull;
+    }
+    free(order);
+
+    sorted = malloc(numdlights * sizeof(uint64_t));
+    memcpy(sorted, lightkeys, numdlights * sizeof(uint64_t));
+    qsort(sorted, numdlights, sizeof(uint64_t), CompareKeys);
+    return sorted;
+}
+
+/*
+=============
+FindAffectedClusters
+
+Marks every cluster whose pvs holds a new light.
+=============
+*/
+static uint8_t *FindAffectedClusters(uint8_t *newclusters) {
+    uint8_t pvs[(MAX_MAP_LEAFS_QBSP + 7) / 8];
+    uint8_t *affected;
+    int32_t numclusters = dvis->numclusters;
+    int32_t rowbytes    = (numclusters + 7) >> 3;
+    int32_t i, j;
+
+    affected = malloc(rowbytes);
+    memset(affected, 0, rowbytes);
+
+    for (i = 0; i < numclusters; i++) {
+        if (!visdatasize) {
+            memset(pvs, 255, rowbytes);
+        } else {
+            DecompressVis(dvisdata + dvis->bitofs[i][DVIS_PVS], pvs);
+        }
+        for (j = 0; j < rowbytes; j++) {
+            if (pvs[j] & newclusters[j]) {
+                affected[i >> 3] |= 1 << (i & 7);
+                break;
+            }
+        }
+    }
+
+    return affected;
+}
+
+static bool FaceDepsValid(facedeps_t *fd, uint64_t *keys, int32_t numkeys, uint8_t *affected) {
+    int32_t i, c;
+
+    for (i = 0; i < fd->numkeys; i++) {
+        if (!KeyInList(fd->keys[i], keys, numkeys))
+            return false;
+    }
+    if (affected) {
+        for (i = 0; i < fd->numclusters; i++) {
+            c = fd->clusters[i];
+            if (affected[c >> 3] & (1 << (c & 7)))
+                return false;
+        }
+    }
+    return true;
+}
+
+static void FreeFaceDeps(facedeps_t *fd) {
+    free(fd->keys);
+    free(fd->clusters);
+    memset(fd, 0, sizeof(*fd));
+}
+
+/*
+=============
+LoadLightCache
+=============
+*/
+static void LoadLightCache(uint64_t *keys, int32_t *lightcluster) {
+    lightcache_header_t header;
+    uint64_t *oldkeys;
+    uint8_t *newclusters, *affected = NULL;
+    int32_t i, numnew = 0, numgone = 0, numrelit = 0;
+    int32_t rowbytes = (dvis->numclusters + 7) >> 3;
+    facedeps_t *fd;
+    patch_t *patch;
+    vec3_t samplelight;
+    int32_t samples;
+    bool clean;
+    FILE *f;
+
+    f = fopen(cache_path, "rb");
+    if (!f) {
+        printf("no light cache, lighting all faces\n");
+        return;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.ident != LIGHTCACHE_ID ||
+        header.version != LIGHTCACHE_VERSION ||
+        header.numfaces != numfaces ||
+        header.num_patches != num_patches ||
+        memcmp(header.checksum, cache_checksum, sizeof(cache_checksum))) {
+        printf("%s is out of date, lighting all faces\n", cache_path);
+        fclose(f);
+        return;
+    }
+
+    oldkeys = malloc(header.numlights * sizeof(uint64_t));
+    SafeRead(f, oldkeys, header.numlights * sizeof(uint64_t));
+
+    newclusters = malloc(rowbytes);
+    memset(newclusters, 0, rowbytes);
+    for (i = 0; i < numdlights; i++) {
+        if (KeyInList(lightkeys[i], oldkeys, header.numlights))
+            continue;
+        numnew++;
+        if (lightcluster[i] >= 0)
+            newclusters[lightcluster[i] >> 3] |= 1 << (lightcluster[i] & 7);
+    }
+    for (i = 0; i < header.numlights; i++) {
+        if (!KeyInList(oldkeys[i], keys, numdlights))
+            numgone++;
+    }
+    if (numnew)
+        affected = FindAffectedClusters(newclusters);
+
+    for (i = 0; i < numfaces; i++) {
+        fd = &facedeps[i];
+        SafeRead(f, &fd->numkeys, sizeof(int32_t));
+        fd->keys = malloc(fd->numkeys * sizeof(uint64_t));
+        SafeRead(f, fd->keys, fd->numkeys * sizeof(uint64_t));
+        SafeRead(f, &fd->numclusters, sizeof(int32_t));
+        fd->clusters = malloc(fd->numclusters * sizeof(int32_t));
+        SafeRead(f, fd->clusters, fd->numclusters * sizeof(int32_t));
+
+        clean = FaceDepsValid(fd, keys, numdlights, affected);
+        ReadFacelight(f, i, clean);
+        for (patch = face_patches[i]; patch; patch = patch->next) {
+            SafeRead(f, samplelight, sizeof(vec3_t));
+            SafeRead(f, &samples, sizeof(int32_t));
+            if (clean) {
+                VectorCopy(samplelight, patch->samplelight);
+                patch->samples = samples;
+            }
+        }
+
+        facecached[i] = clean;
+        if (!clean) {
+            FreeFaceDeps(fd);
+            numrelit++;
+        }
+    }
+
+    fclose(f);
+    free(oldkeys);
+    free(newclusters);
+    free(affected);
+
+    printf("light cache: %i new, %i removed lights, relighting %i of %i faces\n",
+           numnew, numgone, numrelit, numfaces);
+}
+
+/*
+=============
+InitLightCache
+
+Call after CreateDirectLights, before BuildFacelights.
+=============
+*/
+void InitLightCache(void) {
+    char base[1024];
+    int32_t *lightcluster;
+    uint64_t *keys;
+
+    if (!incremental)
+        return;
+
+    sprintf(base, "%s%s", outbase, source);
+    StripExtension(base);
+    sprintf(cache_path, "%s_light.cache", base);
+
+    ChecksumRadState(cache_checksum, false);
+
+    facedeps   = malloc(numfaces * sizeof(facedeps_t));
+    facecached = malloc(numfaces * sizeof(bool));
+    memset(facedeps, 0, numfaces * sizeof(facedeps_t));
+    memset(facecached, 0, numfaces * sizeof(bool));
+
+    lightcluster = malloc(numdlights * sizeof(int32_t));
+    keys         = HashLights(lightcluster);
+    LoadLightCache(keys, lightcluster);
+    free(lightcluster);
+    free(keys);
+}
+
+bool FaceLightCached(int32_t facenum) {
+    return facecached && facecached[facenum];
+}
+
+/*
+=============
+BeginLightDeps / AddLightDepCluster / EndLightDeps
+
+Called from BuildFacelights and GatherSampleLight.  Each face is handled
+by a single thread, so nothing here needs a lock.
+=============
+*/
+void BeginLightDeps(lightdeps_t *deps) {
+    memset(deps, 0, sizeof(*deps));
+    if (!facedeps)
+        return; // not incremental, or a -preview pass
+    deps->lights = malloc((numdlights + 7) >> 3);
+    memset(deps->lights, 0, (numdlights + 7) >> 3);
+}
+
+void AddLightDepCluster(lightdeps_t *deps, vec3_t pos) {
+    int32_t cluster, i;
+
+    if (use_qbsp)
+        cluster = dleafsX[PointInLeafnum(pos)].cluster;
+    else
+        cluster = dleafs[PointInLeafnum(pos)].cluster;
+    if (cluster < 0)
+        return;
+
+    for (i = deps->numclusters - 1; i >= 0; i--) {
+        if (deps->clusters[i] == cluster)
+            return;
+    }
+
+    if (deps->numclusters == deps->maxclusters) {
+        deps->maxclusters = deps->maxclusters ? deps->maxclusters * 2 : 16;
+        deps->clusters    = realloc(deps->clusters, deps->maxclusters * sizeof(int32_t));
+    }
+    deps->clusters[deps->numclusters++] = cluster;
+}
+
+void EndLightDeps(lightdeps_t *deps, int32_t facenum) {
+    facedeps_t *fd;
+    int32_t i;
+
+    if (!deps->lights)
+        return;
+
+    fd = &facedeps[facenum];
+    FreeFaceDeps(fd);
+
+    for (i = 0; i < numdlights; i++) {
+        if (deps->lights[i >> 3] & (1 << (i & 7)))
+            fd->numkeys++;
+    }
+    fd->keys = malloc(fd->numkeys * sizeof(uint64_t));
+    fd->numkeys = 0;
+    for (i = 0; i < numdlights; i++) {
+        if (deps->lights[i >> 3] & (1 << (i & 7)))
+            fd->keys[fd->numkeys++] = lightkeys[i];
+    }
+
+    fd->numclusters = deps->numclusters;
+    fd->clusters    = deps->clusters;
+
+    free(deps->lights);
+    deps->lights   = NULL;
+    deps->clusters = NULL;
+}
+
+/*
+=============
+SaveLightCache
+
+Call once BuildFacelights has run on every face, before the bounces
+touch the patches.
+=============
+*/
+void SaveLightCache(void) {
+    lightcache_header_t header;
+    char tmppath[1040];
+    uint64_t *keys;
+    facedeps_t *fd;
+    patch_t *patch;
+    int32_t i;
+    FILE *f;
+
+    if (!incremental)
+        return;
+
+    memset(&header, 0, sizeof(header));
+    header.ident       = LIGHTCACHE_ID;
+    header.version     = LIGHTCACHE_VERSION;
+    header.numfaces    = numfaces;
+    header.num_patches = num_patches;
+    header.numlights   = numdlights;
+    memcpy(header.checksum, cache_checksum, sizeof(cache_checksum));
+
+    keys = malloc(numdlights * sizeof(uint64_t));
+    memcpy(keys, lightkeys, numdlights * sizeof(uint64_t));
+    qsort(keys, numdlights, sizeof(uint64_t), CompareKeys);
+
+    sprintf(tmppath, "%s.tmp", cache_path);
+    f = SafeOpenWrite(tmppath);
+    SafeWrite(f, &header, sizeof(header));
+    SafeWrite(f, keys, numdlights * sizeof(uint64_t));
+
+    for (i = 0; i < numfaces; i++) {
+        fd = &facedeps[i];
+        SafeWrite(f, &fd->numkeys, sizeof(int32_t));
+        SafeWrite(f, fd->keys, fd->numkeys * sizeof(uint64_t));
+        SafeWrite(f, &fd->numclusters, sizeof(int32_t));
+        SafeWrite(f, fd->clusters, fd->numclusters * sizeof(int32_t));
+        WriteFacelight(f, i);
+        for (patch = face_patches[i]; patch; patch = patch->next) {
+            SafeWrite(f, patch->samplelight, sizeof(vec3_t));
+            SafeWrite(f, &patch->samples, sizeof(int32_t));
+        }
+        FreeFaceDeps(fd);
+    }
+
+    fclose(f);
+    free(keys);
+
+    remove(cache_path);
+    if (rename(tmppath, cache_path))
+        printf("WARNING: couldn't rename %s to %s\n", tmppath, cache_path);
+}
@@ -1372,16 +1372,6 @@ void CalcPoints(lightinfo_t *l, float sofs, float tofs) {
 
 //==============================================================
 
-#define MAX_STYLES 32
-typedef struct
-{
-    int32_t numsamples;
-    float *origins;
-    int32_t numstyles;
-    int32_t stylenums[MAX_STYLES];
-    float *samples[MAX_STYLES];
-} facelight_t;
-
 directlight_t *directlights[MAX_MAP_LEAFS_QBSP];
 facelight_t facelight[MAX_MAP_FACES_QBSP];
 int32_t numdlights;
@@ -1496,6 +1486,7 @@ void CreateDirectLights(void) {
         numdlights++;
         dl = malloc(sizeof(directlight_t));
         memset(dl, 0, sizeof(*dl));
+        dl->index = numdlights - 1;
 
         GetVectorForKey(e, "origin", dl->origin);
         dl->style = FloatForKey(e, "_style");
@@ -1607,6 +1598,7 @@ void CreateDirectLights(void) {
         numdlights++;
         dl = malloc(sizeof(directlight_t));
         memset(dl, 0, sizeof(*dl));
+        dl->index = numdlights - 1;
 
         VectorCopy(p->origin, dl->origin);
 
@@ -1699,6 +1691,103 @@ re_test:
     goto re_test;
 }
 
+/*
+==============================================================================
+
+SUN VISIBILITY MASK
+
+The sun is one direction, so whether a texel sees it changes slowly across
+a face.  With -sunmask N, the first time a face needs the sun through a
+given sky plane the texels on an N texel lattice are traced in one pass.  A
+texel inside a lattice cell whose four corners agree takes their answer;
+only texels in cells that straddle a shadow edge are traced.
+
+Shadows thinner than a cell can be lost, so this is off by default.
+
+==============================================================================
+*/
+
+#define SUNMASK_PLANES 8
+
+int32_t sunmask_step = 0; // qb: -sunmask, 0 traces every texel
+
+typedef struct
+{
+    dplane_t *plane;
+    uint8_t *visible; // per texel, only lattice texels are set
+} sunplanemask_t;
+
+typedef struct
+{
+    vec3_t *points; // texel positions, liteinfo[0].surfpt
+    int32_t w, h;
+    int32_t texel; // texel being lit
+    int32_t numplanes;
+    sunplanemask_t planes[SUNMASK_PLANES];
+} sunmask_t;
+
+static bool TraceSun(dplane_t *plane, vec3_t pos) {
+    vec3_t target, occluded;
+
+    if (!RayPlaneIntersect(plane->normal, plane->dist, pos, sun_pos, target))
+        return false;
+    return !TestLine_color(0, pos, target, occluded);
+}
+
+static sunplanemask_t *SunPlaneMask(sunmask_t *sm, dplane_t *plane) {
+    sunplanemask_t *pm;
+    int32_t i, s, t;
+
+    for (i = 0; i < sm->numplanes; i++)
+        if (sm->planes[i].plane == plane)
+            return &sm->planes[i];
+    if (sm->numplanes == SUNMASK_PLANES)
+        return NULL;
+
+    pm          = &sm->planes[sm->numplanes++];
+    pm->plane   = plane;
+    pm->visible = malloc(sm->w * sm->h);
+    for (t = 0; t < sm->h; t++) {
+        if (t % sunmask_step && t != sm->h - 1)
+            continue;
+        for (s = 0; s < sm->w; s++) {
+            if (s % sunmask_step && s != sm->w - 1)
+                continue;
+            pm->visible[t * sm->w + s] = TraceSun(plane, sm->points[t * sm->w + s]);
+        }
+    }
+    return pm;
+}
+
+static bool SunVisible(sunmask_t *sm, dplane_t *plane, vec3_t pos) {
+    sunplanemask_t *pm;
+    int32_t s, t, s0, s1, t0, t1;
+    uint8_t v;
+
+    if (!sm || !(pm = SunPlaneMask(sm, plane)))
+        return TraceSun(plane, pos);
+
+    s  = sm->texel % sm->w;
+    t  = sm->texel / sm->w;
+    s0 = s - s % sunmask_step;
+    s1 = (s0 + sunmask_step < sm->w - 1) ? s0 + sunmask_step : sm->w - 1;
+    t0 = t - t % sunmask_step;
+    t1 = (t0 + sunmask_step < sm->h - 1) ? t0 + sunmask_step : sm->h - 1;
+    v  = pm->visible[t0 * sm->w + s0];
+    if (pm->visible[t0 * sm->w + s1] != v || pm->visible[t1 * sm->w + s0] != v ||
+        pm->visible[t1 * sm->w + s1] != v)
+        return TraceSun(plane, pos); // near a shadow edge
+    return v;
+}
+
+static void FreeSunMask(sunmask_t *sm) {
+    int32_t i;
+
+    for (i = 0; i < sm->numplanes; i++)
+        free(sm->planes[i].visible);
+    sm->numplanes = 0;
+}
+
 /*
 =============
 LightContributionToPoint
@@ -1708,8 +1797,9 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
                                      vec3_t normal, vec3_t color,
                                      float lightscale2,
                                      bool *sun_main_once,
-                                     bool *sun_ambient_once) {
-    vec3_t delta, target, occluded, colorsky = {0, 0, 0};
+                                     bool *sun_ambient_once,
+                                     sunmask_t *sunmask) {
+    vec3_t delta, occluded, colorsky = {0, 0, 0};
     float dot, dot2;
     float dist;
     float scale = 0.0f;
@@ -1750,9 +1840,7 @@ static void LightContributionToPoint(directlight_t *l, vec3_t pos, int32_t noden
                 set_main = true;
                 main_val = sun_main * dot2;
                 if (!noblock) {
-                    if (!RayPlaneIntersect(
-                            l->plane->normal, l->plane->dist, pos, sun_pos, target) ||
-                        TestLine_color(0, pos, target, occluded)) {
+                    if (!SunVisible(sunmask, l->plane, pos)) {
                         set_main = *sun_main_once;
                         main_val = 0.0f;
                     } else {
@@ -1874,7 +1962,8 @@ Lightscale2 is the normalizer for multisampling, -extra cmd line arg
 
 void GatherSampleLight(vec3_t pos, vec3_t normal,
                        float **styletable, int32_t offset, int32_t mapsize, float lightscale2,
-                       bool *sun_main_once, bool *sun_ambient_once, uint8_t *pvs) {
+                       bool *sun_main_once, bool *sun_ambient_once, uint8_t *pvs,
+                       lightdeps_t *deps, sunmask_t *sunmask) {
     int32_t i;
     directlight_t *l;
     float *dest;
@@ -1886,6 +1975,8 @@ void GatherSampleLight(vec3_t pos, vec3_t normal,
         return;
     }
     nodenum = PointInNodenum(pos);
+    if (deps->lights)
+        AddLightDepCluster(deps, pos);
 
     for (i = 0; i < dvis->numclusters; i++) {
         if (!(pvs[i >> 3] & (1 << (i & 7))))
@@ -1893,12 +1984,15 @@ void GatherSampleLight(vec3_t pos, vec3_t normal,
 
         for (l = directlights[i]; l; l = l->next) {
             LightContributionToPoint(l, pos, nodenum, normal, color, lightscale2,
-                                     sun_main_once, sun_ambient_once);
+                                     sun_main_once, sun_ambient_once, sunmask);
 
             // no contribution
             if (VectorCompare(color, vec3_origin))
                 continue;
 
+            if (deps->lights)
+                deps->lights[l->index >> 3] |= 1 << (l->index & 7);
+
             // if this style doesn't have a table yet, allocate one
             if (!styletable[l->style]) {
                 styletable[l->style] = malloc(mapsize);
@@ -2156,6 +2250,66 @@ static bool NudgeSamplePosition(const vec3_t in, const vec3_t normal, const vec3
     return PvsForOrigin(out, pvs);
 }
 
+/*
+=============
+OnLightLattice
+
+-preview lights every stride'th texel plus the last row and column of the
+face.  Everything in between is interpolated.
+=============
+*/
+int32_t facelight_stride = 1;
+facelight_t *prevfacelight; // qb: previous -preview pass
+int32_t prevfacelight_stride;
+
+static inline bool OnLightLattice(int32_t s, int32_t t, int32_t w, int32_t h, int32_t stride) {
+    return (s % stride == 0 || s == w - 1) && (t % stride == 0 || t == h - 1);
+}
+
+static void ReusePreviewSample(facelight_t *prev, float **styletable, int32_t i, int32_t tablesize) {
+    int32_t st;
+    float *dest;
+
+    for (st = 0; st < prev->numstyles; st++) {
+        dest = styletable[prev->stylenums[st]];
+        if (!dest) {
+            dest = styletable[prev->stylenums[st]] = malloc(tablesize);
+            memset(dest, 0, tablesize);
+        }
+        VectorCopy((prev->samples[st] + i * 3), (dest + i * 3));
+    }
+}
+
+static void InterpolateLattice(float **styletable, int32_t w, int32_t h, int32_t stride) {
+    int32_t k, s, t, s0, s1, t0, t1, j;
+    float fs, ft;
+    float *table, *a, *b, *c, *d;
+
+    for (k = 0; k < MAX_LSTYLES; k++) {
+        table = styletable[k];
+        if (!table)
+            continue;
+        for (t = 0; t < h; t++) {
+            t0 = t - t % stride;
+            t1 = (t0 + stride < h - 1) ? t0 + stride : h - 1;
+            ft = (t1 > t0) ? (float)(t - t0) / (t1 - t0) : 0;
+            for (s = 0; s < w; s++) {
+                if (OnLightLattice(s, t, w, h, stride))
+                    continue;
+                s0 = s - s % stride;
+                s1 = (s0 + stride < w - 1) ? s0 + stride : w - 1;
+                fs = (s1 > s0) ? (float)(s - s0) / (s1 - s0) : 0;
+                a  = table + (t0 * w + s0) * 3;
+                b  = table + (t0 * w + s1) * 3;
+                c  = table + (t1 * w + s0) * 3;
+                d  = table + (t1 * w + s1) * 3;
+                for (j = 0; j < 3; j++)
+                    table[(t * w + s) * 3 + j] = (a[j] * (1 - fs) + b[j] * fs) * (1 - ft) + (c[j] * (1 - fs) + d[j] * fs) * ft;
+            }
+        }
+    }
+}
+
 /*
 =============
 BuildFacelights
@@ -2177,9 +2331,18 @@ void BuildFacelights(int32_t facenum) {
     vec_t *center;
     vec3_t pos;
     vec3_t pointnormal;
+    lightdeps_t deps;
+    int32_t w, h;
+    facelight_t *prev;
+    sunmask_t sunmask;
+
+    // qb: -incremental, restored from the light cache
+    if (FaceLightCached(facenum))
+        return;
 
     liteinfo = malloc(sizeof(*liteinfo) * 5);
     styletable = malloc(sizeof(*styletable) * MAX_LSTYLES);
+    BeginLightDeps(&deps);
 
     if (use_qbsp) {
         dface_tx *this_face;
@@ -2255,9 +2418,36 @@ void BuildFacelights(int32_t facenum) {
     memcpy(fl->origins, liteinfo[0].surfpt, tablesize);
     center = face_extents[facenum].center; // center of the face
 
+    // qb: -preview, texels of the last pass are taken as they are unless
+    // fullbright or style truncation changed them afterwards
+    w    = liteinfo[0].texsize[0] + 1;
+    h    = liteinfo[0].texsize[1] + 1;
+    prev = NULL;
+    if (prevfacelight && numsamples == 1) {
+        prev = &prevfacelight[facenum];
+        if (prev->numsamples != fl->numsamples || prev->numstyles >= MAXLIGHTMAPS ||
+            face_patches[facenum]->baselight[0] >= DIRECT_LIGHT ||
+            face_patches[facenum]->baselight[1] >= DIRECT_LIGHT ||
+            face_patches[facenum]->baselight[2] >= DIRECT_LIGHT)
+            prev = NULL;
+    }
+
+    sunmask.points    = liteinfo[0].surfpt;
+    sunmask.w         = w;
+    sunmask.h         = h;
+    sunmask.numplanes = 0;
+
     for (i = 0; i < liteinfo[0].numsurfpt; i++) {
         sun_ambient_once = false;
         sun_main_once    = false;
+        sunmask.texel    = i;
+
+        if (facelight_stride > 1 && !OnLightLattice(i % w, i / w, w, h, facelight_stride))
+            continue; // interpolated below
+        if (prev && OnLightLattice(i % w, i / w, w, h, prevfacelight_stride)) {
+            ReusePreviewSample(prev, styletable, i, tablesize);
+            continue;
+        }
 
         for (j = 0; j < numsamples; j++) {
             uint8_t pvs[(MAX_MAP_LEAFS_QBSP + 7) / 8];
@@ -2276,12 +2466,18 @@ void BuildFacelights(int32_t facenum) {
                 VectorCopy(liteinfo[0].facenormal, pointnormal);
 
             GatherSampleLight(pos, pointnormal, styletable, i * 3, tablesize, 1.0 / numsamples,
-                              &sun_main_once, &sun_ambient_once, pvs);
+                              &sun_main_once, &sun_ambient_once, pvs, &deps,
+                              sunmask_step > 1 ? &sunmask : NULL);
         }
+    }
+    FreeSunMask(&sunmask);
 
-        // contribute the sample to one or more patches
+    if (facelight_stride > 1)
+        InterpolateLattice(styletable, w, h, facelight_stride);
+
+    // contribute the samples to one or more patches
+    for (i = 0; i < liteinfo[0].numsurfpt; i++)
         AddSampleToPatch(liteinfo[0].surfpt[i], styletable[0] + i * 3, facenum);
-    }
 
     // average up the direct light on each patch for radiosity
     for (patch = face_patches[facenum]; patch; patch = patch->next) {
@@ -2312,6 +2508,7 @@ void BuildFacelights(int32_t facenum) {
     }
 
 cleanup:
+    EndLightDeps(&deps, facenum);
     free(liteinfo);
     free(styletable);
 }
@@ -31,9 +31,14 @@ static char *help_string =
     "    -basedir [path]: Set the directory for assets not in moddir. Default is moddir.\n"
     "    -gamedir [path]: Set game directory, the folder with game executable.\n"
     "    -v: Display more verbose output.\n"
-    "    -threads #: number of CPU threads to use\n\n"
+    "    -threads #: number of CPU threads to use\n"
+    "    -chain: Hand the bsp and portals from pass to pass in memory.\n"
+    "        Only the last pass writes the .bsp, the portal file is skipped.\n"
+    "    -notexcache: Don't keep texture flags and colours in moddir/q2tool_textures.cache.\n\n"
     "BSP pass:\n"
     "    -bsp: enable bsp pass, requires a .map file as input\n"
+    "    -binportals: Also write a binary .prb for vis next to the text .prt.\n"
+    "    -keepportals: With -chain, still write the portal files.\n"
     "    -chop #: Subdivide size.\n"
     "        Default: 240  Range: 32-1024\n"
     "    -choplight #: Subdivide size for surface lights.\n"
@@ -62,7 +67,12 @@ static char *help_string =
     "    -onlyents: Grab the entites and resave.\n\n"
     "VIS pass:\n"
     "    -vis: enable vis pass, requires a .bsp file as input or bsp pass enabled\n"
-    "    -fast: fast single vis pass\n\n"
+    "    -better #: Tighten mightsee first with a flow # leafs deep.\n"
+    "    -fast: fast single vis pass\n"
+    "    -incremental: Keep a vis cache and only reflow portals near changed geometry.\n"
+    "    -level #: 0 is -fast, 1 to 3 limit the flow to 4, 8 or 12 leafs deep,\n"
+    "         4 is full vis.  Default: 4\n"
+    "    -reuse: Bound mightsee by finished neighbour portals and flow the smallest first.\n\n"
     "RAD pass:\n"
     "    -rad: enable rad pass, requires a .bsp file as input or bsp and vis passes enabled\n"
     "    -ambient #: Minimum light level.\n"
@@ -71,22 +81,31 @@ static char *help_string =
     "    -basedir [path]: Set the directory for assets not in moddir. Default is moddir.\n"
     "    -gamedir [path]: Set game directory, the folder with game executable.\n"
     "    -bounce #: Max number of light bounces for radiosity.\n"
+    "    -coordinator [addr]: Light the map with help from -worker processes.\n"
+    "         addr is unix:/path or host:port.\n"
     "    -dice: Subdivide patches with a global grid rather than per patch.\n"
     "    -direct #: Direct light scale factor.\n"
     "    -entity #: Entity light scale factor.\n"
     "    -extra: Use extra samples to smooth lighting.\n"
+    "    -incremental: Keep a light cache and only relight faces touched by changed lights.\n"
     "    -maxdata #: 2097152 is default max. Not needed for QBSP format.\n"
     "         Increase requires a supporting engine.\n"
     "    -maxlight #: Maximium light level.\n"
     "         range:  0 to 255.\n"
+    "    -nocheckpoint: Don't save vis or rad state for -resume.\n"
     "    -noedgefix: disable dark edges at sky fix. More of a hack, really.\n"
     "    -nudge #: Nudge factor for samples. Distance fraction from center.\n"
+    "    -preview #: Write quick previews lit every #th texel first, then refine.\n"
+    "    -resume: Continue an interrupted vis or rad run from its last checkpoint.\n"
     "    -saturate #: Saturation factor of light bounced off surfaces.\n"
     "    -scale #: Light intensity multiplier.\n"
     "    -smooth #: Threshold angle (# and 180deg - #) for phong smoothing.\n"
     "    -subdiv #: Maximum patch size.  Default: 64\n"
+    "    -sunmask #: Trace the sun on a # texel lattice, then only near shadow edges.\n"
+    "         Faster outdoors, may lose shadows thinner than # texels.\n"
     "    -sunradscale #: Sky light intensity scale when sun is active.\n"
     "    -threads #:  Number of CPU cores to use.\n"
+    "    -worker [addr]: Help a -coordinator light the same map.\n"
     "rad debugging options:\n"
     "    -dump: Dump patches to a text file.\n"
     "    -noblock: Brushes don't block lighting path.\n"
@@ -96,6 +115,8 @@ static char *help_string =
 extern bool h2tex;
 extern bool origfix;
 extern bool noweld;
+extern bool binary_portals;
+extern bool keep_portals;
 extern bool nocsg;
 extern bool noshare;
 extern bool notjunc;
@@ -112,6 +133,7 @@ extern bool use_qbsp;
 extern int32_t max_entities;
 extern int32_t max_bounds;
 extern int32_t block_size;
+extern int32_t model_threads;
 extern bool noskipfix;
 extern float subdivide_size;
 extern float subdiv;
@@ -122,8 +144,14 @@ extern int32_t block_xh;
 extern int32_t block_yh;
 extern char inbase[32];
 extern char outbase[32];
+extern bool hold_bsp;
+extern bool notexcache;
+extern bool bsp_in_memory;
 
 extern bool fastvis;
+extern int32_t vislevel;
+extern int32_t better_depth;
+extern bool reuse_vis;
 
 extern bool nosort;
 extern bool dumppatches;
@@ -145,6 +173,11 @@ extern float maxlight;
 extern bool dicepatches;
 extern float saturation;
 extern bool nopvs;
+extern bool checkpoint;
+extern int32_t sunmask_step;
+extern int32_t preview_stride;
+extern char rad_coordinator[256];
+extern char rad_worker[256];
 
 // data
 extern bool g_compress_pak;
@@ -174,6 +207,7 @@ int32_t main(int32_t argc, char *argv[]) {
     bool do_vis  = false;
     bool do_rad  = false;
     bool do_data = false;
+    bool chain   = false;
 
     ThreadSetDefault();
 
@@ -202,6 +236,18 @@ int32_t main(int32_t argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-noweld")) {
             printf("noweld = true\n");
             noweld = true;
+        } else if (!strcmp(argv[i], "-notexcache")) {
+            printf("texture cache = false\n");
+            notexcache = true;
+        } else if (!strcmp(argv[i], "-chain")) {
+            printf("chain passes in memory = true\n");
+            chain = true;
+        } else if (!strcmp(argv[i], "-binportals")) {
+            printf("binary portals = true\n");
+            binary_portals = true;
+        } else if (!strcmp(argv[i], "-keepportals")) {
+            printf("keep portal file = true\n");
+            keep_portals = true;
         } else if (!strcmp(argv[i], "-nocsg")) {
             printf("nocsg = true\n");
             nocsg = true;
@@ -333,6 +379,17 @@ int32_t main(int32_t argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-fast")) {
             printf("fastvis = true\n");
             fastvis = true;
+        } else if (!strcmp(argv[i], "-better")) {
+            better_depth = BOUND(0, atoi(argv[i + 1]), 64);
+            printf("BetterPortalVis depth = %i\n", better_depth);
+            i++;
+        } else if (!strcmp(argv[i], "-level")) {
+            vislevel = BOUND(0, atoi(argv[i + 1]), 4);
+            printf("vis level = %i\n", vislevel);
+            i++;
+        } else if (!strcmp(argv[i], "-reuse")) {
+            printf("reuse = true\n");
+            reuse_vis = true;
         } else if (!strcmp(argv[i], "-nosort")) {
             printf("nosort = true\n");
             nosort = true;
@@ -392,6 +449,10 @@ int32_t main(int32_t argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-nopvs")) {
             nopvs = true;
             printf("nopvs = true\n");
+        } else if (!strcmp(argv[i], "-sunmask")) {
+            sunmask_step = BOUND(2, atoi(argv[i + 1]), 16);
+            printf("sunmask = %i\n", sunmask_step);
+            i++;
         } else if (!strcmp(argv[i], "-noblock")) {
             noblock = true;
             printf("noblock = true\n");
@@ -409,6 +470,27 @@ int32_t main(int32_t argc, char *argv[]) {
         } else if (!strcmp(argv[i], "-savetrace")) {
             save_trace = true;
             printf("savetrace = true\n");
+        } else if (!strcmp(argv[i], "-resume")) {
+            resume = true;
+            printf("resume = true\n");
+        } else if (!strcmp(argv[i], "-preview")) {
+            preview_stride = BOUND(1, atoi(argv[i + 1]), 64);
+            printf("preview stride = %i\n", preview_stride);
+            i++;
+        } else if (!strcmp(argv[i], "-incremental")) {
+            incremental = true;
+            printf("incremental = true\n");
+        } else if (!strcmp(argv[i], "-coordinator")) {
+            strncpy(rad_coordinator, argv[i + 1], sizeof(rad_coordinator) - 1);
+            printf("coordinator = %s\n", rad_coordinator);
+            i++;
+        } else if (!strcmp(argv[i], "-worker")) {
+            strncpy(rad_worker, argv[i + 1], sizeof(rad_worker) - 1);
+            printf("worker = %s\n", rad_worker);
+            i++;
+        } else if (!strcmp(argv[i], "-nocheckpoint")) {
+            checkpoint = false;
+            printf("checkpoint = false\n");
         } else if (!strcmp(argv[i], "-maxlight")) {
             maxlight = BOUND(0, atof(argv[i + 1]), 255);
             i++;
@@ -453,19 +535,27 @@ int32_t main(int32_t argc, char *argv[]) {
                "For complete options list:  q2tool -help\n"
                "-bsp\n"
                "    -chop #                  -choplight #         -qbsp \n"
-               "    -largebounds             -micro #             -nosubdiv\n\n"
+               "    -largebounds             -micro #             -nosubdiv\n"
+               "    -binportals              -keepportals\n\n"
                "-vis\n"
-               "    -fast                    -threads #\n\n"
+               "    -fast                    -threads #\n"
+               "    -level #                 -better #\n"
+               "    -reuse\n\n"
                "-rad\n"
                "    -ambient #            -bounce #\n"
                "    -dice                 -direct #           -entity #\n"
                "    -extra                -help               -maxdata #\n"
                "    -maxlight #           -noedgefix          -nudge #\n"
                "    -saturate #           -scale #            -smooth #\n"
-               "    -subdiv               -sunradscale #      -threads #\n\n"
+               "    -subdiv               -sunradscale #      -threads #\n"
+               "    -resume               -nocheckpoint       -incremental\n"
+               "    -preview #            -coordinator [addr] -worker [addr]\n"
+               "    -sunmask #\n\n"
                "-data\n"
                "    -archive [path]         -release [path]       -only [model]\n"
                "    -3ds                    -lwo                  -compress\n\n"
+               "all passes:\n"
+               "    -chain                  -notexcache\n\n"
                "set paths:\n"
                "    -basedir [path]         -moddir [path]        -gamedir [path]\n\n");
 
@@ -507,20 +597,28 @@ int32_t main(int32_t argc, char *argv[]) {
         printf("basedir = %s\n", basedir);
         printf("gamedir = %s\n\n", gamedir);
 
+        // qb: -chain keeps each pass's bsp in memory for the next one.  The
+        // rad coordinator's workers load the bsp from disk, so vis writes it.
+        bsp_in_memory = false;
+
         if (do_bsp) {
             int32_t old_numthreads = numthreads;
             // qb: below is from original source release.  On Windows, multi threads cause false leak errors.
-            numthreads             = 1; // multiple threads aren't helping...
+            model_threads          = numthreads; // submodels don't flood, they still get threads
+            numthreads             = 1;          // multiple threads aren't helping...
+            hold_bsp = chain && (do_vis || do_rad);
             printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< BEGIN bsp >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
             BSP_ProcessArgument(argv[i]);
             numthreads = old_numthreads;
         }
         if (do_vis || (do_bsp && do_rad)) {
+            hold_bsp = chain && do_rad && !rad_coordinator[0];
             printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< BEGIN vis >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
             VIS_ProcessArgument(argv[i]);
         }
 
         if (do_rad) {
+            hold_bsp = false;
             printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< BEGIN rad >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
             RAD_ProcessArgument(argv[i]);
         }
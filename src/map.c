@@ -20,6 +20,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "qbsp.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 extern bool onlyents;
 
 int32_t nummapbrushes;
@@ -32,8 +36,12 @@ brush_texture_t side_brushtextures[MAX_MAP_SIDES];
 int32_t nummapplanes;
 plane_t mapplanes[MAX_MAP_PLANES_QBSP];
 
-#define PLANE_HASHES 1024
+// qb: planes hash on their normal and dist rounded to cells, see FindFloatPlane
+#define PLANE_HASH_BITS 14
+#define PLANE_HASHES    (1 << PLANE_HASH_BITS)
+#define PLANE_NORMAL_Q  64.0 // normal cells per unit
 plane_t *planehash[PLANE_HASHES];
+static threadmutex_t *planemutex;
 
 vec3_t map_mins, map_maxs;
 
@@ -102,19 +110,49 @@ bool PlaneEqual(plane_t *p, vec3_t normal, vec_t dist) {
     return false;
 }
 
+/*
+================
+PlaneCell
+
+Rounds to the nearest cell, so axial normals and integral dists sit in the
+middle of one.
+================
+*/
+static inline int32_t PlaneCell(vec_t v, vec_t scale) {
+    return (int32_t)floor(v * scale + 0.5);
+}
+
+static inline int32_t PlaneHash(const int32_t *cell) {
+    uint32_t h;
+
+    h = (uint32_t)cell[0] * 73856093u ^ (uint32_t)cell[1] * 19349663u ^
+        (uint32_t)cell[2] * 83492791u ^ (uint32_t)cell[3] * 2654435761u;
+    return (h ^ (h >> PLANE_HASH_BITS)) & (PLANE_HASHES - 1);
+}
+
 /*
 ================
 AddPlaneToHash
+
+p is filled in before it is linked, so FindFloatPlane can walk the chains
+without the lock.
 ================
 */
 void AddPlaneToHash(plane_t *p) {
-    int32_t hash;
+    int32_t cell[4], hash;
 
-    hash = (int32_t)fabs(p->dist) / 8;
-    hash &= (PLANE_HASHES - 1);
+    cell[0] = PlaneCell(p->normal[0], PLANE_NORMAL_Q);
+    cell[1] = PlaneCell(p->normal[1], PLANE_NORMAL_Q);
+    cell[2] = PlaneCell(p->normal[2], PLANE_NORMAL_Q);
+    cell[3] = PlaneCell(p->dist, 1);
+    hash    = PlaneHash(cell);
 
-    p->hash_chain   = planehash[hash];
-    planehash[hash] = p;
+    p->hash_chain = planehash[hash];
+#ifdef _MSC_VER
+    _InterlockedExchangePointer((void *volatile *)&planehash[hash], p);
+#else
+    __atomic_store_n(&planehash[hash], p, __ATOMIC_RELEASE);
+#endif
 }
 
 /*
@@ -197,32 +235,90 @@ void SnapPlane(vec3_t normal, vec_t *dist) {
         *dist = Q_rint(*dist);
 }
 
+/*
+=============
+SearchPlaneHash
+
+Looks in every cell within NORMAL_EPSILON / DIST_EPSILON of the plane.
+If more than one plane is equal, the one the old fabs(dist) / 8 bins
+returned is kept: lowest bin first, then the newest plane.
+=============
+*/
+static plane_t *SearchPlaneHash(vec3_t normal, vec_t dist) {
+    int32_t lo[4], hi[4], cell[4];
+    int32_t i, bin, order, bestorder;
+    plane_t *p, *best;
+
+    for (i = 0; i < 3; i++) {
+        lo[i] = PlaneCell(normal[i] - NORMAL_EPSILON, PLANE_NORMAL_Q);
+        hi[i] = PlaneCell(normal[i] + NORMAL_EPSILON, PLANE_NORMAL_Q);
+    }
+    lo[3] = PlaneCell(dist - DIST_EPSILON, 1);
+    hi[3] = PlaneCell(dist + DIST_EPSILON, 1);
+
+    bin       = (int32_t)fabs(dist) / 8;
+    best      = NULL;
+    bestorder = 0;
+    memcpy(cell, lo, sizeof(cell));
+    while (1) {
+#ifdef _MSC_VER
+        p = _InterlockedCompareExchangePointer((void *volatile *)&planehash[PlaneHash(cell)], NULL, NULL);
+#else
+        p = __atomic_load_n(&planehash[PlaneHash(cell)], __ATOMIC_ACQUIRE);
+#endif
+        for (; p; p = p->hash_chain) {
+            if (!PlaneEqual(p, normal, dist))
+                continue;
+            order = (((int32_t)fabs(p->dist) / 8 - bin + 1) & 1023);
+            if (!best || order < bestorder || (order == bestorder && p > best)) {
+                best      = p;
+                bestorder = order;
+            }
+        }
+
+        // step to the next cell
+        for (i = 0; i < 4; i++) {
+            if (cell[i] < hi[i]) {
+                cell[i]++;
+                break;
+            }
+            cell[i] = lo[i];
+        }
+        if (i == 4)
+            break;
+    }
+
+    return best;
+}
+
 /*
 =============
 FindFloatPlane
 
+Lookups don't lock.  A miss takes planemutex and looks again before adding
+the plane, so two threads can't both create it.
 =============
 */
 
 int32_t FindFloatPlane(vec3_t normal, vec_t dist, int32_t bnum) {
-    int32_t i;
     plane_t *p;
-    int32_t hash, h;
+    int32_t planenum;
 
     SnapPlane(normal, &dist);
-    hash = (int32_t)fabs(dist) / 8;
-    hash &= (PLANE_HASHES - 1);
-
-    // search the border bins as well
-    for (i = -1; i <= 1; i++) {
-        h = (hash + i) & (PLANE_HASHES - 1);
-        for (p = planehash[h]; p; p = p->hash_chain) {
-            if (PlaneEqual(p, normal, dist))
-                return p - mapplanes;
-        }
-    }
 
-    return CreateNewFloatPlane(normal, dist, bnum);
+    p = SearchPlaneHash(normal, dist);
+    if (p)
+        return p - mapplanes;
+
+    ThreadMutexLock(planemutex);
+    p = SearchPlaneHash(normal, dist);
+    if (p)
+        planenum = p - mapplanes;
+    else
+        planenum = CreateNewFloatPlane(normal, dist, bnum);
+    ThreadMutexUnlock(planemutex);
+
+    return planenum;
 }
 
 /*
@@ -530,10 +626,8 @@ void ParseBrush(entity_t *mapent) {
             if (strcmp(token, "("))
                 Error("parsing brush %i", i + 1);
 
-            for (j = 0; j < 3; j++) {
-                GetToken(false);
-                planepts[i][j] = atof(token);
-            }
+            for (j = 0; j < 3; j++)
+                planepts[i][j] = GetTokenFloat(false);
 
             GetToken(false);
             if (strcmp(token, ")"))
@@ -552,10 +646,8 @@ void ParseBrush(entity_t *mapent) {
         // DarkEssence: take parms according to mapversion
         if (g_nMapFileVersion < 220) // old #mapversion
         {
-            GetToken(false);
-            td.shift[0] = atoi(token);
-            GetToken(false);
-            td.shift[1] = atoi(token);
+            td.shift[0] = GetTokenInt(false);
+            td.shift[1] = GetTokenInt(false);
         } else // new #mapversion
         {
             GetToken(false);
@@ -563,14 +655,10 @@ void ParseBrush(entity_t *mapent) {
                 Error("missing '[ in texturedef");
             }
 
-            GetToken(false);
-            UVaxis[0] = atof(token);
-            GetToken(false);
-            UVaxis[1] = atof(token);
-            GetToken(false);
-            UVaxis[2] = atof(token);
-            GetToken(false);
-            td.shift[0] = atof(token);
+            UVaxis[0]   = GetTokenFloat(false);
+            UVaxis[1]   = GetTokenFloat(false);
+            UVaxis[2]   = GetTokenFloat(false);
+            td.shift[0] = GetTokenFloat(false);
 
             GetToken(false);
             if (strcmp(token, "]")) {
@@ -583,14 +671,10 @@ void ParseBrush(entity_t *mapent) {
                 Error("missing '[ in texturedef");
             }
 
-            GetToken(false);
-            UVaxis[3] = atof(token);
-            GetToken(false);
-            UVaxis[4] = atof(token);
-            GetToken(false);
-            UVaxis[5] = atof(token);
-            GetToken(false);
-            td.shift[1] = atof(token);
+            UVaxis[3]   = GetTokenFloat(false);
+            UVaxis[4]   = GetTokenFloat(false);
+            UVaxis[5]   = GetTokenFloat(false);
+            td.shift[1] = GetTokenFloat(false);
 
             GetToken(false);
             if (strcmp(token, "]")) {
@@ -598,12 +682,9 @@ void ParseBrush(entity_t *mapent) {
             }
         }
 
-        GetToken(false);
-        td.rotate = atoi(token);
-        GetToken(false);
-        td.scale[0] = atof(token);
-        GetToken(false);
-        td.scale[1]    = atof(token);
+        td.rotate   = GetTokenInt(false);
+        td.scale[0] = GetTokenFloat(false);
+        td.scale[1] = GetTokenFloat(false);
 
         // find default flags and values
         mt             = FindMiptex(td.name);
@@ -613,12 +694,9 @@ void ParseBrush(entity_t *mapent) {
         side->surf = td.flags = textureref[mt].flags;
 
         if (TokenAvailable()) {
-            GetToken(false);
-            side->contents = atoi(token);
-            GetToken(false);
-            side->surf = td.flags = atoi(token);
-            GetToken(false);
-            td.value = atoi(token);
+            side->contents = GetTokenInt(false);
+            side->surf     = td.flags = GetTokenInt(false);
+            td.value       = GetTokenInt(false);
         }
 
         // translucent objects are automatically classified as detail
@@ -918,6 +996,8 @@ void LoadMapFile(char *filename) {
 
     LoadScriptFile(filename);
 
+    if (!planemutex)
+        planemutex = ThreadMutexCreate();
     nummapbrushsides = 0;
     num_entities     = 0;
 
@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "qrad.h"
+#include "texcache.h"
 
 vec3_t texture_reflectivity[MAX_MAP_TEXINFO_QBSP];
 
@@ -118,6 +119,43 @@ void CalcTextureReflectivity_Heretic2( void ){
 	}
 }
 
+// qb: what CalcTextureReflectivity keeps in the texture cache
+enum {
+    REFLECT_COLOR,  // color is the average before saturation
+    REFLECT_NOTFOUND,
+    REFLECT_EMPTY   // tga without texels
+};
+
+typedef struct
+{
+    int32_t status;
+    int32_t source; // ReflectivityPath
+    float color[3];
+} reflectinfo_t;
+
+#define REFLECT_SOURCES 3
+
+/*
+======================
+ReflectivityPath
+
+The files CalcTextureReflectivity tries, in order.
+======================
+*/
+static void ReflectivityPath(char *path, int32_t source, char *texture) {
+    switch (source) {
+    case 0:
+        sprintf(path, "%stextures/%s.tga", moddir, texture);
+        break;
+    case 1:
+        sprintf(path, "%stextures/%s.wal", moddir, texture);
+        break;
+    default:
+        sprintf(path, "%stextures/%s.wal", basedir, texture);
+        break;
+    }
+}
+
 /*
 ======================
 CalcTextureReflectivity
@@ -126,7 +164,10 @@ CalcTextureReflectivity
 void CalcTextureReflectivity(void) {
     int32_t i, j, k, count;
     int32_t texels, texel;
+    int32_t alphaflags;
     bool wal_tex;
+    texcachekey_t key;
+    reflectinfo_t info;
     float color[3], cur_color[3], tex_a, a;
     char path[1200];
     float *r, *g, *b;
@@ -155,7 +196,7 @@ void CalcTextureReflectivity(void) {
             Load256Image(path, NULL, &palette, NULL, NULL);
         } else if((i = TryLoadFileFromPak("pics/colormap.pcx", (void **)&palette_frompak, moddir)) != -1) {
             // unicat: load from pack files, palette is loaded from the last 768 bytes
-            palette = palette_frompak - (i - 768);
+            palette = palette_frompak + (i - 768);
         } else {
             Error("unable to load pics/colormap.pcx");
         }
@@ -185,16 +226,46 @@ void CalcTextureReflectivity(void) {
         if (j != i)
             continue;
 
+        // qb: a warm compile takes the average colour from the texture cache.
+        // The alpha weighting of a tga depends on the surface flags.
+        TexCacheKeyBegin(&key, "reflectivity", texinfo[i].texture);
+        for (j = 0; j < REFLECT_SOURCES; j++) {
+            ReflectivityPath(path, j, texinfo[i].texture);
+            TexCacheKeyFile(&key, path);
+        }
+        alphaflags = texinfo[i].flags & (SURF_WARP | SURF_NODRAW | SURF_ALPHATEST | SURF_TRANS33 | SURF_TRANS66);
+        TexCacheKeyData(&key, &alphaflags, sizeof(alphaflags));
+        TexCacheKeyData(&key, palette, 768);
+
+        if (TexCacheFind(&key, &info, sizeof(info))) {
+            ReflectivityPath(path, info.source, texinfo[i].texture);
+            if (info.status == REFLECT_NOTFOUND) {
+                qprintf("NOT FOUND %s\n", path);
+                continue;
+            }
+            if (info.status == REFLECT_EMPTY) {
+                qprintf("tex %i (%s) no rgba data (file broken?)\n", i, path);
+                continue;
+            }
+            VectorCopy(info.color, texture_reflectivity[i]);
+            goto saturate;
+        }
+
+        memset(&info, 0, sizeof(info));
+        wal_tex = false;
+
         // buffer is RGBA  (A  set to 255 for 24 bit format)
         // qb: looks in moddir then basedir
-        sprintf(path, "%stextures/%s.tga", moddir, texinfo[i].texture);
+        info.source = 0;
+        ReflectivityPath(path, 0, texinfo[i].texture);
         if (FileExists(path)) // LoadTGA expects file to exist
         {
             LoadTGA(path, &pbuffer, &width, &height); // load rgba data
             qprintf("load %s\n", path);
         } else {
             // look for wal file in moddir
-            sprintf(path, "%stextures/%s.wal", moddir, texinfo[i].texture);
+            info.source = 1;
+            ReflectivityPath(path, 1, texinfo[i].texture);
             qprintf("attempting %s\n", path);
 
             // load the miptex to get the flags and values
@@ -209,7 +280,8 @@ void CalcTextureReflectivity(void) {
                     qprintf("load %s\n", path);
                 } else {
                     // look for wal file in base dir
-                    sprintf(path, "%stextures/%s.wal", basedir, texinfo[i].texture);
+                    info.source = 2;
+                    ReflectivityPath(path, 2, texinfo[i].texture);
                     qprintf("load %s\n", path);
 
                     // load the miptex to get the flags and values
@@ -219,6 +291,8 @@ void CalcTextureReflectivity(void) {
                             wal_tex = true;
                     } else {
                         qprintf("NOT FOUND %s\n", path);
+                        info.status = REFLECT_NOTFOUND;
+                        TexCacheStore(&key, &info, sizeof(info));
                         continue;
                     }
                 }
@@ -238,10 +312,13 @@ void CalcTextureReflectivity(void) {
                 for (k = 0; k < 3; k++)
                     color[k] += palette[texel * 3 + k];
             }
+            free(mt);
         } else {
             texels = width * height;
             if (texels <= 0) {
                 qprintf("tex %i (%s) no rgba data (file broken?)\n", i, path);
+                info.status = REFLECT_EMPTY;
+                TexCacheStore(&key, &info, sizeof(info));
                 continue; // empty texture, possible bad file
             }
 
@@ -286,6 +363,12 @@ void CalcTextureReflectivity(void) {
             texture_reflectivity[i][j] = c;
         }
 
+        info.status = REFLECT_COLOR;
+        VectorCopy(texture_reflectivity[i], info.color);
+        TexCacheStore(&key, &info, sizeof(info));
+
+    saturate:
+
 // reflectivity saturation
 #define Pr .299
 #define Pg .587
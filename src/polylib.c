@@ -21,15 +21,19 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "cmdlib.h"
 #include "mathlib.h"
 #include "polylib.h"
+#include "pool.h"
 
 extern int32_t numthreads;
 
-// counters are only bumped when running single threaded,
-// because they are an awefull coherence problem
-int32_t c_active_windings;
-int32_t c_peak_windings;
-int32_t c_winding_allocs;
-int32_t c_winding_points;
+// windings come from a pool per size class, larger ones are malloced
+#define WINDING_SIZE(points) ((int32_t)(myoffsetof(winding_t, p) + (points) * sizeof(vec3_t)))
+
+static pool_t windingpools[] = {
+    POOL("winding4", WINDING_SIZE(4)),
+    POOL("winding8", WINDING_SIZE(8)),
+    POOL("winding16", WINDING_SIZE(16)),
+    POOL("winding32", WINDING_SIZE(32)),
+    POOL("winding64", WINDING_SIZE(64))};
 
 void pw(winding_t *w) {
     int32_t i;
@@ -43,20 +47,17 @@ AllocWinding
 =============
 */
 winding_t *AllocWinding(int32_t points) {
-    winding_t *w;
-    int32_t s;
-
-    if (numthreads == 1) {
-        c_winding_allocs++;
-        c_winding_points += points;
-        c_active_windings++;
-        if (c_active_windings > c_peak_windings)
-            c_peak_windings = c_active_windings;
+    pool_t *pool;
+    int32_t i;
+
+    pool = NULL;
+    for (i = 0; i < sizeof(windingpools) / sizeof(windingpools[0]); i++) {
+        if (points <= (4 << i)) {
+            pool = &windingpools[i];
+            break;
+        }
     }
-    s = sizeof(vec_t) * 3 * points + sizeof(int32_t);
-    w = malloc(s);
-    memset(w, 0, s);
-    return w;
+    return PoolAlloc(pool, WINDING_SIZE(points));
 }
 
 void FreeWinding(winding_t *w) {
@@ -64,9 +65,7 @@ void FreeWinding(winding_t *w) {
         Error("FreeWinding: freed a freed winding");
     *(unsigned *)w = 0xdeaddead;
 
-    if (numthreads == 1)
-        c_active_windings--;
-    free(w);
+    PoolFree(w);
 }
 
 /*
@@ -288,7 +287,7 @@ void ClipWindingEpsilon(
     vec_t dists[MAX_POINTS_ON_WINDING + 4];
     int32_t sides[MAX_POINTS_ON_WINDING + 4];
     int32_t counts[3];
-    static vec_t dot; // VC 4.2 optimizer bug if not static
+    vec_t dot;
     int32_t i, j;
     vec_t *p1, *p2;
     vec3_t mid;
@@ -389,7 +388,7 @@ void ChopWindingInPlace(winding_t **inout, vec3_t normal, vec_t dist, vec_t epsi
     vec_t dists[MAX_POINTS_ON_WINDING + 4];
     int32_t sides[MAX_POINTS_ON_WINDING + 4];
     int32_t counts[3];
-    static vec_t dot; // VC 4.2 optimizer bug if not static
+    vec_t dot;
     int32_t i, j;
     vec_t *p1, *p2;
     vec3_t mid;
@@ -0,0 +1,284 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "cmdlib.h"
+#include "threads.h"
+#include "pool.h"
+
+/*
+==============================================================================
+
+OBJECT POOLS
+
+Windings, brushes, nodes, portals and faces are allocated and freed by
+the million.  Each pool hands out objects up to pool->size from slabs and
+keeps freed ones on a list for reuse.
+
+Every thread takes a slot of its own the first time it touches a pool
+during a RunThreadsOn, so allocating and freeing never locks.  An object
+freed on another thread goes to that thread's list.  Slots are given out
+again by the next RunThreadsOn, when the threads holding them are gone.
+
+Each object has a small header naming its pool.  Objects too big for any
+pool are malloced with a NULL pool, so PoolFree can take anything
+PoolAlloc returned.
+
+PoolRelease frees all of a pool's slabs at once when nothing in it is live.
+==============================================================================
+*/
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define POOL_SLAB  65536
+#define POOL_ALIGN 16
+
+struct poolobj_s {
+    pool_t *pool; // NULL if malloced on its own
+    poolobj_t *next;
+};
+
+#define POOL_HEADER ((sizeof(poolobj_t) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+static THREAD_LOCAL int32_t poolslot, poolslotrun;
+static volatile int32_t slotrun[POOL_SLOTS]; // threadruns + 1 of the run that holds the slot
+
+static pool_t *volatile poollist;
+
+static bool CompareExchange(volatile int32_t *v, int32_t old, int32_t new) {
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange((volatile long *)v, new, old) == old;
+#else
+    return __atomic_compare_exchange_n(v, &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+==============
+GetPoolSlot
+==============
+*/
+static int32_t GetPoolSlot(void) {
+    int32_t run, old, s;
+
+    run = threadruns + 1;
+    if (poolslotrun == run)
+        return poolslot;
+
+    for (s = 0; s < POOL_SLOTS; s++) {
+        old = slotrun[s];
+        if (old != run && CompareExchange(&slotrun[s], old, run)) {
+            poolslot    = s;
+            poolslotrun = run;
+            return s;
+        }
+    }
+
+    Error("GetPoolSlot: more than %i threads", POOL_SLOTS);
+    return 0;
+}
+
+static void RegisterPool(pool_t *pool) {
+    pool_t *head;
+
+    if (!CompareExchange(&pool->registered, 0, 1))
+        return;
+
+    do {
+        head       = poollist;
+        pool->next = head;
+#ifdef _MSC_VER
+    } while (_InterlockedCompareExchangePointer((void *volatile *)&poollist, pool, head) != head);
+#else
+    } while (!__atomic_compare_exchange_n(&poollist, &head, pool, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+#endif
+}
+
+/*
+==============
+NewSlab
+==============
+*/
+static void NewSlab(pool_t *pool, poolcache_t *c, int32_t stride) {
+    int32_t count, bytes;
+    char *slab;
+
+    count = POOL_SLAB / stride;
+    if (count < 16)
+        count = 16;
+    bytes = POOL_ALIGN + count * stride;
+
+    slab = malloc(bytes);
+    if (!slab)
+        Error("NewSlab: out of memory for %s", pool->name);
+    *(void **)slab = c->slabs;
+    c->slabs       = slab;
+    c->bump        = slab + POOL_ALIGN;
+    c->bumpend     = slab + bytes;
+    c->slabbytes += bytes;
+
+    RegisterPool(pool);
+}
+
+/*
+==============
+PoolAlloc
+
+Returns size zeroed bytes.  pool may be NULL for a plain malloc.
+==============
+*/
+void *PoolAlloc(pool_t *pool, int32_t size) {
+    poolcache_t *c;
+    poolobj_t *o;
+    int32_t stride;
+
+    if (!pool) {
+        o = malloc(POOL_HEADER + size);
+        if (!o)
+            Error("PoolAlloc: out of memory");
+        o->pool = NULL;
+        memset((char *)o + POOL_HEADER, 0, size);
+        return (char *)o + POOL_HEADER;
+    }
+
+    if (size > pool->size)
+        Error("PoolAlloc: %i bytes from the %i byte %s pool", size, pool->size, pool->name);
+
+    c = &pool->cache[GetPoolSlot()];
+    if (c->free) {
+        o       = c->free;
+        c->free = o->next;
+    } else {
+        stride = POOL_HEADER + ((pool->size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1));
+        if (c->bumpend - c->bump < stride)
+            NewSlab(pool, c, stride);
+        o = (poolobj_t *)c->bump;
+        c->bump += stride;
+    }
+    o->pool = pool;
+    c->allocs++;
+
+    memset((char *)o + POOL_HEADER, 0, size);
+    return (char *)o + POOL_HEADER;
+}
+
+/*
+==============
+PoolFree
+==============
+*/
+void PoolFree(void *p) {
+    poolcache_t *c;
+    poolobj_t *o;
+
+    o = (poolobj_t *)((char *)p - POOL_HEADER);
+    if (!o->pool) {
+        free(o);
+        return;
+    }
+
+    c       = &o->pool->cache[GetPoolSlot()];
+    o->next = c->free;
+    c->free = o;
+    c->frees++;
+}
+
+/*
+==============
+PoolActive
+
+Objects allocated and not freed yet.  Only exact while no threads run.
+==============
+*/
+int64_t PoolActive(pool_t *pool) {
+    int64_t active;
+    int32_t i;
+
+    active = 0;
+    for (i = 0; i < POOL_SLOTS; i++)
+        active += pool->cache[i].allocs - pool->cache[i].frees;
+    return active;
+}
+
+static void UpdatePeak(pool_t *pool) {
+    int64_t bytes;
+    int32_t i;
+
+    bytes = 0;
+    for (i = 0; i < POOL_SLOTS; i++)
+        bytes += pool->cache[i].slabbytes;
+    if (bytes > pool->peakbytes)
+        pool->peakbytes = bytes;
+}
+
+/*
+==============
+PoolRelease
+
+Frees every slab of the pool if none of its objects are live.  Does
+nothing while threads run.
+==============
+*/
+void PoolRelease(pool_t *pool) {
+    poolcache_t *c;
+    void *slab, *next;
+    int32_t i;
+
+    if (threaded || PoolActive(pool))
+        return;
+
+    UpdatePeak(pool);
+    for (i = 0; i < POOL_SLOTS; i++) {
+        c = &pool->cache[i];
+        for (slab = c->slabs; slab; slab = next) {
+            next = *(void **)slab;
+            free(slab);
+        }
+        c->free      = NULL;
+        c->slabs     = NULL;
+        c->bump      = c->bumpend = NULL;
+        c->slabbytes = 0;
+    }
+}
+
+/*
+==============
+PrintPoolStats
+==============
+*/
+void PrintPoolStats(void) {
+    pool_t *pool;
+    int64_t allocs;
+    int32_t i;
+
+    if (!poollist)
+        return;
+
+    qprintf("pool             allocs     active   peak KB\n");
+    for (pool = poollist; pool; pool = pool->next) {
+        allocs = 0;
+        for (i = 0; i < POOL_SLOTS; i++)
+            allocs += pool->cache[i].allocs;
+        UpdatePeak(pool);
+        qprintf("%-12s %10lli %10lli %9lli\n", pool->name, (long long)allocs,
+                (long long)PoolActive(pool), (long long)(pool->peakbytes >> 10));
+    }
+}
@@ -0,0 +1,64 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+// fixed size object pools, see pool.c
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#define POOL_SLOTS 128 // threads that can hold a pool cache at once
+
+// each thread's cache gets its own cache line
+#ifdef _MSC_VER
+#define POOL_CACHELINE __declspec(align(64))
+#else
+#define POOL_CACHELINE __attribute__((aligned(64)))
+#endif
+
+typedef struct poolobj_s poolobj_t;
+
+typedef struct POOL_CACHELINE
+{
+    poolobj_t *free;
+    char *bump, *bumpend; // rest of the newest slab
+    void *slabs;
+    int64_t allocs, frees;
+    int64_t slabbytes;
+} poolcache_t;
+
+typedef struct pool_s
+{
+    const char *name;
+    int32_t size; // largest object the pool hands out
+    int64_t peakbytes;
+    struct pool_s *next; // registered pools, for PrintPoolStats
+    int32_t registered;
+    poolcache_t cache[POOL_SLOTS];
+} pool_t;
+
+#define POOL(poolname, objsize) {.name = (poolname), .size = (objsize)}
+
+void *PoolAlloc(pool_t *pool, int32_t size);
+void PoolFree(void *p);
+void PoolRelease(pool_t *pool);
+int64_t PoolActive(pool_t *pool);
+void PrintPoolStats(void);
+
+#endif
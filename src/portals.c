@@ -20,8 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "qbsp.h"
 
-int32_t c_active_portals;
-int32_t c_peak_portals;
+pool_t portalpool = POOL("portal", sizeof(portal_t));
+
 int32_t c_boundary;
 int32_t c_boundary_sides;
 
@@ -31,25 +31,13 @@ AllocPortal
 ===========
 */
 portal_t *AllocPortal(void) {
-    portal_t *p;
-
-    if (numthreads == 1)
-        c_active_portals++;
-    if (c_active_portals > c_peak_portals)
-        c_peak_portals = c_active_portals;
-
-    p = malloc(sizeof(portal_t));
-    memset(p, 0, sizeof(portal_t));
-
-    return p;
+    return PoolAlloc(&portalpool, sizeof(portal_t));
 }
 
 void FreePortal(portal_t *p) {
     if (p->winding)
         FreeWinding(p->winding);
-    if (numthreads == 1)
-        c_active_portals--;
-    free(p);
+    PoolFree(p);
 }
 
 //==============================================================
@@ -37,6 +37,13 @@ FILE *pf;
 int32_t num_visclusters; // clusters the player can be in
 int32_t num_visportals;
 
+bool binary_portals; // qb: -binportals, write name.prb alongside name.prt
+bool keep_portals;   // qb: -keepportals, write the portal file even when vis takes them from memory
+
+static prbportal_t *prb_portals;
+static float *prb_points;
+static int32_t prb_numportals, prb_numpoints, prb_maxpoints;
+
 void WriteFloat(FILE *f, vec_t v) {
     if (fabs(v - Q_rint(v)) < 0.001)
         fprintf(f, "%i ", (int32_t)Q_rint(v));
@@ -44,6 +51,44 @@ void WriteFloat(FILE *f, vec_t v) {
         fprintf(f, "%f ", v);
 }
 
+/*
+=================
+PortalCoord
+
+The value vis would get back from WriteFloat, so both formats give the
+same vis.
+=================
+*/
+static float PortalCoord(vec_t v) {
+    char text[64];
+
+    if (fabs(v - Q_rint(v)) < 0.001)
+        return (float)Q_rint(v);
+    sprintf(text, "%f", v);
+    return (float)atof(text);
+}
+
+static void AddBinaryPortal(winding_t *w, int32_t front, int32_t back) {
+    prbportal_t *out;
+    int32_t i;
+
+    if (prb_numportals == num_visportals)
+        Error("AddBinaryPortal: more portals than counted");
+    if (prb_numpoints + w->numpoints > prb_maxpoints) {
+        prb_maxpoints = prb_maxpoints * 2 + w->numpoints;
+        prb_points    = realloc(prb_points, prb_maxpoints * 3 * sizeof(float));
+    }
+
+    out             = &prb_portals[prb_numportals++];
+    out->numpoints  = w->numpoints;
+    out->leafs[0]   = front;
+    out->leafs[1]   = back;
+    out->firstpoint = prb_numpoints;
+    for (i = 0; i < w->numpoints * 3; i++)
+        prb_points[prb_numpoints * 3 + i] = PortalCoord(w->p[i / 3][i % 3]);
+    prb_numpoints += w->numpoints;
+}
+
 /*
 =================
 WritePortalFile_r
@@ -79,6 +124,13 @@ void WritePortalFile_r(node_t *node) {
             // plane the same way vis will, and flip the side orders if needed
             // FIXME: is this still relevent?
             WindingPlane(w, normal, &dist);
+            if (prb_portals) {
+                if (DotProduct(p->plane.normal, normal) < 0.99)
+                    AddBinaryPortal(w, p->nodes[1]->cluster, p->nodes[0]->cluster);
+                else
+                    AddBinaryPortal(w, p->nodes[0]->cluster, p->nodes[1]->cluster);
+                continue;
+            }
             if (DotProduct(p->plane.normal, normal) < 0.99) {
                 // backwards...
                 fprintf(pf, "%i %i %i ", w->numpoints, p->nodes[1]->cluster, p->nodes[0]->cluster);
@@ -216,13 +268,79 @@ void SaveClusters_r(node_t *node) {
     SaveClusters_r(node->children[1]);
 }
 
+/*
+================
+BuildBinaryPortals
+
+The .prb image: prbheader_t, then a prbportal_t per portal, then all the
+points packed as floats.  Vis copies the points straight into its windings.
+================
+*/
+static uint8_t *BuildBinaryPortals(node_t *headnode, int32_t *length) {
+    prbheader_t *header;
+    uint8_t *image;
+    int32_t portalbytes, pointbytes;
+
+    prb_portals    = malloc(num_visportals * sizeof(prbportal_t) + 1); // never NULL, WritePortalFile_r tests it
+    prb_numportals = prb_numpoints = prb_maxpoints = 0;
+    prb_points     = NULL;
+
+    WritePortalFile_r(headnode);
+    if (prb_numportals != num_visportals)
+        Error("BuildBinaryPortals: wrote %i of %i portals", prb_numportals, num_visportals);
+
+    portalbytes = num_visportals * sizeof(prbportal_t);
+    pointbytes  = prb_numpoints * 3 * sizeof(float);
+    *length     = sizeof(prbheader_t) + portalbytes + pointbytes;
+    image       = malloc(*length);
+    if (!image)
+        Error("BuildBinaryPortals: out of memory");
+
+    header = (prbheader_t *)image;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->ident, PRBFILE, 4);
+    header->numclusters = num_visclusters;
+    header->numportals  = num_visportals;
+    header->numpoints   = prb_numpoints;
+    memcpy(image + sizeof(prbheader_t), prb_portals, portalbytes);
+    memcpy(image + sizeof(prbheader_t) + portalbytes, prb_points, pointbytes);
+
+    free(prb_portals);
+    free(prb_points);
+    prb_portals = NULL;
+    prb_points  = NULL;
+
+    return image;
+}
+
+/*
+================
+WriteTextPortalFile
+================
+*/
+static void WriteTextPortalFile(node_t *headnode, char *filename) {
+    printf("writing %s\n", filename);
+    pf = fopen(filename, "w");
+    if (!pf)
+        Error("Error opening %s", filename);
+
+    fprintf(pf, "%s\n", PORTALFILE);
+    fprintf(pf, "%i\n", num_visclusters);
+    fprintf(pf, "%i\n", num_visportals);
+
+    WritePortalFile_r(headnode);
+
+    fclose(pf);
+    pf = NULL;
+}
+
 /*
 ================
 WritePortalFile
 ================
 */
 void WritePortalFile(tree_t *tree) {
-    char filename[1030];
+    char filename[1030], binaryname[1030];
     node_t *headnode;
 
     qprintf("--- WritePortalFile ---\n");
@@ -243,6 +361,7 @@ void WritePortalFile(tree_t *tree) {
 
     // write the file
     sprintf(filename, "%s.prt", source);
+    sprintf(binaryname, "%s.prb", source);
 
     if (use_qbsp)
         printf("\ntexinfo count: %i of %i maximum\n", numtexinfo, MAX_MAP_TEXINFO_QBSP);
@@ -254,21 +373,39 @@ void WritePortalFile(tree_t *tree) {
     else
         printf("brushsides count: %i of %i maximum\n", nummapbrushsides, MAX_MAP_BRUSHSIDES);
 
-    printf("writing %s\n", filename);
-    pf = fopen(filename, "w");
-    if (!pf)
-        Error("Error opening %s", filename);
-
-    fprintf(pf, "%s\n", PORTALFILE);
-    fprintf(pf, "%i\n", num_visclusters);
-    fprintf(pf, "%i\n", num_visportals);
-
     qprintf("%5i visclusters\n", num_visclusters);
     qprintf("%5i visportals\n", num_visportals);
 
-    WritePortalFile_r(headnode);
-
-    fclose(pf);
+    // vis takes a .prb newer than the .prt, so never leave a stale one around
+    if (!binary_portals || (hold_bsp && !keep_portals))
+        remove(binaryname);
+
+    if (hold_bsp) {
+        // qb: -chain, vis takes the portals from memory
+        free(heldportals);
+        heldportals = BuildBinaryPortals(headnode, &heldportalsize);
+        if (!keep_portals)
+            remove(filename);
+        else {
+            WriteTextPortalFile(headnode, filename);
+            if (binary_portals) {
+                printf("writing %s\n", binaryname);
+                SaveFile(binaryname, heldportals, heldportalsize);
+            }
+        }
+    } else {
+        // the text file is always written, editors and leak tools read it
+        WriteTextPortalFile(headnode, filename);
+        if (binary_portals) {
+            int32_t length;
+            uint8_t *image;
+
+            image = BuildBinaryPortals(headnode, &length);
+            printf("writing %s\n", binaryname);
+            SaveFile(binaryname, image, length);
+            free(image);
+        }
+    }
 
     // we need to store the clusters out now because ordering
     // issues made us do this after writebsp...
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "scriplib.h"
 #include "polylib.h"
 #include "threads.h"
+#include "pool.h"
 #include "bspfile.h"
 
 #define MAX_BRUSH_SIDES 128
@@ -251,8 +252,14 @@ bspbrush_t *CopyBrush(bspbrush_t *brush);
 void SplitBrush(bspbrush_t *brush, int32_t planenum,
                 bspbrush_t **front, bspbrush_t **back);
 
+#define NUM_BRUSH_POOLS 5
+
+extern pool_t nodepool;
+extern pool_t brushpools[NUM_BRUSH_POOLS];
+
 tree_t *AllocTree(void);
 node_t *AllocNode(void);
+bspbrush_t *BrushFromBounds(vec3_t mins, vec3_t maxs);
 bspbrush_t *AllocBrush(int32_t numsides);
 int32_t CountBrushList(bspbrush_t *brushes);
 void FreeBrush(bspbrush_t *brushes);
@@ -279,6 +286,8 @@ bool FloodEntities(tree_t *tree);
 void FillOutside(node_t *headnode);
 void FloodAreas(tree_t *tree);
 void MarkVisibleSides(tree_t *tree, int32_t start, int32_t end);
+extern pool_t portalpool;
+
 void FreePortal(portal_t *p);
 void EmitAreaPortals(node_t *headnode);
 
@@ -317,6 +326,8 @@ void MakeFaces(node_t *headnode);
 void FixTjuncs(node_t *headnode);
 int32_t GetEdge(int32_t v1, int32_t v2, face_t *f);
 
+extern pool_t facepool;
+
 face_t *AllocFace(void);
 void FreeFace(face_t *f);
 
@@ -53,6 +53,7 @@ typedef struct directlight_s {
     dleaf_t *leaf;
     dleaf_tx *leafX;
     int32_t nodenum;
+    int32_t index; // qb: order of creation, for the light cache
 } directlight_t;
 
 // the sum of all tranfer->transfer values for a given patch
@@ -103,11 +104,24 @@ typedef struct patch_s {
     int32_t samples; // for averaging direct light
 } patch_t;
 
+#define MAX_STYLES 32
+typedef struct
+{
+    int32_t numsamples;
+    float *origins;
+    int32_t numstyles;
+    int32_t stylenums[MAX_STYLES];
+    float *samples[MAX_STYLES];
+} facelight_t;
+
+extern facelight_t facelight[MAX_MAP_FACES_QBSP];
+
 extern patch_t *face_patches[MAX_MAP_FACES_QBSP];
 extern entity_t *face_entity[MAX_MAP_FACES_QBSP];
 extern vec3_t face_offset[MAX_MAP_FACES_QBSP]; // for rotating bmodels
 extern patch_t patches[MAX_PATCHES_QBSP];
 extern unsigned num_patches;
+extern vec3_t radiosity[MAX_PATCHES_QBSP];
 
 extern int32_t leafparents[MAX_MAP_LEAFS_QBSP];
 extern int32_t nodeparents[MAX_MAP_NODES_QBSP];
@@ -136,6 +150,7 @@ extern bool dicepatches;
 extern int32_t numbounce;
 extern bool noblock;
 extern bool noedgefix;
+extern int32_t sunmask_step;
 
 extern directlight_t *directlights[MAX_MAP_LEAFS_QBSP];
 
@@ -191,3 +206,51 @@ extern uint8_t *dlightdata_ptr;
 extern uint8_t dlightdata_raw[MAX_MAP_LIGHTING_QBSP];
 
 extern float sunradscale;
+
+//==============================================
+
+extern bool checkpoint;
+
+void InitRadCheckpoint(void);
+bool LoadFacelightCheckpoint(void);
+int32_t LoadBounceCheckpoint(void);
+void SaveFacelightCheckpoint(void);
+void SaveBounceCheckpoint(int32_t bounce);
+void WaitRadCheckpoint(void);
+void RemoveRadCheckpoint(void);
+void ChecksumRadState(uint8_t *checksum, bool withentities);
+void WriteFacelight(FILE *f, int32_t facenum);
+void ReadFacelight(FILE *f, int32_t facenum, bool keep);
+
+//==============================================
+
+// lights and clusters that one face's samples saw, see lightcache.c
+typedef struct
+{
+    uint8_t *lights; // one bit per directlight_t index
+    int32_t *clusters;
+    int32_t numclusters;
+    int32_t maxclusters;
+} lightdeps_t;
+
+extern int32_t numdlights;
+
+void InitLightCache(void);
+bool FaceLightCached(int32_t facenum);
+void BeginLightDeps(lightdeps_t *deps);
+void AddLightDepCluster(lightdeps_t *deps, vec3_t pos);
+void EndLightDeps(lightdeps_t *deps, int32_t facenum);
+void SaveLightCache(void);
+
+//==============================================
+
+// distributed lighting, see radnet.c
+extern char rad_coordinator[256];
+extern char rad_worker[256];
+
+void InitRadCoordinator(void);
+void DistributeFacelights(void);
+void DistributeTransfers(void);
+void DistributeFinalLight(void);
+void ShutdownRadCoordinator(void);
+void RunRadWorker(void);
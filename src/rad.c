@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "qrad.h"
+#include "texcache.h"
 
 /*
 
@@ -715,25 +716,30 @@ void ShootLight(int32_t patchnum) {
 /*
 =============
 BounceLight
+
+Preview passes pass save false so their bounces never reach a checkpoint.
 =============
 */
-void BounceLight(void) {
+void BounceLight(int32_t firstbounce, bool save) {
     int32_t i, j, start = 0, stop;
     float added;
     char name[64];
     patch_t *p;
 
-    for (i = 0; i < num_patches; i++) {
-        p = &patches[i];
-        for (j = 0; j < 3; j++) {
-            //			p->totallight[j] = p->samplelight[j];
-            radiosity[i][j] = p->samplelight[j] * p->reflectivity[j] * p->area;
+    // qb: a resumed run already has radiosity from the checkpoint
+    if (!firstbounce) {
+        for (i = 0; i < num_patches; i++) {
+            p = &patches[i];
+            for (j = 0; j < 3; j++) {
+                //			p->totallight[j] = p->samplelight[j];
+                radiosity[i][j] = p->samplelight[j] * p->reflectivity[j] * p->area;
+            }
         }
     }
     if (memory)
         trace_buf_size = (num_patches + 7) / 8;
 
-    for (i = 0; i < numbounce; i++) {
+    for (i = firstbounce; i < numbounce; i++) {
         if (memory) {
             p_progress = -1;
             start      = I_FloatTime();
@@ -753,6 +759,9 @@ void BounceLight(void) {
             sprintf(name, "bounce%i.txt", i);
             WriteWorld(name);
         }
+
+        if (save)
+            SaveBounceCheckpoint(i + 1);
     }
 }
 
@@ -769,12 +778,136 @@ void CheckPatches(void) {
     }
 }
 
+/*
+=============
+MakeTransferLists
+
+-preview needs the transfers before the final pass, only build them once.
+=============
+*/
+static bool transfers_made;
+
+void MakeTransferLists(void) {
+    if (memory || transfers_made)
+        return;
+    if (rad_coordinator[0]) {
+        DistributeTransfers();
+    } else {
+        RunThreadsOnIndividual(num_patches, true, MakeTransfers);
+        qprintf("transfer lists: %5.1f megs\n", (float)total_transfer * sizeof(transfer_t) / (1024 * 1024));
+    }
+    transfers_made = true;
+}
+
+/*
+=============
+PreviewLighting
+
+-preview N: light every Nth texel without -extra and write the bsp, then
+halve the stride and add a bounce per pass.  The final full quality pass
+in RadWorld reuses the texels of the last preview pass when it can.
+=============
+*/
+int32_t preview_stride;
+
+extern int32_t facelight_stride;
+extern facelight_t *prevfacelight;
+extern int32_t prevfacelight_stride;
+
+static vec3_t *base_totallight;
+
+static void ResetPatchLight(void) {
+    int32_t i;
+
+    for (i = 0; i < num_patches; i++) {
+        VectorCopy(base_totallight[i], patches[i].totallight);
+        VectorClear(patches[i].samplelight);
+        patches[i].samples = 0;
+    }
+}
+
+static void FreePreviewFacelights(void) {
+    int32_t i, j;
+
+    if (!prevfacelight)
+        return;
+    for (i = 0; i < numfaces; i++) {
+        // FinalLightFace may have cut numstyles down to MAXLIGHTMAPS
+        free(prevfacelight[i].origins);
+        for (j = 0; j < MAX_STYLES; j++)
+            free(prevfacelight[i].samples[j]);
+    }
+    free(prevfacelight);
+    prevfacelight        = NULL;
+    prevfacelight_stride = 0;
+}
+
+static void NextFacelights(void) {
+    FreePreviewFacelights();
+    prevfacelight = malloc(numfaces * sizeof(facelight_t));
+    memcpy(prevfacelight, facelight, numfaces * sizeof(facelight_t));
+    memset(facelight, 0, numfaces * sizeof(facelight_t));
+    prevfacelight_stride = facelight_stride;
+}
+
+static void PreviewLighting(void) {
+    int32_t i, pass, stride;
+    int32_t old_numthreads   = numthreads;
+    int32_t old_numbounce    = numbounce;
+    bool old_extrasamples    = extrasamples;
+    double start             = I_FloatTime();
+    char name[1024];
+
+    base_totallight = malloc(num_patches * sizeof(vec3_t));
+    for (i = 0; i < num_patches; i++)
+        VectorCopy(patches[i].totallight, base_totallight[i]);
+
+    extrasamples = false;
+    for (pass = 0, stride = preview_stride; stride > 1; pass++, stride >>= 1) {
+        numbounce = pass < old_numbounce ? pass : old_numbounce;
+        printf("--- preview: stride %i, %i bounce ---\n", stride, numbounce);
+
+        if (pass)
+            NextFacelights();
+        ResetPatchLight();
+        facelight_stride = stride;
+        RunThreadsOnIndividual(numfaces, true, BuildFacelights);
+
+        if (numbounce > 0) {
+            MakeTransferLists();
+            numthreads = 1;
+            BounceLight(0, false);
+            numthreads = old_numthreads;
+        }
+
+        lightdatasize = 0;
+        RunThreadsOnIndividual(numfaces, true, FinalLightFace);
+
+        sprintf(name, "%s%s", outbase, source);
+        printf("writing preview %s (%5.0f seconds)\n", name, I_FloatTime() - start);
+        WriteBSPFile(name);
+    }
+
+    extrasamples = old_extrasamples;
+    numbounce    = old_numbounce;
+
+    // set up the full quality pass
+    NextFacelights();
+    ResetPatchLight();
+    facelight_stride = 1;
+    if (extrasamples)
+        FreePreviewFacelights(); // -extra samples don't match the preview texels
+    free(base_totallight);
+}
+
 /*
 =============
 RadWorld
 =============
 */
 void RadWorld(void) {
+    int32_t donebounce = 0;
+
     if (numnodes == 0 || numfaces == 0)
         Error("Empty map");
     MakeBackplanes();
@@ -791,20 +924,45 @@ void RadWorld(void) {
     // create directlights out of patches and lights
     CreateDirectLights();
     PairEdges(); // qb: moved here for phong
+    LinkPlaneFaces();
+
+    if (rad_worker[0]) {
+        RunRadWorker();
+        return;
+    }
+    if (rad_coordinator[0]) {
+        if (incremental) {
+            printf("-incremental is ignored with -coordinator\n");
+            incremental = false;
+        }
+        InitRadCoordinator();
+    }
+
+    InitRadCheckpoint();
 
     // build initial facelights
-    RunThreadsOnIndividual(numfaces, true, BuildFacelights);
+    if (resume && LoadFacelightCheckpoint()) {
+        donebounce = LoadBounceCheckpoint();
+    } else {
+        if (preview_stride > 1)
+            PreviewLighting();
+        InitLightCache();
+        if (rad_coordinator[0])
+            DistributeFacelights();
+        else
+            RunThreadsOnIndividual(numfaces, true, BuildFacelights);
+        FreePreviewFacelights();
+        SaveLightCache();
+        SaveFacelightCheckpoint();
+    }
 
-    if (numbounce > 0) {
+    if (numbounce > donebounce) {
         // build transfer lists
-        if (!memory) {
-            RunThreadsOnIndividual(num_patches, true, MakeTransfers);
-            qprintf("transfer lists: %5.1f megs\n", (float)total_transfer * sizeof(transfer_t) / (1024 * 1024));
-        }
+        MakeTransferLists();
         numthreads = 1;
 
         // spread light around
-        BounceLight();
+        BounceLight(donebounce, true);
 
         FreeTransfers();
 
@@ -819,10 +977,14 @@ void RadWorld(void) {
     }
 
     // blend bounced light into direct light and save
-    LinkPlaneFaces();
+    WaitRadCheckpoint();
 
     lightdatasize = 0;
-    RunThreadsOnIndividual(numfaces, true, FinalLightFace);
+    if (rad_coordinator[0]) {
+        DistributeFinalLight();
+        ShutdownRadCoordinator();
+    } else
+        RunThreadsOnIndividual(numfaces, true, FinalLightFace);
 }
 
 /*
@@ -848,7 +1010,9 @@ void RAD_ProcessArgument(const char *arg) {
     name = (char *)malloc(strlen(inbase) + strlen(source) + 1);
     sprintf(name, "%s%s", inbase, source);
     printf("reading %s\n", name);
-    LoadBSPFile(name);
+    LoadChainedBSPFile(name);
+    if (preview_stride > 1)
+        UnmapBSPFile(); // previews write the bsp while patches point into it
     dlightdata_ptr = dlightdata;
     if (use_qbsp) {
         maxdata = MAX_MAP_LIGHTING_QBSP;
@@ -858,6 +1022,7 @@ void RAD_ProcessArgument(const char *arg) {
         CalcTextureReflectivity_Heretic2();
     else
         CalcTextureReflectivity();
+    SaveTextureCache();
 
     if (!visdatasize) {
         printf("No vis information, direct lighting only.\n");
@@ -881,6 +1046,11 @@ void RAD_ProcessArgument(const char *arg) {
 
     RadWorld();
 
+    if (rad_worker[0]) {
+        printf("%5.0f seconds elapsed\n", I_FloatTime() - start);
+        return;
+    }
+
     if (smoothing_threshold > 0.0) {
         printf("Smoothing edges found: %i\n\n", num_smoothing);
     }
@@ -888,6 +1058,7 @@ void RAD_ProcessArgument(const char *arg) {
     sprintf(name, "%s%s", outbase, source);
     printf("writing %s\n", name);
     WriteBSPFile(name);
+    RemoveRadCheckpoint();
 
     end = I_FloatTime();
     printf("%5.0f seconds elapsed\n", end - start);
@@ -0,0 +1,1072 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "qrad.h"
+#include "mdfour.h"
+
+/*
+==============================================================================
+
+DISTRIBUTED RAD
+
+q2tool -rad -coordinator ADDR map    lights map, farming out the work
+q2tool -rad -worker ADDR map         helps; run as many as you like
+
+ADDR is unix:/path/to/socket or host:port.  Every process loads the same
+bsp and builds the same patches and lights; the handshake compares a
+checksum of all of that plus the lighting settings.
+
+The coordinator hands out three kinds of jobs, each a range of faces or
+patches:
+
+JOB_FACELIGHTS  BuildFacelights, returns facelights and patch direct light
+JOB_TRANSFERS   MakeTransfers, returns the transfer lists
+JOB_FINALLIGHT  FinalLightFace, sent with the facelights of the range and
+                preceded once per worker by the bounced patch totallight.
+                Returns each face's styles and lightmap bytes.
+
+The bounces run on the coordinator.  Results are stored by face/patch
+index and lightmaps are packed in face order, the same order a local
+-threads 1 run uses, so the bsp comes out identical whatever the number
+of workers.  A worker that drops out or answers with the wrong job has
+its job handed to someone else.  With no worker attached for NET_WAIT
+seconds the coordinator works through the jobs itself.
+
+Data goes over the wire in native byte order, so all machines must share
+the same endianness.
+==============================================================================
+*/
+
+char rad_coordinator[256]; // qb: -coordinator address
+char rad_worker[256];      // qb: -worker address
+
+#define FACE_CHUNK  64
+#define PATCH_CHUNK 512
+
+enum {
+    MSG_HELLO = 1,
+    MSG_WELCOME,
+    MSG_REJECT,
+    MSG_JOB,
+    MSG_RESULT,
+    MSG_TOTALLIGHT,
+    MSG_DONE
+};
+
+enum {
+    JOB_FACELIGHTS,
+    JOB_TRANSFERS,
+    JOB_FINALLIGHT
+};
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t length;
+} msgheader_t;
+
+typedef struct
+{
+    int32_t phase;
+    int32_t first;
+    int32_t count;
+} jobheader_t;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size, maxsize;
+    size_t readofs;
+} netbuf_t;
+
+extern int32_t total_transfer;
+extern uint8_t *dlightdata_ptr;
+extern void MakeTransfers(int32_t i);
+
+static uint8_t net_checksum[16];
+
+/*
+==============================================================================
+
+BUFFERS AND MESSAGES
+
+==============================================================================
+*/
+
+static void NetPut(netbuf_t *buf, const void *data, size_t size) {
+    if (buf->size + size > buf->maxsize) {
+        buf->maxsize = (buf->size + size) * 2;
+        buf->data    = realloc(buf->data, buf->maxsize);
+        if (!buf->data)
+            Error("NetPut: out of memory");
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static bool NetRead(netbuf_t *buf, void *data, size_t size) {
+    if (size > buf->size - buf->readofs)
+        return false;
+    memcpy(data, buf->data + buf->readofs, size);
+    buf->readofs += size;
+    return true;
+}
+
+static void NetGet(netbuf_t *buf, void *data, size_t size) {
+    if (!NetRead(buf, data, size))
+        Error("NetGet: short message");
+}
+
+// skips count items of size bytes, false if count is negative or runs past the end
+static bool NetSkip(netbuf_t *buf, int64_t count, size_t size) {
+    if (count < 0 || (uint64_t)count > (buf->size - buf->readofs) / size)
+        return false;
+    buf->readofs += count * size;
+    return true;
+}
+
+static void NetFree(netbuf_t *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+static bool WriteAll(int32_t fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    ssize_t n;
+
+    while (size) {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool ReadAll(int32_t fd, void *data, size_t size) {
+    uint8_t *p = data;
+    ssize_t n;
+
+    while (size) {
+        n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool SendMsg(int32_t fd, uint32_t type, netbuf_t *buf) {
+    msgheader_t h;
+
+    h.type   = type;
+    h.length = buf ? buf->size : 0;
+    if (!WriteAll(fd, &h, sizeof(h)))
+        return false;
+    return !buf || WriteAll(fd, buf->data, buf->size);
+}
+
+static bool RecvMsg(int32_t fd, uint32_t *type, netbuf_t *buf) {
+    msgheader_t h;
+
+    buf->size    = 0;
+    buf->readofs = 0;
+    if (!ReadAll(fd, &h, sizeof(h)))
+        return false;
+    *type = h.type;
+    if (h.length > buf->maxsize) {
+        buf->maxsize = h.length;
+        buf->data    = realloc(buf->data, buf->maxsize);
+        if (!buf->data)
+            Error("RecvMsg: out of memory");
+    }
+    buf->size = h.length;
+    return ReadAll(fd, buf->data, h.length);
+}
+
+/*
+=============
+OpenSocket
+
+unix:/path or host:port.  Listens when server is set, otherwise connects.
+Returns -1 on failure.
+=============
+*/
+static int32_t OpenSocket(char *address, bool server) {
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un sun_addr;
+    char host[256], *port;
+    int32_t fd = -1, one = 1;
+
+    if (!strncmp(address, "unix:", 5)) {
+        memset(&sun_addr, 0, sizeof(sun_addr));
+        sun_addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(sun_addr.sun_path))
+            Error("socket path too long: %s", address + 5);
+        strcpy(sun_addr.sun_path, address + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (server) {
+            unlink(sun_addr.sun_path);
+            if (bind(fd, (struct sockaddr *)&sun_addr, sizeof(sun_addr)) || listen(fd, 64)) {
+                close(fd);
+                return -1;
+            }
+        } else if (connect(fd, (struct sockaddr *)&sun_addr, sizeof(sun_addr))) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    strncpy(host, address, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    port                   = strrchr(host, ':');
+    if (!port)
+        Error("bad address %s, expected unix:/path or host:port", address);
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = server ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res))
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (server) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 64))
+                break;
+        } else if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+/*
+=============
+ChecksumRadNet
+
+Workers must agree on everything, final lightmap settings included.
+=============
+*/
+static void ChecksumRadNet(void) {
+    struct mdfour md;
+    uint8_t state[16];
+    float settings[6];
+
+    ChecksumRadState(state, true);
+    settings[0] = ambient;
+    settings[1] = lightscale;
+    settings[2] = maxlight;
+    settings[3] = grayscale;
+    settings[4] = saturation;
+    settings[5] = numbounce;
+
+    mdfour_begin(&md);
+    mdfour_update(&md, state, sizeof(state));
+    mdfour_update(&md, (uint8_t *)settings, sizeof(settings));
+    mdfour_result(&md, net_checksum);
+}
+
+/*
+==============================================================================
+
+JOB DATA
+
+==============================================================================
+*/
+
+static void PutFacelight(netbuf_t *buf, int32_t facenum) {
+    facelight_t *fl = &facelight[facenum];
+    int32_t j;
+
+    NetPut(buf, &fl->numsamples, sizeof(int32_t));
+    NetPut(buf, &fl->numstyles, sizeof(int32_t));
+    if (!fl->numsamples)
+        return;
+    NetPut(buf, fl->stylenums, fl->numstyles * sizeof(int32_t));
+    NetPut(buf, fl->origins, fl->numsamples * sizeof(vec3_t));
+    for (j = 0; j < fl->numstyles; j++)
+        NetPut(buf, fl->samples[j], fl->numsamples * sizeof(vec3_t));
+}
+
+static void GetFacelight(netbuf_t *buf, int32_t facenum) {
+    facelight_t *fl = &facelight[facenum];
+    int32_t j;
+
+    memset(fl, 0, sizeof(*fl));
+    NetGet(buf, &fl->numsamples, sizeof(int32_t));
+    NetGet(buf, &fl->numstyles, sizeof(int32_t));
+    if (!fl->numsamples)
+        return;
+    if (fl->numstyles < 0 || fl->numstyles > MAX_STYLES)
+        Error("GetFacelight: bad style count on face %i", facenum);
+    NetGet(buf, fl->stylenums, fl->numstyles * sizeof(int32_t));
+    fl->origins = malloc(fl->numsamples * sizeof(vec3_t));
+    NetGet(buf, fl->origins, fl->numsamples * sizeof(vec3_t));
+    for (j = 0; j < fl->numstyles; j++) {
+        fl->samples[j] = malloc(fl->numsamples * sizeof(vec3_t));
+        NetGet(buf, fl->samples[j], fl->numsamples * sizeof(vec3_t));
+    }
+}
+
+static void FreeFacelight(int32_t facenum) {
+    facelight_t *fl = &facelight[facenum];
+    int32_t j;
+
+    // FinalLightFace may have cut numstyles down to MAXLIGHTMAPS
+    free(fl->origins);
+    for (j = 0; j < MAX_STYLES; j++)
+        free(fl->samples[j]);
+    memset(fl, 0, sizeof(*fl));
+}
+
+static bool FaceIsLit(int32_t facenum) {
+    int32_t ti = use_qbsp ? dfacesX[facenum].texinfo : dfaces[facenum].texinfo;
+
+    return !(texinfo[ti].flags & (SURF_WARP | SURF_SKY));
+}
+
+/*
+==============================================================================
+
+WORKER
+
+==============================================================================
+*/
+
+static int32_t job_first;
+
+static void WorkerFacelight(int32_t i) {
+    BuildFacelights(job_first + i);
+}
+
+static void WorkerTransfers(int32_t i) {
+    MakeTransfers(job_first + i);
+}
+
+static void WorkerFinalLight(int32_t i) {
+    FinalLightFace(job_first + i);
+}
+
+static void RunWorkerJob(netbuf_t *in, netbuf_t *out) {
+    jobheader_t job;
+    patch_t *patch;
+    int32_t i, f, size, written;
+    int32_t *allocsize;
+    uint8_t styles[MAXLIGHTMAPS];
+    int32_t lightofs;
+
+    NetGet(in, &job, sizeof(job));
+    NetPut(out, &job, sizeof(job));
+    job_first = job.first;
+
+    switch (job.phase) {
+    case JOB_FACELIGHTS:
+        for (i = 0; i < job.count; i++) {
+            for (patch = face_patches[job.first + i]; patch; patch = patch->next) {
+                VectorClear(patch->samplelight);
+                patch->samples = 0;
+            }
+        }
+        RunThreadsOnIndividual(job.count, false, WorkerFacelight);
+        for (i = 0; i < job.count; i++) {
+            f = job.first + i;
+            PutFacelight(out, f);
+            for (patch = face_patches[f]; patch; patch = patch->next) {
+                NetPut(out, patch->samplelight, sizeof(vec3_t));
+                NetPut(out, &patch->samples, sizeof(int32_t));
+            }
+            FreeFacelight(f);
+        }
+        break;
+
+    case JOB_TRANSFERS:
+        RunThreadsOnIndividual(job.count, false, WorkerTransfers);
+        for (i = 0; i < job.count; i++) {
+            patch = &patches[job.first + i];
+            NetPut(out, &patch->numtransfers, sizeof(int32_t));
+            if (patch->numtransfers > 0)
+                NetPut(out, patch->transfers, patch->numtransfers * sizeof(transfer_t));
+            free(patch->transfers);
+            patch->transfers    = NULL;
+            patch->numtransfers = 0;
+        }
+        break;
+
+    case JOB_FINALLIGHT:
+        allocsize = malloc(job.count * sizeof(int32_t));
+        for (i = 0; i < job.count; i++) {
+            GetFacelight(in, job.first + i);
+            allocsize[i] = facelight[job.first + i].numstyles * facelight[job.first + i].numsamples * 3;
+        }
+        lightdatasize = 0;
+        RunThreadsOnIndividual(job.count, false, WorkerFinalLight);
+        for (i = 0; i < job.count; i++) {
+            f       = job.first + i;
+            size    = FaceIsLit(f) ? allocsize[i] : 0;
+            written = size ? facelight[f].numstyles * facelight[f].numsamples * 3 : 0;
+            if (use_qbsp) {
+                memcpy(styles, dfacesX[f].styles, MAXLIGHTMAPS);
+                lightofs = dfacesX[f].lightofs;
+            } else {
+                memcpy(styles, dfaces[f].styles, MAXLIGHTMAPS);
+                lightofs = dfaces[f].lightofs;
+            }
+            NetPut(out, &size, sizeof(int32_t));
+            NetPut(out, &written, sizeof(int32_t));
+            NetPut(out, styles, MAXLIGHTMAPS);
+            if (written)
+                NetPut(out, dlightdata_ptr + lightofs, written);
+            FreeFacelight(f);
+        }
+        free(allocsize);
+        break;
+
+    default:
+        Error("RunWorkerJob: bad job type %i", job.phase);
+    }
+}
+
+/*
+=============
+RunRadWorker
+
+Called from RadWorld once patches and lights are set up.  Keeps trying to
+reach the coordinator for a minute, then serves jobs until told to stop.
+=============
+*/
+void RunRadWorker(void) {
+    netbuf_t in, out;
+    uint32_t type;
+    int32_t fd, tries, i;
+
+    signal(SIGPIPE, SIG_IGN);
+    ChecksumRadNet();
+
+    for (tries = 0; (fd = OpenSocket(rad_worker, false)) < 0; tries++) {
+        if (tries == 60)
+            Error("couldn't connect to coordinator at %s", rad_worker);
+        sleep(1);
+    }
+    printf("connected to coordinator at %s\n", rad_worker);
+
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+
+    NetPut(&out, net_checksum, sizeof(net_checksum));
+    if (!SendMsg(fd, MSG_HELLO, &out) || !RecvMsg(fd, &type, &in))
+        Error("lost connection to coordinator");
+    if (type != MSG_WELCOME)
+        Error("coordinator rejected this worker: map or settings differ");
+
+    while (RecvMsg(fd, &type, &in)) {
+        if (type == MSG_DONE)
+            break;
+        if (type == MSG_TOTALLIGHT) {
+            for (i = 0; i < num_patches; i++)
+                NetGet(&in, patches[i].totallight, sizeof(vec3_t));
+            continue;
+        }
+        if (type != MSG_JOB)
+            Error("unexpected message %i from coordinator", type);
+
+        out.size = 0;
+        RunWorkerJob(&in, &out);
+        if (!SendMsg(fd, MSG_RESULT, &out))
+            break;
+    }
+
+    close(fd);
+    NetFree(&in);
+    NetFree(&out);
+    printf("worker finished\n");
+}
+
+/*
+==============================================================================
+
+COORDINATOR
+
+==============================================================================
+*/
+
+#define MAX_NET_WORKERS 256
+#define NET_TIMEOUT     30 // seconds a connection may stall before its hello or mid-message
+#define NET_WAIT        60 // seconds without workers before the coordinator lights on its own
+
+typedef struct
+{
+    int32_t fd;
+    int32_t job; // index into jobs, -1 when idle
+    bool has_totallight;
+} networker_t;
+
+typedef struct
+{
+    int32_t first, count;
+    bool assigned, done;
+    netbuf_t result; // JOB_FINALLIGHT keeps results until all are in
+} netjob_t;
+
+// accepted, hello not read yet
+typedef struct
+{
+    int32_t fd;
+    double since;
+} netpending_t;
+
+static int32_t listen_fd = -1;
+static networker_t networkers[MAX_NET_WORKERS];
+static int32_t num_networkers;
+static netpending_t pending[MAX_NET_WORKERS];
+static int32_t num_pending;
+static double lastworker; // last time any worker was attached
+
+static void DropWorker(int32_t w, netjob_t *jobs) {
+    if (networkers[w].job >= 0)
+        jobs[networkers[w].job].assigned = false;
+    close(networkers[w].fd);
+    networkers[w] = networkers[--num_networkers];
+    printf("(worker lost, %i left)", num_networkers);
+    fflush(stdout);
+}
+
+/*
+=============
+AcceptWorker
+
+The hello is read once poll says it is there, so a client that connects
+and says nothing can't hold up the coordinator.  Reads on a worker time
+out after NET_TIMEOUT seconds.
+=============
+*/
+static void AcceptWorker(void) {
+    struct timeval tv;
+    int32_t fd;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (num_pending == MAX_NET_WORKERS) {
+        close(fd);
+        return;
+    }
+
+    tv.tv_sec  = NET_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    pending[num_pending].fd    = fd;
+    pending[num_pending].since = I_FloatTime();
+    num_pending++;
+}
+
+static void GreetWorker(int32_t p) {
+    netbuf_t buf;
+    uint32_t type;
+    int32_t fd = pending[p].fd;
+
+    pending[p] = pending[--num_pending];
+
+    memset(&buf, 0, sizeof(buf));
+    if (!RecvMsg(fd, &type, &buf) || type != MSG_HELLO || buf.size != sizeof(net_checksum) ||
+        memcmp(buf.data, net_checksum, sizeof(net_checksum)) || num_networkers == MAX_NET_WORKERS) {
+        SendMsg(fd, MSG_REJECT, NULL);
+        close(fd);
+        NetFree(&buf);
+        printf("(rejected a worker)");
+        return;
+    }
+    NetFree(&buf);
+
+    if (!SendMsg(fd, MSG_WELCOME, NULL)) {
+        close(fd);
+        return;
+    }
+    networkers[num_networkers].fd             = fd;
+    networkers[num_networkers].job            = -1;
+    networkers[num_networkers].has_totallight = false;
+    num_networkers++;
+}
+
+static void ExpirePending(double now) {
+    int32_t p;
+
+    for (p = num_pending - 1; p >= 0; p--) {
+        if (now - pending[p].since < NET_TIMEOUT)
+            continue;
+        close(pending[p].fd);
+        pending[p] = pending[--num_pending];
+        printf("(dropped a connection that never said hello)");
+    }
+}
+
+/*
+=============
+InitRadCoordinator
+
+Listen early so workers can connect while the patches are being built.
+=============
+*/
+void InitRadCoordinator(void) {
+    signal(SIGPIPE, SIG_IGN);
+    ChecksumRadNet();
+    listen_fd = OpenSocket(rad_coordinator, true);
+    if (listen_fd < 0)
+        Error("couldn't listen on %s", rad_coordinator);
+    lastworker = I_FloatTime();
+    printf("coordinator listening on %s\n", rad_coordinator);
+}
+
+static void BuildJob(int32_t phase, netjob_t *job, netbuf_t *buf) {
+    jobheader_t h;
+    int32_t i;
+
+    h.phase = phase;
+    h.first = job->first;
+    h.count = job->count;
+    NetPut(buf, &h, sizeof(h));
+    if (phase == JOB_FINALLIGHT) {
+        for (i = 0; i < job->count; i++)
+            PutFacelight(buf, job->first + i);
+    }
+}
+
+static bool SendJob(int32_t w, int32_t phase, netjob_t *job) {
+    netbuf_t buf;
+    int32_t i;
+    bool ok;
+
+    memset(&buf, 0, sizeof(buf));
+
+    if (phase == JOB_FINALLIGHT && !networkers[w].has_totallight) {
+        for (i = 0; i < num_patches; i++)
+            NetPut(&buf, patches[i].totallight, sizeof(vec3_t));
+        if (!SendMsg(networkers[w].fd, MSG_TOTALLIGHT, &buf)) {
+            NetFree(&buf);
+            return false;
+        }
+        networkers[w].has_totallight = true;
+        buf.size = 0;
+    }
+
+    BuildJob(phase, job, &buf);
+    ok = SendMsg(networkers[w].fd, MSG_JOB, &buf);
+    NetFree(&buf);
+    return ok;
+}
+
+static bool CheckFacelight(netbuf_t *buf) {
+    int32_t numsamples, numstyles;
+
+    if (!NetRead(buf, &numsamples, sizeof(int32_t)) || !NetRead(buf, &numstyles, sizeof(int32_t)))
+        return false;
+    if (!numsamples)
+        return true;
+    if (numsamples < 0 || numstyles < 0 || numstyles > MAX_STYLES)
+        return false;
+    return NetSkip(buf, numstyles, sizeof(int32_t)) &&
+           NetSkip(buf, (int64_t)numsamples * (numstyles + 1), sizeof(vec3_t));
+}
+
+/*
+=============
+CheckResult
+
+Walks a result without applying it, so a truncated or garbled one from a
+broken worker can be thrown away instead of taking the coordinator down.
+buf is left where it was.
+=============
+*/
+static bool CheckResult(int32_t phase, netjob_t *job, netbuf_t *buf) {
+    patch_t *patch;
+    size_t start = buf->readofs;
+    int32_t i, f, numtransfers, size, written;
+    bool ok = true;
+
+    for (i = 0; ok && i < job->count; i++) {
+        f = job->first + i;
+        switch (phase) {
+        case JOB_FACELIGHTS:
+            ok = CheckFacelight(buf);
+            for (patch = face_patches[f]; ok && patch; patch = patch->next)
+                ok = NetSkip(buf, 1, sizeof(vec3_t) + sizeof(int32_t));
+            break;
+
+        case JOB_TRANSFERS:
+            ok = NetRead(buf, &numtransfers, sizeof(int32_t)) &&
+                 NetSkip(buf, numtransfers, sizeof(transfer_t));
+            break;
+
+        case JOB_FINALLIGHT:
+            // PackFinalLight skips the bytes of unlit faces
+            ok = NetRead(buf, &size, sizeof(int32_t)) && NetRead(buf, &written, sizeof(int32_t)) &&
+                 NetSkip(buf, MAXLIGHTMAPS, 1) && written >= 0 && written <= size && size <= maxdata &&
+                 (FaceIsLit(f) ? NetSkip(buf, written, 1) : !written);
+            break;
+        }
+    }
+    ok           = ok && buf->readofs == buf->size;
+    buf->readofs = start;
+    return ok;
+}
+
+static void ApplyResult(int32_t phase, netjob_t *job, netbuf_t *buf) {
+    patch_t *patch;
+    int32_t i, f;
+
+    switch (phase) {
+    case JOB_FACELIGHTS:
+        for (i = 0; i < job->count; i++) {
+            f = job->first + i;
+            GetFacelight(buf, f);
+            for (patch = face_patches[f]; patch; patch = patch->next) {
+                NetGet(buf, patch->samplelight, sizeof(vec3_t));
+                NetGet(buf, &patch->samples, sizeof(int32_t));
+            }
+        }
+        break;
+
+    case JOB_TRANSFERS:
+        for (i = 0; i < job->count; i++) {
+            patch = &patches[job->first + i];
+            NetGet(buf, &patch->numtransfers, sizeof(int32_t));
+            if (patch->numtransfers > 0) {
+                patch->transfers = malloc(patch->numtransfers * sizeof(transfer_t));
+                NetGet(buf, patch->transfers, patch->numtransfers * sizeof(transfer_t));
+                total_transfer += patch->numtransfers;
+            }
+        }
+        break;
+
+    case JOB_FINALLIGHT:
+        // packed in face order once everything is in
+        job->result         = *buf;
+        job->result.readofs = 0;
+        memset(buf, 0, sizeof(*buf));
+        return;
+    }
+}
+
+/*
+=============
+RunLocalJob
+
+With no worker around the coordinator does the job itself, through the
+same code and wire format a worker uses, so the result is the same.
+=============
+*/
+static void RunLocalJob(int32_t phase, netjob_t *job) {
+    netbuf_t in, out;
+    int32_t i, transfers = total_transfer;
+
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+    BuildJob(phase, job, &in);
+    if (phase == JOB_FINALLIGHT) {
+        // the job carries them now, RunWorkerJob reads them back
+        for (i = 0; i < job->count; i++)
+            FreeFacelight(job->first + i);
+    }
+
+    RunWorkerJob(&in, &out);
+    total_transfer = transfers; // ApplyResult counts them
+    out.readofs    = sizeof(jobheader_t);
+    ApplyResult(phase, job, &out);
+
+    NetFree(&in);
+    NetFree(&out);
+}
+
+/*
+=============
+PackFinalLight
+
+Lay the lightmaps out in face order, like a single threaded FinalLightFace.
+=============
+*/
+static void PackFinalLight(netjob_t *jobs, int32_t numjobs) {
+    jobheader_t h;
+    netbuf_t *buf;
+    int32_t j, i, f, size, written;
+    uint8_t styles[MAXLIGHTMAPS];
+
+    lightdatasize = 0;
+    for (j = 0; j < numjobs; j++) {
+        buf = &jobs[j].result;
+        NetGet(buf, &h, sizeof(h));
+        for (i = 0; i < h.count; i++) {
+            f = h.first + i;
+            NetGet(buf, &size, sizeof(int32_t));
+            NetGet(buf, &written, sizeof(int32_t));
+            NetGet(buf, styles, MAXLIGHTMAPS);
+            if (!FaceIsLit(f))
+                continue;
+            if (lightdatasize + size > maxdata)
+                Error("lightdatasize %i > maxdata %i", lightdatasize + size, maxdata);
+            NetGet(buf, dlightdata_ptr + lightdatasize, written);
+            if (use_qbsp) {
+                dfacesX[f].lightofs = lightdatasize;
+                memcpy(dfacesX[f].styles, styles, MAXLIGHTMAPS);
+            } else {
+                dfaces[f].lightofs = lightdatasize;
+                memcpy(dfaces[f].styles, styles, MAXLIGHTMAPS);
+            }
+            lightdatasize += size;
+        }
+        NetFree(buf);
+    }
+}
+
+/*
+=============
+RunDistributed
+
+Hands out total items in chunks until every chunk has come back.
+=============
+*/
+static void RunDistributed(int32_t phase, int32_t total, int32_t chunk) {
+    struct pollfd fds[MAX_NET_WORKERS * 2 + 1];
+    netjob_t *jobs;
+    netbuf_t buf;
+    uint32_t type;
+    jobheader_t h;
+    int32_t numjobs, numdone = 0, nextjob = 0;
+    int32_t i, w, n, np, f, oldf = -1, timeout;
+    double start = I_FloatTime(), now;
+    bool local = false;
+
+    numjobs = (total + chunk - 1) / chunk;
+    jobs    = malloc(numjobs * sizeof(netjob_t));
+    memset(jobs, 0, numjobs * sizeof(netjob_t));
+    for (i = 0; i < numjobs; i++) {
+        jobs[i].first = i * chunk;
+        jobs[i].count = (i + 1) * chunk > total ? total - i * chunk : chunk;
+    }
+    memset(&buf, 0, sizeof(buf));
+
+    if (!num_networkers)
+        printf("waiting for workers on %s\n", rad_coordinator);
+
+    while (numdone < numjobs) {
+        // keep every idle worker busy
+        for (w = 0; w < num_networkers; w++) {
+            if (networkers[w].job >= 0)
+                continue;
+            for (n = 0; n < numjobs; n++) {
+                i = (nextjob + n) % numjobs;
+                if (!jobs[i].assigned && !jobs[i].done)
+                    break;
+            }
+            if (n == numjobs)
+                break;
+            nextjob = i + 1;
+            jobs[i].assigned  = true;
+            networkers[w].job = i;
+            if (!SendJob(w, phase, &jobs[i])) {
+                DropWorker(w, jobs);
+                w--;
+            }
+        }
+
+        now = I_FloatTime();
+        ExpirePending(now);
+        if (num_networkers)
+            lastworker = now;
+
+        // nobody to hand the work to, do a job here between polls
+        timeout = -1;
+        if (!num_networkers) {
+            if (now - lastworker >= NET_WAIT) {
+                if (!local)
+                    printf("(no workers for %i seconds, lighting here)", NET_WAIT);
+                local = true;
+                timeout = 0;
+            } else
+                timeout = (int32_t)((NET_WAIT - (now - lastworker)) * 1000) + 1;
+        }
+        if (num_pending && (timeout < 0 || timeout > 1000))
+            timeout = 1000; // to expire them
+
+        fds[0].fd     = listen_fd;
+        fds[0].events = POLLIN;
+        for (w = 0; w < num_networkers; w++) {
+            fds[w + 1].fd     = networkers[w].fd;
+            fds[w + 1].events = POLLIN;
+        }
+        n  = num_networkers;
+        np = num_pending;
+        for (w = 0; w < np; w++) {
+            fds[n + 1 + w].fd     = pending[w].fd;
+            fds[n + 1 + w].events = POLLIN;
+        }
+        if (poll(fds, n + np + 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            Error("poll failed");
+        }
+
+        if (!timeout) {
+            for (i = 0; i < numjobs; i++) {
+                if (!jobs[i].assigned && !jobs[i].done)
+                    break;
+            }
+            if (i < numjobs) {
+                RunLocalJob(phase, &jobs[i]);
+                jobs[i].done = true;
+                numdone++;
+            }
+        }
+
+        for (w = n - 1; w >= 0; w--) {
+            if (!fds[w + 1].revents)
+                continue;
+            if (!RecvMsg(networkers[w].fd, &type, &buf) || type != MSG_RESULT) {
+                DropWorker(w, jobs);
+                continue;
+            }
+            i = networkers[w].job;
+            if (!NetRead(&buf, &h, sizeof(h)) || i < 0 || h.phase != phase || h.first != jobs[i].first || h.count != jobs[i].count) {
+                // a stale or broken worker, its job goes to someone else
+                printf("(worker returned the wrong job)");
+                DropWorker(w, jobs);
+                continue;
+            }
+            if (!CheckResult(phase, &jobs[i], &buf)) {
+                printf("(worker returned a bad result)");
+                DropWorker(w, jobs);
+                continue;
+            }
+            ApplyResult(phase, &jobs[i], &buf);
+            buf.readofs       = 0;
+            jobs[i].done      = true;
+            networkers[w].job = -1;
+            numdone++;
+
+            f = 10 * numdone / numjobs;
+            if (f != oldf) {
+                oldf = f;
+                printf("%i...", f);
+                fflush(stdout);
+            }
+        }
+
+        // pending only ever shrinks by a swap from the end, so go backwards
+        for (w = np - 1; w >= 0; w--) {
+            if (fds[n + 1 + w].revents)
+                GreetWorker(w);
+        }
+        if (fds[0].revents & POLLIN)
+            AcceptWorker();
+    }
+
+    if (phase == JOB_FINALLIGHT)
+        PackFinalLight(jobs, numjobs);
+
+    NetFree(&buf);
+    free(jobs);
+    printf(" (%i, %i workers)\n", (int32_t)(I_FloatTime() - start), num_networkers);
+}
+
+void DistributeFacelights(void) {
+    RunDistributed(JOB_FACELIGHTS, numfaces, FACE_CHUNK);
+}
+
+void DistributeTransfers(void) {
+    RunDistributed(JOB_TRANSFERS, num_patches, PATCH_CHUNK);
+    qprintf("transfer lists: %5.1f megs\n", (float)total_transfer * sizeof(transfer_t) / (1024 * 1024));
+}
+
+void DistributeFinalLight(void) {
+    RunDistributed(JOB_FINALLIGHT, numfaces, FACE_CHUNK);
+}
+
+/*
+=============
+ShutdownRadCoordinator
+=============
+*/
+void ShutdownRadCoordinator(void) {
+    int32_t w;
+
+    for (w = 0; w < num_networkers; w++) {
+        SendMsg(networkers[w].fd, MSG_DONE, NULL);
+        close(networkers[w].fd);
+    }
+    num_networkers = 0;
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+    if (!strncmp(rad_coordinator, "unix:", 5))
+        unlink(rad_coordinator + 5);
+}
+
+#else // _WIN32
+
+void RunRadWorker(void) {
+    Error("-worker is not supported on this platform");
+}
+
+void InitRadCoordinator(void) {
+    Error("-coordinator is not supported on this platform");
+}
+
+void DistributeFacelights(void) {
+}
+
+void DistributeTransfers(void) {
+}
+
+void DistributeFinalLight(void) {
+}
+
+void ShutdownRadCoordinator(void) {
+}
+
+#endif
@@ -36,6 +36,7 @@ typedef struct
     char filename[1024];
     char *buffer, *script_p, *end_p;
     int32_t line;
+    bool mapped; // buffer came from MapFile, not ParseFromMemory
 } script_t;
 
 #define MAX_INCLUDES 8
@@ -47,6 +48,11 @@ char token[MAXTOKEN];
 bool endofscript;
 bool tokenready; // only true if UnGetToken was just called
 
+// the last token scanned, token only holds it once GetToken copied it
+static char *viewstart;
+static int32_t viewlength;
+static bool tokenstale;
+
 // qb: brush info from AA tools
 char brush_info[2000]      = "No brushes processed yet. Look near beginning of map";
 static int32_t brush_begin = 1;
@@ -66,9 +72,12 @@ void TestBrushBegin() {
 /*
 ==============
 AddScriptToStack
+
+The file is mapped rather than read, tokens are scanned in place.
 ==============
 */
 void AddScriptToStack(char *filename) {
+    FILE *f;
     int32_t size;
 
     script++;
@@ -76,7 +85,11 @@ void AddScriptToStack(char *filename) {
         Error("script file exceeded MAX_INCLUDES");
     strcpy(script->filename, ExpandPath(filename));
 
-    size = LoadFile(script->filename, (void **)&script->buffer);
+    f    = SafeOpenRead(script->filename);
+    size = Q_filelength(f);
+    fclose(f);
+    script->buffer = size ? MapFile(script->filename, &size) : NULL;
+    script->mapped = true;
 
     printf("entering %s\n", script->filename);
 
@@ -97,6 +110,7 @@ void LoadScriptFile(char *filename) {
 
     endofscript = false;
     tokenready  = false;
+    tokenstale  = false;
 }
 
 /*
@@ -112,12 +126,14 @@ void ParseFromMemory(char *buffer, int32_t size) {
     strcpy(script->filename, "memory buffer");
 
     script->buffer   = buffer;
+    script->mapped   = false;
     script->line     = 1;
     script->script_p = script->buffer;
     script->end_p    = script->buffer + size;
 
     endofscript      = false;
     tokenready       = false;
+    tokenstale       = false;
 }
 
 /*
@@ -138,16 +154,25 @@ void UnGetToken(void) {
     tokenready = true;
 }
 
-bool EndOfScript(bool crossline) {
+/*
+==============
+EndOfScript
+
+Returns true if an included script was left and scanning should go on
+in the one that included it.
+==============
+*/
+static bool EndOfScript(bool crossline) {
     if (!crossline)
         Error("Line %i is incomplete\n", scriptline);
 
-    if (!strcmp(script->filename, "memory buffer")) {
+    if (!script->mapped) {
         endofscript = true;
         return false;
     }
 
-    free(script->buffer);
+    if (script->buffer)
+        UnmapFile(script->buffer, script->end_p - script->buffer);
     if (script == scriptstack + 1) {
         endofscript = true;
         return false;
@@ -155,107 +180,265 @@ bool EndOfScript(bool crossline) {
     script--;
     scriptline = script->line;
     printf("returning to %s\n", script->filename);
-    return GetToken(crossline);
+    return true;
 }
 
 /*
 ==============
-GetToken
+ScanToken
+
+Finds the next token without copying it.  The buffer isn't terminated,
+so every read is checked against end_p.
 ==============
 */
-bool GetToken(bool crossline) {
-    char *token_p;
+static bool ScanToken(bool crossline, char **start, int32_t *length) {
+    char *p, *end;
 
-    if (tokenready) // is a token allready waiting?
-    {
-        tokenready = false;
-        return true;
+restart:
+    if (script->script_p >= script->end_p) {
+        if (EndOfScript(crossline))
+            goto restart;
+        return false;
     }
 
-    if (script->script_p >= script->end_p)
-        return EndOfScript(crossline);
-
     TestBrushBegin();
 //
 // skip space
 //
 skipspace:
-    while (*script->script_p <= 32) {
-        if (script->script_p >= script->end_p)
-            return EndOfScript(crossline);
-        if (*script->script_p++ == '\n') {
+    p   = script->script_p;
+    end = script->end_p;
+    while (p < end && *p <= 32) {
+        if (*p++ == '\n') {
             if (!crossline)
                 Error("Line %i is incomplete\n", scriptline);
             scriptline = script->line++;
         }
     }
+    script->script_p = p;
 
-    if (script->script_p >= script->end_p)
-        return EndOfScript(crossline);
+    if (p >= end) {
+        if (EndOfScript(crossline))
+            goto restart;
+        return false;
+    }
 
     // ; # // comments
-    if (*script->script_p == ';' || *script->script_p == '#' || (script->script_p[0] == '/' && script->script_p[1] == '/')) {
+    if (*p == ';' || *p == '#' || (*p == '/' && p + 1 < end && p[1] == '/')) {
         if (!crossline)
             Error("Line %i is incomplete\n", scriptline);
-        while (*script->script_p++ != '\n')
-            if (script->script_p >= script->end_p)
-                return EndOfScript(crossline);
-        scriptline = script->line++;
+        p = memchr(p, '\n', end - p);
+        if (!p) {
+            script->script_p = end;
+            if (EndOfScript(crossline))
+                goto restart;
+            return false;
+        }
+        script->script_p = p + 1;
+        scriptline       = script->line++;
         goto skipspace;
     }
 
     // /* */ comments
-    if (script->script_p[0] == '/' && script->script_p[1] == '*') {
+    if (*p == '/' && p + 1 < end && p[1] == '*') {
         if (!crossline)
             Error("Line %i is incomplete\n", scriptline);
-        script->script_p += 2;
-        while (script->script_p[0] != '*' && script->script_p[1] != '/') {
-            if (script->script_p[0] == '\n')
+        p += 2;
+        while (p < end && p[0] != '*' && (p + 1 >= end || p[1] != '/')) {
+            if (p[0] == '\n')
                 scriptline = script->line++;
-            script->script_p++;
-            if (script->script_p >= script->end_p)
-                return EndOfScript(crossline);
+            p++;
+        }
+        if (p >= end) {
+            script->script_p = end;
+            if (EndOfScript(crossline))
+                goto restart;
+            return false;
         }
-        script->script_p += 2;
+        script->script_p = p + 2;
         goto skipspace;
     }
 
-    //
-    // copy token
-    //
-    token_p = token;
-
-    if (*script->script_p == '"') {
+    if (*p == '"') {
         // quoted token
-        script->script_p++;
-        while (*script->script_p != '"') {
-            *token_p++ = *script->script_p++;
-            if (script->script_p == script->end_p)
-                break;
-            if (token_p == &token[MAXTOKEN])
+        *start = ++p;
+        while (p < end && *p != '"') {
+            p++;
+            if (p - *start == MAXTOKEN)
                 Error("Token too large on line %i\n", scriptline);
         }
-        script->script_p++;
-    } else // regular token
-        while (*script->script_p > 32 && *script->script_p != ';') {
-            *token_p++ = *script->script_p++;
-            if (script->script_p == script->end_p)
-                break;
-            if (token_p == &token[MAXTOKEN])
+        *length          = p - *start;
+        script->script_p = p + 1;
+    } else { // regular token
+        *start = p;
+        while (p < end && *p > 32 && *p != ';') {
+            p++;
+            if (p - *start == MAXTOKEN)
                 Error("Token too large on line %i\n", scriptline);
         }
+        *length          = p - *start;
+        script->script_p = p;
+    }
+
+    return true;
+}
+
+/*
+==============
+GetTokenView
+
+Like GetToken, but start and length point into the script itself and
+token isn't filled in.  The view stays valid until the next token.
+==============
+*/
+bool GetTokenView(bool crossline, char **start, int32_t *length) {
+    if (tokenready) // is a token allready waiting?
+    {
+        tokenready = false;
+        if (tokenstale) {
+            *start  = viewstart;
+            *length = viewlength;
+        } else {
+            *start  = token;
+            *length = strlen(token);
+        }
+        return true;
+    }
 
-    *token_p = 0;
+    if (!ScanToken(crossline, start, length))
+        return false;
 
-    if (!strcmp(token, "$include")) {
+    if (*length == 8 && !memcmp(*start, "$include", 8)) {
         GetToken(false);
         AddScriptToStack(token);
-        return GetToken(crossline);
+        return GetTokenView(crossline, start, length);
+    }
+
+    viewstart  = *start;
+    viewlength = *length;
+    tokenstale = true;
+    return true;
+}
+
+/*
+==============
+GetToken
+==============
+*/
+bool GetToken(bool crossline) {
+    char *start;
+    int32_t length;
+
+    if (tokenready && !tokenstale) {
+        tokenready = false;
+        return true;
     }
 
+    if (!GetTokenView(crossline, &start, &length))
+        return false;
+
+    memcpy(token, start, length);
+    token[length] = 0;
+    tokenstale    = false;
+
     return true;
 }
 
+/*
+==============
+GetTokenFloat
+
+Reads a number in place.  Plain decimals with up to 15 significant digits
+convert exactly from the integer mantissa and one division by a power of
+ten, which is what atof rounds to as well.  Anything else goes to atof.
+==============
+*/
+static const double powersof10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+double GetTokenFloat(bool crossline) {
+    char *start, *p, *end;
+    char buffer[MAXTOKEN];
+    int32_t length, digits, frac;
+    uint64_t mantissa;
+    bool negative, sawdigit;
+    double v;
+
+    if (!GetTokenView(crossline, &start, &length))
+        return 0;
+    p   = start;
+    end = start + length;
+
+    negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    mantissa = 0;
+    digits = frac = 0;
+    sawdigit      = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (mantissa || *p != '0')
+            digits++;
+        mantissa = mantissa * 10 + (*p - '0');
+        sawdigit = true;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (mantissa || *p != '0')
+                digits++;
+            mantissa = mantissa * 10 + (*p - '0');
+            sawdigit = true;
+            frac++;
+        }
+    }
+
+    if (p == end && sawdigit && digits <= 15 && frac <= 22) {
+        v = (double)mantissa;
+        if (frac)
+            v /= powersof10[frac];
+        return negative ? -v : v;
+    }
+
+    memcpy(buffer, start, length);
+    buffer[length] = 0;
+    return atof(buffer);
+}
+
+/*
+==============
+GetTokenInt
+
+atoi on the token in place.
+==============
+*/
+int32_t GetTokenInt(bool crossline) {
+    char *start, *p, *end;
+    char buffer[MAXTOKEN];
+    int32_t length, digits, v;
+    bool negative;
+
+    if (!GetTokenView(crossline, &start, &length))
+        return 0;
+    p   = start;
+    end = start + length;
+
+    negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    v = digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9' && digits < 10; p++, digits++)
+        v = v * 10 + (*p - '0');
+
+    if (digits && digits < 10)
+        return negative ? -v : v;
+
+    memcpy(buffer, start, length);
+    buffer[length] = 0;
+    return atoi(buffer);
+}
+
 /*
 ==============
 TokenAvailable
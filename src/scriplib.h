@@ -39,5 +39,8 @@ void LoadScriptFile(char *filename);
 void ParseFromMemory(char *buffer, int32_t size);
 
 bool GetToken(bool crossline);
+bool GetTokenView(bool crossline, char **start, int32_t *length);
+double GetTokenFloat(bool crossline);
+int32_t GetTokenInt(bool crossline);
 void UnGetToken(void);
 bool TokenAvailable(void);
@@ -0,0 +1,328 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "cmdlib.h"
+#include "texcache.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+==============================================================================
+
+TEXTURE CACHE
+
+moddir/q2tool_textures.cache keeps what bsp and rad read out of texture
+files: the miptex flags for FindMiptex, the average colour for
+CalcTextureReflectivity.  A record is found by a key hashing everything
+the result came from: the texture name, the size and time of every file
+the lookup would try, the size and time of every pak it would search,
+and whatever else the caller adds.  Touching any of them gives a new key,
+so nothing is ever invalidated; records no run has used for
+TEXCACHE_MAXAGE runs are dropped.
+
+A warm compile stats the candidates and reads no texture at all.
+
+Lookups come from the serial parts of bsp and rad and take no lock.
+Disable with -notexcache.
+==============================================================================
+*/
+
+#define TEXCACHE_ID      (('1' << 24) + ('C' << 16) + ('X' << 8) + 'T') // "TXC1"
+#define TEXCACHE_VERSION 1
+#define TEXCACHE_MAXAGE  16
+
+typedef struct
+{
+    int32_t ident;
+    int32_t version;
+    int32_t numentries;
+} texcache_header_t;
+
+typedef struct
+{
+    uint8_t key[16];
+    int32_t age; // runs since the record was last used
+    int32_t length;
+    uint8_t data[TEXCACHE_DATA];
+} texcache_entry_t;
+
+// what a key holds for each file it depends on
+typedef struct
+{
+    int32_t exists;
+    int32_t pad;
+    int64_t size;
+    int64_t mtime;
+} filestamp_t;
+
+bool notexcache; // qb: -notexcache
+
+static char cache_path[1040];
+static bool cache_loaded, cache_dirty;
+static texcache_entry_t *entries;
+static int32_t numentries, maxentries;
+static int32_t *entryhash; // entries index + 1, 0 is empty
+static int32_t hashmask;
+static int32_t c_hits, c_misses;
+
+static uint32_t EntryHash(uint8_t *key) {
+    return key[0] | (key[1] << 8) | (key[2] << 16) | ((uint32_t)key[3] << 24);
+}
+
+static void RehashEntries(void) {
+    int32_t i, size;
+    uint32_t h;
+
+    for (size = 256; size < numentries * 2 + 2; size <<= 1)
+        ;
+    free(entryhash);
+    entryhash = malloc(size * sizeof(int32_t));
+    memset(entryhash, 0, size * sizeof(int32_t));
+    hashmask = size - 1;
+
+    for (i = 0; i < numentries; i++) {
+        for (h = EntryHash(entries[i].key); entryhash[h & hashmask]; h++)
+            ;
+        entryhash[h & hashmask] = i + 1;
+    }
+}
+
+static texcache_entry_t *FindEntry(uint8_t *key) {
+    uint32_t h;
+    int32_t e;
+
+    for (h = EntryHash(key); (e = entryhash[h & hashmask]); h++)
+        if (!memcmp(entries[e - 1].key, key, 16))
+            return &entries[e - 1];
+    return NULL;
+}
+
+/*
+=============
+LoadTextureCache
+
+Every record ages by one run as it is loaded.
+=============
+*/
+static void LoadTextureCache(void) {
+    texcache_header_t header;
+    FILE *f;
+    int32_t i;
+
+    cache_loaded = true;
+    if (notexcache || !moddir[0])
+        return;
+
+    sprintf(cache_path, "%sq2tool_textures.cache", moddir);
+
+    f = fopen(cache_path, "rb");
+    if (f) {
+        if (fread(&header, sizeof(header), 1, f) == 1 &&
+            header.ident == TEXCACHE_ID &&
+            header.version == TEXCACHE_VERSION &&
+            header.numentries > 0 && header.numentries < 0x100000) {
+            numentries = maxentries = header.numentries;
+            entries                 = malloc(numentries * sizeof(texcache_entry_t));
+            if (fread(entries, sizeof(texcache_entry_t), numentries, f) != numentries)
+                numentries = 0;
+        }
+        fclose(f);
+    }
+
+    for (i = 0; i < numentries; i++)
+        entries[i].age++;
+    RehashEntries();
+}
+
+/*
+=============
+TexCacheKeyBegin
+=============
+*/
+void TexCacheKeyBegin(texcachekey_t *key, char *kind, char *name) {
+    mdfour_begin(&key->md);
+    TexCacheKeyData(key, kind, strlen(kind) + 1);
+    TexCacheKeyData(key, name, strlen(name) + 1);
+}
+
+void TexCacheKeyData(texcachekey_t *key, void *data, int32_t length) {
+    mdfour_update(&key->md, data, length);
+}
+
+static bool AddFileStamp(texcachekey_t *key, char *path) {
+    filestamp_t stamp;
+    struct stat st;
+
+    memset(&stamp, 0, sizeof(stamp));
+    if (!stat(path, &st)) {
+        stamp.exists = 1;
+        stamp.size   = st.st_size;
+        stamp.mtime  = st.st_mtime;
+    }
+
+    TexCacheKeyData(key, path, strlen(path) + 1);
+    TexCacheKeyData(key, &stamp, sizeof(stamp));
+    return stamp.exists;
+}
+
+/*
+=============
+TexCacheKeyFile
+
+Adds path and its size and time, or that it is missing.
+=============
+*/
+void TexCacheKeyFile(texcachekey_t *key, char *path) {
+    AddFileStamp(key, path);
+}
+
+/*
+=============
+TexCacheKeyPaks
+
+Adds every pak TryLoadFileFromPak would search in gamedir.
+=============
+*/
+void TexCacheKeyPaks(texcachekey_t *key, char *gamedir) {
+    char path[1040];
+    int32_t pakn;
+
+    for (pakn = 0;; pakn++) {
+        sprintf(path, "%spak%d.pak", gamedir, pakn);
+        if (!AddFileStamp(key, path))
+            break;
+    }
+}
+
+/*
+=============
+TexCacheFind
+
+Finishes the key.  Copies the record to data and returns true if there
+is one of exactly length bytes.
+=============
+*/
+bool TexCacheFind(texcachekey_t *key, void *data, int32_t length) {
+    texcache_entry_t *e;
+
+    mdfour_result(&key->md, key->digest);
+
+    if (!cache_loaded)
+        LoadTextureCache();
+    if (!cache_path[0])
+        return false;
+
+    e = FindEntry(key->digest);
+    if (!e || e->length != length) {
+        c_misses++;
+        return false;
+    }
+
+    memcpy(data, e->data, length);
+    e->age = 0;
+    c_hits++;
+    return true;
+}
+
+/*
+=============
+TexCacheStore
+
+key must have been through TexCacheFind.
+=============
+*/
+void TexCacheStore(texcachekey_t *key, void *data, int32_t length) {
+    texcache_entry_t *e;
+
+    if (!cache_path[0])
+        return;
+    if (length > TEXCACHE_DATA)
+        Error("TexCacheStore: %i byte record", length);
+
+    e = FindEntry(key->digest);
+    if (!e) {
+        if (numentries == maxentries) {
+            maxentries = maxentries * 2 + 256;
+            entries    = realloc(entries, maxentries * sizeof(texcache_entry_t));
+        }
+        e = &entries[numentries++];
+        memset(e, 0, sizeof(*e));
+        memcpy(e->key, key->digest, 16);
+
+        if (numentries * 2 + 2 > hashmask + 1)
+            RehashEntries();
+        else {
+            uint32_t h;
+
+            for (h = EntryHash(key->digest); entryhash[h & hashmask]; h++)
+                ;
+            entryhash[h & hashmask] = numentries;
+        }
+    }
+
+    e->age    = 0;
+    e->length = length;
+    memcpy(e->data, data, length);
+    cache_dirty = true;
+}
+
+/*
+=============
+SaveTextureCache
+
+Writes the cache if anything was added.  Call at the end of a pass.
+=============
+*/
+void SaveTextureCache(void) {
+    texcache_header_t header;
+    char tmppath[1060];
+    int32_t i, kept;
+    FILE *f;
+
+    if (c_hits + c_misses)
+        qprintf("texture cache: %i hits, %i misses\n", c_hits, c_misses);
+    c_hits = c_misses = 0;
+
+    if (!cache_dirty)
+        return;
+    cache_dirty = false;
+
+    kept        = 0;
+    for (i = 0; i < numentries; i++)
+        if (entries[i].age <= TEXCACHE_MAXAGE)
+            kept++;
+
+    memset(&header, 0, sizeof(header));
+    header.ident      = TEXCACHE_ID;
+    header.version    = TEXCACHE_VERSION;
+    header.numentries = kept;
+
+    sprintf(tmppath, "%s.tmp", cache_path);
+    f = SafeOpenWrite(tmppath);
+    SafeWrite(f, &header, sizeof(header));
+    for (i = 0; i < numentries; i++)
+        if (entries[i].age <= TEXCACHE_MAXAGE)
+            SafeWrite(f, &entries[i], sizeof(texcache_entry_t));
+    fclose(f);
+
+    remove(cache_path);
+    if (rename(tmppath, cache_path))
+        printf("WARNING: couldn't rename %s to %s\n", tmppath, cache_path);
+}
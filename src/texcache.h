@@ -0,0 +1,46 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+// persistent texture info cache, see texcache.c
+
+#ifndef _TEXCACHE_H
+#define _TEXCACHE_H
+
+#include "mdfour.h"
+
+#define TEXCACHE_DATA 96 // largest record a lookup can store
+
+typedef struct
+{
+    struct mdfour md;
+    uint8_t digest[16];
+} texcachekey_t;
+
+extern bool notexcache;
+
+void TexCacheKeyBegin(texcachekey_t *key, char *kind, char *name);
+void TexCacheKeyData(texcachekey_t *key, void *data, int32_t length);
+void TexCacheKeyFile(texcachekey_t *key, char *path);
+void TexCacheKeyPaks(texcachekey_t *key, char *gamedir);
+bool TexCacheFind(texcachekey_t *key, void *data, int32_t length);
+void TexCacheStore(texcachekey_t *key, void *data, int32_t length);
+void SaveTextureCache(void);
+
+#endif
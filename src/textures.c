@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "qbsp.h"
+#include "texcache.h"
 
 int32_t nummiptex;
 textureref_t textureref[MAX_MAP_TEXTURES];
@@ -26,8 +27,49 @@ bool h2tex;
 
 //==========================================================================
 
+// qb: what FindMiptex keeps in the texture cache
+typedef struct
+{
+    int32_t found;
+    int32_t flags;
+    int32_t value;
+    int32_t contents;
+    char animname[64];
+} miptexinfo_t;
+
+/*
+==================
+MiptexCacheKey
+
+Every file and pak FindMiptex would look in for a .wal.
+==================
+*/
+static void MiptexCacheKey(texcachekey_t *key, char *name) {
+    char path[1080];
+
+    TexCacheKeyBegin(key, "miptex", name);
+    if (moddir[0] != 0) {
+        sprintf(path, "%stextures/%s.wal", moddir, name);
+        TexCacheKeyFile(key, path);
+        TexCacheKeyPaks(key, moddir);
+    }
+    sprintf(path, "%stextures/%s.wal", basedir, name);
+    TexCacheKeyFile(key, path);
+    TexCacheKeyPaks(key, basedir);
+}
+
+static void SetMiptexRef(int32_t i, miptex_t *mt) {
+    textureref[i].value    = LittleLong(mt->value);
+    textureref[i].flags    = LittleLong(mt->flags);
+    textureref[i].contents = LittleLong(mt->contents);
+    strcpy(textureref[i].animname, mt->animname);
+}
+
 int32_t FindMiptex(char *name) {
     int32_t i, mod_fail;
+    bool cached;
+    texcachekey_t key;
+    miptexinfo_t info;
     char path[1080];
     char pakpath[56];
     miptex_t *mt;
@@ -43,9 +85,23 @@ int32_t FindMiptex(char *name) {
     strcpy(textureref[i].name, name);
 
     mod_fail = true;
+    cached   = false;
+
+    // qb: a warm compile takes the flags from the texture cache
+    if (!h2tex) {
+        MiptexCacheKey(&key, name);
+        if (TexCacheFind(&key, &info, sizeof(info))) {
+            textureref[i].flags    = info.flags;
+            textureref[i].value    = info.value;
+            textureref[i].contents = info.contents;
+            strcpy(textureref[i].animname, info.animname);
+            mod_fail = !info.found;
+            cached   = true;
+        }
+    }
 
     // load the miptex to get the flags and values
-    if (moddir[0] != 0) {
+    if (!cached && moddir[0] != 0) {
         if (h2tex) {
             sprintf(pakpath, "textures/%s.m32", name);
             sprintf(path, "%s%s", moddir, pakpath);
@@ -72,33 +128,41 @@ int32_t FindMiptex(char *name) {
             sprintf(pakpath, "textures/%s.wal", name);
             sprintf(path, "%s%s", moddir, pakpath);
             // load the miptex to get the flags and values
-            if (TryLoadFile(path, (void **)&mt, false) != -1 ||
-                TryLoadFileFromPak(pakpath, (void **)&mt, moddir) != -1) {
-                textureref[i].value    = LittleLong(mt->value);
-                textureref[i].flags    = LittleLong(mt->flags);
-                textureref[i].contents = LittleLong(mt->contents);
-                strcpy(textureref[i].animname, mt->animname);
+            if (TryLoadFile(path, (void **)&mt, false) != -1) {
+                SetMiptexRef(i, mt);
                 free(mt);
                 mod_fail = false;
+            } else if (TryMapFileFromPak(pakpath, (void **)&mt, moddir) != -1) {
+                SetMiptexRef(i, mt); // points into the pak, nothing to free
+                mod_fail = false;
             }
         }
     }
 
-    if (mod_fail) {
+    if (!cached && mod_fail) {
         // load the miptex to get the flags and values
         sprintf(path, "%s%s", basedir, pakpath);
 
-        if (TryLoadFile(path, (void **)&mt, false) != -1 ||
-            TryLoadFileFromPak(pakpath, (void **)&mt, basedir) != -1) {
-            textureref[i].value    = LittleLong(mt->value);
-            textureref[i].flags    = LittleLong(mt->flags);
-            textureref[i].contents = LittleLong(mt->contents);
-            strcpy(textureref[i].animname, mt->animname);
+        if (TryLoadFile(path, (void **)&mt, false) != -1) {
+            SetMiptexRef(i, mt);
             free(mt);
             mod_fail = false;
+        } else if (TryMapFileFromPak(pakpath, (void **)&mt, basedir) != -1) {
+            SetMiptexRef(i, mt); // points into the pak, nothing to free
+            mod_fail = false;
         }
     }
 
+    if (!cached && !h2tex) {
+        memset(&info, 0, sizeof(info));
+        info.found    = !mod_fail;
+        info.flags    = textureref[i].flags;
+        info.value    = textureref[i].value;
+        info.contents = textureref[i].contents;
+        strcpy(info.animname, textureref[i].animname);
+        TexCacheStore(&key, &info, sizeof(info));
+    }
+
     if (mod_fail)
         printf("WARNING: couldn't locate texture %s\n", name);
 
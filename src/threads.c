@@ -29,6 +29,7 @@ volatile int32_t oldf;
 volatile bool pacifier;
 
 volatile bool threaded;
+volatile int32_t threadruns; // bumped as each RunThreadsOn starts
 
 /*
 =============
@@ -128,6 +129,33 @@ void ThreadUnlock(void) {
     LeaveCriticalSection(&crit);
 }
 
+/*
+=============
+ThreadMutex
+
+A lock of its own, for shared tables that shouldn't wait on ThreadLock.
+=============
+*/
+struct threadmutex_s {
+    CRITICAL_SECTION crit;
+};
+
+threadmutex_t *ThreadMutexCreate(void) {
+    threadmutex_t *m;
+
+    m = malloc(sizeof(*m));
+    InitializeCriticalSection(&m->crit);
+    return m;
+}
+
+void ThreadMutexLock(threadmutex_t *m) {
+    EnterCriticalSection(&m->crit);
+}
+
+void ThreadMutexUnlock(threadmutex_t *m) {
+    LeaveCriticalSection(&m->crit);
+}
+
 /*
 =============
 RunThreadsOn
@@ -141,6 +169,7 @@ void RunThreadsOn(int32_t workcnt, bool showpacifier, void (*func)(int32_t)) {
 
     start     = I_FloatTime();
     dispatch  = 0;
+    threadruns++;
     workcount = workcnt;
     oldf      = -1;
     pacifier  = showpacifier;
@@ -202,6 +231,34 @@ void ThreadUnlock(void) {
         pthread_mutex_unlock(my_mutex);
 }
 
+/*
+=============
+ThreadMutex
+
+A lock of its own, for shared tables that shouldn't wait on ThreadLock.
+=============
+*/
+struct threadmutex_s {
+    pthread_mutex_t mutex;
+};
+
+threadmutex_t *ThreadMutexCreate(void) {
+    threadmutex_t *m;
+
+    m = malloc(sizeof(*m));
+    if (pthread_mutex_init(&m->mutex, NULL))
+        Error("pthread_mutex_init failed");
+    return m;
+}
+
+void ThreadMutexLock(threadmutex_t *m) {
+    pthread_mutex_lock(&m->mutex);
+}
+
+void ThreadMutexUnlock(threadmutex_t *m) {
+    pthread_mutex_unlock(&m->mutex);
+}
+
 /*
 =============
 RunThreadsOn
@@ -217,6 +274,7 @@ void RunThreadsOn(int32_t workcnt, bool showpacifier, void (*func)(int32_t)) {
 
     start     = I_FloatTime();
     dispatch  = 0;
+    threadruns++;
     workcount = workcnt;
     oldf      = -1;
     pacifier  = showpacifier;
@@ -279,6 +337,16 @@ void ThreadLock(void) {
 void ThreadUnlock(void) {
 }
 
+threadmutex_t *ThreadMutexCreate(void) {
+    return NULL;
+}
+
+void ThreadMutexLock(threadmutex_t *m) {
+}
+
+void ThreadMutexUnlock(threadmutex_t *m) {
+}
+
 /*
 =============
 RunThreadsOn
@@ -288,6 +356,7 @@ void RunThreadsOn(int32_t workcnt, bool showpacifier, void (*func)(int32_t)) {
     int32_t start, end;
 
     dispatch  = 0;
+    threadruns++;
     workcount = workcnt;
     oldf      = -1;
     pacifier  = showpacifier;
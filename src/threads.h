@@ -19,6 +19,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 extern int32_t numthreads;
+extern volatile bool threaded;
+extern volatile int32_t threadruns;
 
 void ThreadSetDefault(void);
 int32_t GetThreadWork(void);
@@ -26,3 +28,9 @@ void RunThreadsOnIndividual(int32_t workcnt, bool showpacifier, void (*func)(int
 void RunThreadsOn(int32_t workcnt, bool showpacifier, void (*func)(int32_t));
 void ThreadLock(void);
 void ThreadUnlock(void);
+
+typedef struct threadmutex_s threadmutex_t;
+
+threadmutex_t *ThreadMutexCreate(void);
+void ThreadMutexLock(threadmutex_t *m);
+void ThreadMutexUnlock(threadmutex_t *m);
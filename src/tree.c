@@ -19,7 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 #include "qbsp.h"
 
-extern int32_t c_nodes;
+extern THREAD_LOCAL int32_t c_nodes;
 
 void RemovePortalFromNode(portal_t *portal, node_t *l);
 
@@ -92,9 +92,8 @@ void FreeTree_r(node_t *node) {
     if (node->volume)
         FreeBrush(node->volume);
 
-    if (numthreads == 1)
-        c_nodes--;
-    free(node);
+    c_nodes--;
+    PoolFree(node);
 }
 
 /*
@@ -103,9 +102,18 @@ FreeTree
 =============
 */
 void FreeTree(tree_t *tree) {
+    int32_t i;
+
     FreeTreePortals_r(tree->headnode);
     FreeTree_r(tree->headnode);
     free(tree);
+
+    // give the slabs back at once if no other tree is holding any
+    PoolRelease(&nodepool);
+    PoolRelease(&portalpool);
+    PoolRelease(&facepool);
+    for (i = 0; i < NUM_BRUSH_POOLS; i++)
+        PoolRelease(&brushpools[i]);
 }
 
 //===============================================================
@@ -44,6 +44,7 @@ int32_t portalbytes, portallongs;
 
 bool fastvis;
 bool nosort;
+int32_t vislevel = 4; // qb: -level, 0 is -fast, 4 full flow
 
 int32_t totalvis;
 
@@ -130,16 +131,21 @@ LeafVectorFromPortalVector
 ==============
 */
 int32_t LeafVectorFromPortalVector(uint8_t *portalbits, uint8_t *leafbits) {
-    int32_t i;
+    int32_t i, j, bits;
     portal_t *p;
     int32_t c_leafs;
 
     memset(leafbits, 0, leafbytes);
 
-    for (i = 0; i < numportals * 2; i++) {
-        if (portalbits[i >> 3] & (1 << (i & 7))) {
-            p = portals + i;
-            leafbits[p->leaf >> 3] |= (1 << (p->leaf & 7));
+    // skip empty words, most of a portal row is zero
+    for (i = 0; i < portallongs; i++) {
+        if (!((uint32_t *)portalbits)[i])
+            continue;
+        for (j = i * 4; j < i * 4 + 4; j++) {
+            for (bits = portalbits[j]; bits; bits &= bits - 1) {
+                p = portals + (j << 3) + LowestBit(bits);
+                leafbits[p->leaf >> 3] |= (1 << (p->leaf & 7));
+            }
         }
     }
 
@@ -148,6 +154,147 @@ int32_t LeafVectorFromPortalVector(uint8_t *portalbits, uint8_t *leafbits) {
     return c_leafs;
 }
 
+/*
+===============
+Compressed rows
+
+ClusterMerge and CalcPHS run a cluster per work item.  Each compresses
+its row into its own buffer and StoreVisRows copies them into the vis
+lump in cluster order afterwards, so the lump is the same however the
+threads ran.
+
+Clusters in the same room often have identical rows.  A row that is
+already in the lump, pvs or phs, is pointed at instead of stored again;
+the engine only follows bitofs so this is invisible to it.
+===============
+*/
+static uint8_t **visrows;     // [portalclusters], compressed
+static int32_t *visrowsize;   // [portalclusters]
+static int32_t *visrowbits;   // [portalclusters], clusters in the row
+static uint32_t *visrowhash;  // [portalclusters]
+
+typedef struct
+{
+    uint32_t hash;
+    int32_t size; // 0 for an empty slot
+    int32_t ofs;  // into vismap
+} rowslot_t;
+
+static rowslot_t *rowslots;
+static int32_t rowslotmask;
+static int32_t c_sharedrows, c_sharedbytes;
+
+static void AllocVisRows(void) {
+    int32_t slots;
+
+    visrows    = malloc(portalclusters * sizeof(uint8_t *));
+    visrowsize = malloc(portalclusters * sizeof(int32_t));
+    visrowbits = malloc(portalclusters * sizeof(int32_t));
+    visrowhash = malloc(portalclusters * sizeof(uint32_t));
+
+    // pvs and phs rows share one table, kept at most half full
+    if (!rowslots) {
+        for (slots = 64; slots < portalclusters * 4; slots <<= 1)
+            ;
+        rowslots    = malloc(slots * sizeof(rowslot_t));
+        rowslotmask = slots - 1;
+        memset(rowslots, 0, slots * sizeof(rowslot_t));
+        c_sharedrows = c_sharedbytes = 0;
+    }
+}
+
+static void FreeVisRowSlots(void) {
+    free(rowslots);
+    rowslots = NULL;
+}
+
+static void SaveVisRow(int32_t cluster, uint8_t *uncompressed, int32_t numbits) {
+    uint8_t compressed[MAX_MAP_LEAFS_QBSP / 8];
+    uint32_t hash;
+    int32_t i, size;
+
+    size = CompressVis(uncompressed, compressed);
+
+    hash = 2166136261u; // FNV-1a
+    for (i = 0; i < size; i++)
+        hash = (hash ^ compressed[i]) * 16777619u;
+
+    visrows[cluster]    = malloc(size);
+    visrowsize[cluster] = size;
+    visrowbits[cluster] = numbits;
+    visrowhash[cluster] = hash;
+    memcpy(visrows[cluster], compressed, size);
+}
+
+/*
+===============
+FindVisRow
+
+Returns the slot holding an identical row, or the empty slot to put it in.
+===============
+*/
+static rowslot_t *FindVisRow(uint8_t *row, int32_t size, uint32_t hash) {
+    rowslot_t *slot;
+    int32_t i;
+
+    for (i = hash & rowslotmask;; i = (i + 1) & rowslotmask) {
+        slot = &rowslots[i];
+        if (!slot->size)
+            return slot;
+        if (slot->hash == hash && slot->size == size && !memcmp(vismap + slot->ofs, row, size))
+            return slot;
+    }
+}
+
+/*
+===============
+StoreVisRows
+
+Appends the rows to the vis lump and returns the total of the counts.
+===============
+*/
+static int32_t StoreVisRows(int32_t ofs) {
+    int32_t i, total;
+    rowslot_t *slot;
+    uint8_t *dest;
+
+    total = 0;
+    for (i = 0; i < portalclusters; i++) {
+        total += visrowbits[i];
+        if (ofs == DVIS_PVS)
+            qprintf("cluster %4i : %4i visible\n", i, visrowbits[i]);
+
+        slot = FindVisRow(visrows[i], visrowsize[i], visrowhash[i]);
+        if (slot->size) {
+            dvis->bitofs[i][ofs] = slot->ofs;
+            c_sharedrows++;
+            c_sharedbytes += visrowsize[i];
+            free(visrows[i]);
+            continue;
+        }
+
+        dest = vismap_p;
+        vismap_p += visrowsize[i];
+
+        if (vismap_p > vismap_end)
+            Error("Vismap expansion overflow. Exceeds extended limit");
+
+        dvis->bitofs[i][ofs] = dest - vismap;
+        memcpy(dest, visrows[i], visrowsize[i]);
+        free(visrows[i]);
+
+        slot->hash = visrowhash[i];
+        slot->size = visrowsize[i];
+        slot->ofs  = dest - vismap;
+    }
+
+    free(visrows);
+    free(visrowsize);
+    free(visrowbits);
+    free(visrowhash);
+    return total;
+}
+
 /*
 ===============
 ClusterMerge
@@ -159,10 +306,8 @@ void ClusterMerge(int32_t leafnum) {
     leaf_t *leaf;
     uint8_t portalvector[MAX_PORTALS_QBSP / 8];
     uint8_t uncompressed[MAX_MAP_LEAFS_QBSP / 8];
-    uint8_t compressed[MAX_MAP_LEAFS_QBSP / 8];
-    int32_t i, j;
+    int32_t i;
     int32_t numvis;
-    uint8_t *dest;
     portal_t *p;
     int32_t pnum;
 
@@ -175,8 +320,7 @@ void ClusterMerge(int32_t leafnum) {
         p = leaf->portals[i];
         if (p->status != stat_done)
             Error("portal not done");
-        for (j = 0; j < portallongs; j++)
-            ((uint32_t *)portalvector)[j] |= ((uint32_t *)p->portalvis)[j];
+        BitsOr((uint32_t *)portalvector, (uint32_t *)p->portalvis, portallongs);
         pnum = p - portals;
         portalvector[pnum >> 3] |= 1 << (pnum & 7);
     }
@@ -193,22 +337,7 @@ void ClusterMerge(int32_t leafnum) {
     // save uncompressed for PHS calculation
     memcpy(uncompressedvis + leafnum * leafbytes, uncompressed, leafbytes);
 
-    //
-    // compress the bit string
-    //
-    qprintf("cluster %4i : %4i visible\n", leafnum, numvis);
-    totalvis += numvis;
-
-    i    = CompressVis(uncompressed, compressed);
-
-    dest = vismap_p;
-    vismap_p += i;
-
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow. Exceeds extended limit");
-
-    dvis->bitofs[leafnum][DVIS_PVS] = dest - vismap;
-    memcpy(dest, compressed, i);
+    SaveVisRow(leafnum, uncompressed, numvis);
 }
 
 /*
@@ -228,7 +357,12 @@ void CalcPortalVis(void) {
         return;
     }
 
-    RunThreadsOnIndividual(numportals * 2, true, PortalFlow);
+    LoadVisState();
+    LoadVisCache();
+    RunThreadsOnIndividual(BuildFlowWork(), true, PortalFlow);
+    FreeFlowWork();
+    FinishVisState();
+    SaveVisCache();
 }
 
 /*
@@ -236,12 +370,22 @@ void CalcPortalVis(void) {
 CalcVis
 ==================
 */
-void CalcVis(void) {
-    int32_t i;
+// -level 1..3 stop PortalFlow this many leafs deep, 4 runs it to the end
+static const int32_t level_depth[5] = {0, 4, 8, 12, 0};
 
+void CalcVis(void) {
     RunThreadsOnIndividual(numportals * 2, true, BasePortalVis);
 
-    //	RunThreadsOnIndividual (numportals*2, true, BetterPortalVis);
+    if (!vislevel)
+        fastvis = true;
+    flow_depth = level_depth[vislevel];
+
+    if (!fastvis && better_depth) {
+        printf("BetterPortalVis, depth %i\n", better_depth);
+        RunThreadsOnIndividual(numportals * 2, true, BetterPortalVis);
+        TightenPortalFlood();
+        printf("Average mightsee: %i, was %i\n", c_vis / (numportals * 2), c_flood / (numportals * 2));
+    }
 
     SortPortals();
 
@@ -250,8 +394,9 @@ void CalcVis(void) {
     //
     // assemble the leaf vis lists by oring and compressing the portal lists
     //
-    for (i = 0; i < portalclusters; i++)
-        ClusterMerge(i);
+    AllocVisRows();
+    RunThreadsOnIndividual(portalclusters, true, ClusterMerge);
+    totalvis = StoreVisRows(DVIS_PVS);
 
     printf("Average clusters visible: %i\n", totalvis / portalclusters);
 }
@@ -284,33 +429,12 @@ void SetPortalSphere(portal_t *p) {
 
 /*
 ============
-LoadPortals
+AllocPortals
+
+Sets up everything sized by portalclusters and numportals.
 ============
 */
-void LoadPortals(char *name) {
-    int32_t i, j;
-    portal_t *p;
-    leaf_t *l;
-    char magic[80];
-    FILE *f;
-    int32_t numpoints;
-    winding_t *w;
-    int32_t leafnums[2];
-    plane_t plane;
-
-    if (!strcmp(name, "-"))
-        f = stdin;
-    else {
-        f = fopen(name, "r");
-        if (!f)
-            Error("LoadPortals: couldn't read %s\n", name);
-    }
-
-    if (fscanf(f, "%79s\n%i\n%i\n", magic, &portalclusters, &numportals) != 3)
-        Error("LoadPortals: failed to read header");
-    if (strcmp(magic, PORTALFILE))
-        Error("LoadPortals: not a portal file");
-
+static void AllocPortals(void) {
     printf("%4i portalclusters\n", portalclusters);
     printf("%4i numportals\n", numportals);
 
@@ -336,18 +460,164 @@ void LoadPortals(char *name) {
     vismap_p          = (uint8_t *)&dvis->bitofs[portalclusters];
 
     vismap_end        = vismap + MAX_MAP_VISIBILITY_QBSP;
+}
 
-    for (i = 0, p = portals; i < numportals; i++) {
+/*
+============
+MakePortalPair
+
+File portal i becomes memory portals i*2 and i*2+1.  w is the forward
+winding, it stays with the forward portal.
+============
+*/
+static void MakePortalPair(int32_t i, winding_t *w, int32_t *leafnums) {
+    portal_t *p;
+    leaf_t *l;
+    plane_t plane;
+    int32_t j;
+
+    if ((unsigned)leafnums[0] > portalclusters || (unsigned)leafnums[1] > portalclusters)
+        Error("LoadPortals: reading portal %i", i);
+
+    // calc plane
+    PlaneFromWinding(w, &plane);
+
+    // create forward portal
+    p = &portals[i * 2];
+    l = &leafs[leafnums[0]];
+    if (l->numportals == MAX_PORTALS_ON_LEAF)
+        Error("Leaf with too many portals");
+    l->portals[l->numportals] = p;
+    l->numportals++;
+
+    p->winding = w;
+    VectorSubtract(vec3_origin, plane.normal, p->plane.normal);
+    p->plane.dist = -plane.dist;
+    p->leaf       = leafnums[1];
+    SetPortalSphere(p);
+    p++;
+
+    // create backwards portal
+    l = &leafs[leafnums[1]];
+    if (l->numportals == MAX_PORTALS_ON_LEAF)
+        Error("Leaf with too many portals");
+    l->portals[l->numportals] = p;
+    l->numportals++;
+
+    p->winding            = NewWinding(w->numpoints);
+    p->winding->numpoints = w->numpoints;
+    for (j = 0; j < w->numpoints; j++) {
+        VectorCopy(w->points[w->numpoints - 1 - j], p->winding->points[j]);
+    }
+
+    p->plane = plane;
+    p->leaf  = leafnums[0];
+    SetPortalSphere(p);
+}
+
+/*
+============
+ParseBinaryPortals
+
+A .prb image, from a file or straight from bsp with -chain.  The points
+are copied into the windings, nothing is parsed.
+============
+*/
+static void ParseBinaryPortals(uint8_t *buffer, int32_t length, char *name) {
+    prbheader_t *header;
+    prbportal_t *in;
+    float *points, *v;
+    int32_t i, j;
+    winding_t *w;
+
+    header = (prbheader_t *)buffer;
+    if (length < sizeof(prbheader_t) || memcmp(header->ident, PRBFILE, 4))
+        Error("LoadPortals: %s is not a binary portal file", name);
+
+    portalclusters = header->numclusters;
+    numportals     = header->numportals;
+    if (portalclusters < 0 || numportals < 0 || numportals > MAX_PORTALS_QBSP || header->numpoints < 0 ||
+        length != sizeof(prbheader_t) + numportals * sizeof(prbportal_t) + header->numpoints * 3 * sizeof(float))
+        Error("LoadPortals: %s is damaged", name);
+
+    AllocPortals();
+
+    in     = (prbportal_t *)(header + 1);
+    points = (float *)(in + numportals);
+    for (i = 0; i < numportals; i++, in++) {
+        if (in->numpoints < 3 || in->numpoints > MAX_POINTS_ON_WINDING ||
+            in->firstpoint < 0 || in->firstpoint > header->numpoints - in->numpoints)
+            Error("LoadPortals: portal %i has bad points", i);
+
+        w            = NewWinding(in->numpoints);
+        w->original  = true;
+        w->numpoints = in->numpoints;
+        v            = points + in->firstpoint * 3;
+        for (j = 0; j < in->numpoints; j++, v += 3)
+            VectorCopy(v, w->points[j]);
+
+        MakePortalPair(i, w, in->leafs);
+    }
+}
+
+/*
+============
+LoadBinaryPortals
+
+The .prb from bsp -binportals, mapped rather than read.
+============
+*/
+static void LoadBinaryPortals(char *name) {
+    uint8_t *buffer;
+    int32_t length;
+
+    buffer = MapFile(name, &length);
+    ParseBinaryPortals(buffer, length, name);
+    UnmapFile(buffer, length);
+}
+
+/*
+============
+LoadPortals
+============
+*/
+void LoadPortals(char *name) {
+    int32_t i, j;
+    char magic[80];
+    FILE *f;
+    int32_t numpoints;
+    winding_t *w;
+    int32_t leafnums[2];
+
+    if (strlen(name) > 4 && !Q_strcasecmp(name + strlen(name) - 4, ".prb")) {
+        LoadBinaryPortals(name);
+        return;
+    }
+
+    if (!strcmp(name, "-"))
+        f = stdin;
+    else {
+        f = fopen(name, "r");
+        if (!f)
+            Error("LoadPortals: couldn't read %s\n", name);
+    }
+
+    if (fscanf(f, "%79s\n%i\n%i\n", magic, &portalclusters, &numportals) != 3)
+        Error("LoadPortals: failed to read header");
+    if (strcmp(magic, PORTALFILE))
+        Error("LoadPortals: not a portal file");
+
+    AllocPortals();
+
+    for (i = 0; i < numportals; i++) {
         if (fscanf(f, "%i %i %i ", &numpoints, &leafnums[0], &leafnums[1]) != 3)
             Error("LoadPortals: reading portal %i", i);
         if (numpoints > MAX_POINTS_ON_WINDING)
             Error("LoadPortals: portal %i has too many points", i);
-        if ((unsigned)leafnums[0] > portalclusters || (unsigned)leafnums[1] > portalclusters)
-            Error("LoadPortals: reading portal %i", i);
 
-        w = p->winding = NewWinding(numpoints);
-        w->original    = true;
-        w->numpoints   = numpoints;
+        w            = NewWinding(numpoints);
+        w->original  = true;
+        w->numpoints = numpoints;
 
         for (j = 0; j < numpoints; j++) {
             double v[3];
@@ -362,40 +632,7 @@ void LoadPortals(char *name) {
         }
         fscanf(f, "\n");
 
-        // calc plane
-        PlaneFromWinding(w, &plane);
-
-        // create forward portal
-        l = &leafs[leafnums[0]];
-        if (l->numportals == MAX_PORTALS_ON_LEAF)
-            Error("Leaf with too many portals");
-        l->portals[l->numportals] = p;
-        l->numportals++;
-
-        p->winding = w;
-        VectorSubtract(vec3_origin, plane.normal, p->plane.normal);
-        p->plane.dist = -plane.dist;
-        p->leaf       = leafnums[1];
-        SetPortalSphere(p);
-        p++;
-
-        // create backwards portal
-        l = &leafs[leafnums[1]];
-        if (l->numportals == MAX_PORTALS_ON_LEAF)
-            Error("Leaf with too many portals");
-        l->portals[l->numportals] = p;
-        l->numportals++;
-
-        p->winding            = NewWinding(w->numpoints);
-        p->winding->numpoints = w->numpoints;
-        for (j = 0; j < w->numpoints; j++) {
-            VectorCopy(w->points[w->numpoints - 1 - j], p->winding->points[j]);
-        }
-
-        p->plane = plane;
-        p->leaf  = leafnums[0];
-        SetPortalSphere(p);
-        p++;
+        MakePortalPair(i, w, leafnums);
     }
 
     fclose(f);
@@ -403,65 +640,59 @@ void LoadPortals(char *name) {
 
 /*
 ================
-CalcPHS
+ClusterPHS
 
-Calculate the PHS (Potentially Hearable Set)
-by ORing together all the PVS visible from a leaf
+ORs together the pvs of every cluster in the pvs of cluster i
 ================
 */
-void CalcPHS(void) {
-    int32_t i, j, k, l, index;
-    int32_t bitbyte;
-    uint32_t *dest, *src;
-    uint8_t *scan;
-    int32_t count;
+void ClusterPHS(int32_t cluster) {
     uint8_t uncompressed[MAX_MAP_LEAFS_QBSP / 8];
-    uint8_t compressed[MAX_MAP_LEAFS_QBSP / 8];
-
-    printf("Building PHS...\n");
-
-    count = 0;
-    for (i = 0; i < portalclusters; i++) {
-        scan = uncompressedvis + i * leafbytes;
-        memcpy(uncompressed, scan, leafbytes);
-        for (j = 0; j < leafbytes; j++) {
-            bitbyte = scan[j];
-            if (!bitbyte)
-                continue;
-            for (k = 0; k < 8; k++) {
-                if (!(bitbyte & (1 << k)))
-                    continue;
+    uint8_t *scan;
+    uint32_t *src;
+    int32_t i, j, bits, index;
+
+    scan = uncompressedvis + cluster * leafbytes;
+    memcpy(uncompressed, scan, leafbytes);
+
+    // walk the set bits, skipping empty words
+    for (i = 0; i < leaflongs; i++) {
+        if (!((uint32_t *)scan)[i])
+            continue;
+        for (j = i * 4; j < i * 4 + 4; j++) {
+            for (bits = scan[j]; bits; bits &= bits - 1) {
                 // OR this pvs row into the phs
-                index = ((j << 3) + k);
+                index = (j << 3) + LowestBit(bits);
                 if (index >= portalclusters)
                     Error("Bad bit in PVS"); // pad bits should be 0
-                src  = (uint32_t *)(uncompressedvis + index * leafbytes);
-                dest = (uint32_t *)uncompressed;
-                for (l = 0; l < leaflongs; l++)
-                    ((uint32_t *)uncompressed)[l] |= src[l];
+                src = (uint32_t *)(uncompressedvis + index * leafbytes);
+                BitsOr((uint32_t *)uncompressed, src, leaflongs);
             }
         }
-        for (j = 0; j < portalclusters; j++)
-            if (uncompressed[j >> 3] & (1 << (j & 7)))
-                count++;
+    }
 
-        //
-        // compress the bit string
-        //
-        j    = CompressVis(uncompressed, compressed);
+    SaveVisRow(cluster, uncompressed, CountBits(uncompressed, portalclusters));
+}
 
-        dest = (uint32_t *)vismap_p;
-        vismap_p += j;
+/*
+================
+CalcPHS
 
-        if (vismap_p > vismap_end)
-            Error("Vismap expansion overflow. Exceeds extended limit");
+Calculate the PHS (Potentially Hearable Set)
+by ORing together all the PVS visible from a leaf
+================
+*/
+void CalcPHS(void) {
+    int32_t count;
 
-        dvis->bitofs[i][DVIS_PHS] = (uint8_t *)dest - vismap;
+    printf("Building PHS...\n");
 
-        memcpy(dest, compressed, j);
-    }
+    AllocVisRows();
+    RunThreadsOnIndividual(portalclusters, true, ClusterPHS);
+    count = StoreVisRows(DVIS_PHS);
+    FreeVisRowSlots();
 
     printf("Average clusters hearable: %i\n", count / portalclusters);
+    printf("%i duplicate rows shared, %i bytes saved\n", c_sharedrows, c_sharedbytes);
 }
 
 /*
@@ -481,16 +712,34 @@ void VIS_ProcessArgument(const char * arg) {
 
     sprintf(name, "%s%s", inbase, source);
     printf("reading %s\n", name);
-    LoadBSPFile(name);
+    LoadChainedBSPFile(name);
     if (numnodes == 0 || numfaces == 0)
         Error("Empty map");
 
+    // qb: take the binary portal file when bsp wrote one with the .prt,
+    // not one left over from before the .prt was rewritten
     sprintf(portalfile, "%s%s", inbase, ExpandArg(arg));
     StripExtension(portalfile);
     strcat(portalfile, ".prt");
+    strcpy(name, portalfile);
+    strcpy(name + strlen(name) - 4, ".prb");
+    if (FileExists(name) && FileTime(name) >= FileTime(portalfile))
+        strcpy(portalfile, name);
+
+    if (heldportals) {
+        printf("using the portals from bsp\n");
+        ParseBinaryPortals(heldportals, heldportalsize, portalfile);
+    } else {
+        printf("reading %s\n", portalfile);
+        LoadPortals(portalfile);
+    }
+
+    sprintf(name, "%s%s", outbase, source);
+    InitVisState(name, portalfile);
 
-    printf("reading %s\n", portalfile);
-    LoadPortals(portalfile);
+    free(heldportals); // the checkpoint checksum was the last use
+    heldportals = NULL;
+    InitVisCache(name);
 
     CalcVis();
 
@@ -504,7 +753,8 @@ void VIS_ProcessArgument(const char * arg) {
         printf("\nWARNING: visdatasize exceeds default limit of %i\n\n", DEFAULT_MAP_VISIBILITY);
 
     sprintf(name, "%s%s", outbase, source);
-    WriteBSPFile(name);
+    WriteChainedBSPFile(name);
+    RemoveVisState();
 
     PrintBSPFileSizes();
 
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "cmdlib.h"
 #include "mathlib.h"
 #include "bspfile.h"
+#include "bitset.h"
 
 //#define	MAX_PORTALS	32767
 
@@ -63,6 +64,7 @@ typedef struct
     uint8_t *portalfront; // [portals], preliminary
     uint8_t *portalflood; // [portals], intermediate
     uint8_t *portalvis;   // [portals], final
+    uint8_t *cachedvis;   // [portals], -incremental, taken instead of flowing
 
     int32_t nummightsee; // bit count on portalflood for sort
 } portal_t;
@@ -86,7 +88,8 @@ typedef struct leaf_s {
 } leaf_t;
 
 typedef struct pstack_s {
-    uint8_t mightsee[MAX_PORTALS_QBSP / 8]; // bit string
+    uint8_t *mightsee; // bit string, portalbytes from the thread's arena
+    int32_t depth;
     struct pstack_s *next;
     leaf_t *leaf;
     portal_t *portal; // portal exiting
@@ -104,6 +107,13 @@ typedef struct
     portal_t *base;
     int32_t c_chains;
     pstack_t pstack_head;
+
+    uint8_t **mightsee_chunks; // MIGHTSEE_CHUNK recursion levels each
+    int32_t num_mightsee_chunks;
+
+    int32_t maxdepth;   // BetterPortalVis stops recursing here, 0 for no limit
+    int32_t leafportal; // only flow through this portal of the first leaf, -1 for all
+    bool shared;        // other threads are filling base->portalvis too
 } threaddata_t;
 
 extern int32_t numportals;
@@ -116,6 +126,10 @@ extern int32_t c_portaltest, c_portalpass, c_portalcheck;
 extern int32_t c_portalskip, c_leafskip;
 extern int32_t c_vistest, c_mighttest;
 extern int32_t c_chains;
+extern int32_t better_depth, flow_depth;
+extern bool reuse_vis;
+extern int32_t vislevel;
+extern int32_t c_flood, c_vis;
 
 extern uint8_t *vismap, *vismap_p, *vismap_end; // past visfile
 
@@ -128,8 +142,20 @@ void LeafFlow(int32_t leafnum);
 
 void BasePortalVis(int32_t portalnum);
 void BetterPortalVis(int32_t portalnum);
-void PortalFlow(int32_t portalnum);
+void TightenPortalFlood(void);
+void PortalFlow(int32_t work);
+int32_t BuildFlowWork(void);
+void FreeFlowWork(void);
+
+void InitVisState(char *bspname, char *portalfile);
+int32_t LoadVisState(void);
+void SaveVisPortal(portal_t *p);
+void FinishVisState(void);
+void RemoveVisState(void);
+
+void InitVisCache(char *bspname);
+int32_t LoadVisCache(void);
+void SaveVisCache(void);
 
 extern portal_t *sorted_portals[MAX_MAP_PORTALS_QBSP * 2];
 
-int32_t CountBits(uint8_t *bits, int32_t numbits);
@@ -0,0 +1,416 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "vis.h"
+#include "mdfour.h"
+
+/*
+==============================================================================
+
+VIS CACHE
+
+With -incremental, name_vis.cache keeps every portal's portalvis from the
+last full vis.  Portal and cluster numbers shift with any edit, so portals
+are identified by a hash of their winding plus the windings of every portal
+out of the leafs on both sides.  A portal whose leafs gained, lost or moved
+a portal gets a new key, as does the portal itself if it moved.
+
+The flow from a portal only walks portals in its portalflood and only
+through portals it marks visible.  A matched portal keeps its old portalvis
+unless its new portalflood holds a portal with no match, or its old
+portalvis held a portal that is gone.  Everything else is reflowed.
+
+A kept portalvis is not put in place until PortalFlow reaches the portal
+in the usual order.  Flows bound themselves by the portalvis of portals
+already done, so marking every kept portal done up front would clip the
+reflowed portals harder than a full vis does.
+
+The settings that change portalvis are covered by a checksum; changing them
+throws the whole cache away.
+==============================================================================
+*/
+
+#define VISCACHE_ID      (('1' << 24) + ('C' << 16) + ('S' << 8) + 'V') // "VSC1"
+#define VISCACHE_VERSION 1
+
+typedef struct
+{
+    int32_t ident;
+    int32_t version;
+    uint8_t checksum[16];
+    int32_t numportals; // file portals, memory portals are twice that
+} viscache_header_t;
+
+typedef struct
+{
+    uint64_t key;
+    int32_t index;
+} keyindex_t;
+
+static char cache_path[1024];
+static uint8_t cache_checksum[16];
+static uint64_t *portalkeys; // by portal
+
+static int32_t CompareKeys(const void *a, const void *b) {
+    uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+    return (ka > kb) - (ka < kb);
+}
+
+static int32_t CompareKeyIndex(const void *a, const void *b) {
+    const keyindex_t *ka = a, *kb = b;
+
+    if (ka->key != kb->key)
+        return (ka->key > kb->key) - (ka->key < kb->key);
+    return ka->index - kb->index;
+}
+
+static uint64_t HashBytes(void *data, int32_t length) {
+    uint8_t digest[16];
+    uint64_t key;
+
+    mdfour(digest, data, length);
+    memcpy(&key, digest, sizeof(key));
+    return key;
+}
+
+/*
+=============
+HashPortals
+
+Fills portalkeys.  Identical portals, if there ever are any, are told
+apart by their order.
+=============
+*/
+static void HashPortals(void) {
+    uint64_t *windingkeys, *leafkeys, *list;
+    uint64_t k[3];
+    keyindex_t *order;
+    winding_t *w;
+    leaf_t *leaf;
+    int32_t i, j, dup;
+
+    windingkeys = malloc(numportals * 2 * sizeof(uint64_t));
+    for (i = 0; i < numportals * 2; i++) {
+        w              = portals[i].winding;
+        windingkeys[i] = HashBytes(w->points, w->numpoints * sizeof(vec3_t));
+    }
+
+    // a leaf is the set of its portals, in any order
+    leafkeys = malloc(portalclusters * sizeof(uint64_t));
+    list     = malloc(MAX_PORTALS_ON_LEAF * sizeof(uint64_t));
+    for (i = 0; i < portalclusters; i++) {
+        leaf = &leafs[i];
+        for (j = 0; j < leaf->numportals; j++)
+            list[j] = windingkeys[leaf->portals[j] - portals];
+        qsort(list, leaf->numportals, sizeof(uint64_t), CompareKeys);
+        leafkeys[i] = HashBytes(list, leaf->numportals * sizeof(uint64_t));
+    }
+    free(list);
+
+    portalkeys = malloc(numportals * 2 * sizeof(uint64_t));
+    order      = malloc(numportals * 2 * sizeof(keyindex_t));
+    for (i = 0; i < numportals * 2; i++) {
+        k[0]           = windingkeys[i];
+        k[1]           = leafkeys[portals[i ^ 1].leaf]; // leaf it leaves
+        k[2]           = leafkeys[portals[i].leaf];     // leaf it looks into
+        order[i].key   = HashBytes(k, sizeof(k));
+        order[i].index = i;
+    }
+
+    qsort(order, numportals * 2, sizeof(keyindex_t), CompareKeyIndex);
+    for (i = 0, dup = 0; i < numportals * 2; i++) {
+        if (i > 0 && order[i].key == order[i - 1].key)
+            dup++;
+        else
+            dup = 0;
+        portalkeys[order[i].index] = order[i].key;
+        if (dup)
+            portalkeys[order[i].index] += dup * 0x9E3779B97F4A7C15ull;
+    }
+
+    free(order);
+    free(leafkeys);
+    free(windingkeys);
+}
+
+/*
+=============
+WriteBits / ReadBits
+
+portalvis is mostly zero, so runs of zero bytes are stored as a 0 and a
+count, the same way CompressVis packs rows.
+=============
+*/
+static void WriteBits(FILE *f, uint8_t *bits, uint8_t *buffer) {
+    uint8_t *out = buffer;
+    int32_t i, rep;
+
+    for (i = 0; i < portalbytes; i++) {
+        *out++ = bits[i];
+        if (bits[i])
+            continue;
+        rep = 1;
+        for (i++; i < portalbytes && !bits[i] && rep < 255; i++)
+            rep++;
+        *out++ = rep;
+        i--;
+    }
+    rep = out - buffer;
+    SafeWrite(f, &rep, sizeof(int32_t));
+    SafeWrite(f, buffer, rep);
+}
+
+static bool ReadBits(FILE *f, uint8_t *bits, uint8_t *buffer, int32_t bytes) {
+    uint8_t *in, *end;
+    int32_t out, length, rep;
+
+    if (fread(&length, sizeof(int32_t), 1, f) != 1 || length < 0 || length > bytes * 2 ||
+        fread(buffer, length, 1, f) != 1)
+        return false;
+
+    in  = buffer;
+    end = buffer + length;
+    out = 0;
+    while (in < end) {
+        if (*in) {
+            if (out >= bytes)
+                return false;
+            bits[out++] = *in++;
+            continue;
+        }
+        if (in + 1 >= end)
+            return false;
+        rep = in[1];
+        if (out + rep > bytes)
+            return false;
+        memset(bits + out, 0, rep);
+        out += rep;
+        in += 2;
+    }
+    return out == bytes;
+}
+
+/*
+=============
+InitVisCache
+
+bspname is the output bsp.  Call once the portals are loaded.
+=============
+*/
+void InitVisCache(char *bspname) {
+    int32_t settings[4];
+
+    cache_path[0] = 0;
+    if (!incremental)
+        return;
+
+    strcpy(cache_path, bspname);
+    StripExtension(cache_path);
+    strcat(cache_path, "_vis.cache");
+
+    settings[0] = vislevel;
+    settings[1] = better_depth;
+    settings[2] = reuse_vis;
+    settings[3] = 0;
+    mdfour(cache_checksum, (uint8_t *)settings, sizeof(settings));
+
+    HashPortals();
+}
+
+/*
+=============
+LoadVisCache
+
+Call after BasePortalVis.  Gives the portals whose old portalvis still
+holds a cachedvis for PortalFlow and returns how many there were.
+=============
+*/
+int32_t LoadVisCache(void) {
+    viscache_header_t header;
+    keyindex_t *newkeys, *found, search;
+    uint64_t *oldkeys;
+    int32_t *oldtonew, *newtoold;
+    uint8_t *changed, *gone, *oldbits, *buffer;
+    uint32_t *flood;
+    int32_t i, j, n, oldcount, oldbytes, reused, reflow;
+    portal_t *p;
+    FILE *f;
+
+    if (!cache_path[0])
+        return 0;
+
+    f = fopen(cache_path, "rb");
+    if (!f) {
+        printf("no %s yet, full vis\n", cache_path);
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.ident != VISCACHE_ID ||
+        header.version != VISCACHE_VERSION ||
+        header.numportals <= 0 || header.numportals > MAX_PORTALS_QBSP ||
+        memcmp(header.checksum, cache_checksum, sizeof(cache_checksum))) {
+        printf("%s is from other vis settings, full vis\n", cache_path);
+        fclose(f);
+        return 0;
+    }
+
+    oldcount = header.numportals * 2;
+    oldbytes = ((oldcount + 63) & ~63) >> 3;
+    oldkeys  = malloc(oldcount * sizeof(uint64_t));
+    SafeRead(f, oldkeys, oldcount * sizeof(uint64_t));
+
+    // match old portals to new ones by key
+    newkeys = malloc(numportals * 2 * sizeof(keyindex_t));
+    for (i = 0; i < numportals * 2; i++) {
+        newkeys[i].key   = portalkeys[i];
+        newkeys[i].index = i;
+    }
+    qsort(newkeys, numportals * 2, sizeof(keyindex_t), CompareKeyIndex);
+
+    oldtonew = malloc(oldcount * sizeof(int32_t));
+    newtoold = malloc(numportals * 2 * sizeof(int32_t));
+    for (i = 0; i < numportals * 2; i++)
+        newtoold[i] = -1;
+    gone = malloc(oldbytes);
+    memset(gone, 0, oldbytes);
+    for (i = 0; i < oldcount; i++) {
+        search.key = oldkeys[i];
+        found      = bsearch(&search, newkeys, numportals * 2, sizeof(keyindex_t), CompareKeys);
+        if (found) {
+            oldtonew[i]            = found->index;
+            newtoold[found->index] = i;
+        } else {
+            oldtonew[i] = -1;
+            gone[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    changed = malloc(portalbytes);
+    memset(changed, 0, portalbytes);
+    for (i = 0; i < numportals * 2; i++) {
+        if (newtoold[i] < 0)
+            changed[i >> 3] |= 1 << (i & 7);
+    }
+
+    oldbits = malloc(oldbytes);
+    buffer  = malloc(oldbytes * 2);
+    reused  = reflow = 0;
+    for (i = 0; i < oldcount; i++) {
+        if (!ReadBits(f, oldbits, buffer, oldbytes)) {
+            printf("%s is damaged, reflowing the rest\n", cache_path);
+            break;
+        }
+        if (oldtonew[i] < 0)
+            continue;
+        p = &portals[oldtonew[i]];
+        if (p->status == stat_done)
+            continue; // resumed
+
+        // the flow would walk into new geometry, or saw through old
+        flood = (uint32_t *)p->portalflood;
+        for (j = 0; j < portallongs; j++) {
+            if (flood[j] & ((uint32_t *)changed)[j])
+                break;
+        }
+        if (j < portallongs) {
+            reflow++;
+            continue;
+        }
+        for (j = 0; j < oldbytes; j++) {
+            if (oldbits[j] & gone[j])
+                break;
+        }
+        if (j < oldbytes) {
+            reflow++;
+            continue;
+        }
+
+        p->cachedvis = malloc(portalbytes);
+        memset(p->cachedvis, 0, portalbytes);
+        for (j = 0; j < oldcount; j++) {
+            if (!oldbits[j >> 3]) {
+                j |= 7;
+                continue;
+            }
+            if (oldbits[j >> 3] & (1 << (j & 7))) {
+                n = oldtonew[j];
+                p->cachedvis[n >> 3] |= 1 << (n & 7);
+            }
+        }
+        reused++;
+    }
+    fclose(f);
+
+    printf("incremental: %i of %i portals reused, %i near changes, %i new\n",
+           reused, numportals * 2, reflow, CountBits(changed, numportals * 2));
+
+    free(buffer);
+    free(oldbits);
+    free(changed);
+    free(gone);
+    free(newtoold);
+    free(oldtonew);
+    free(newkeys);
+    free(oldkeys);
+    return reused;
+}
+
+/*
+=============
+SaveVisCache
+
+Call once every portal is done.
+=============
+*/
+void SaveVisCache(void) {
+    viscache_header_t header;
+    char tmppath[1040];
+    uint8_t *buffer;
+    int32_t i;
+    FILE *f;
+
+    if (!cache_path[0])
+        return;
+
+    memset(&header, 0, sizeof(header));
+    header.ident      = VISCACHE_ID;
+    header.version    = VISCACHE_VERSION;
+    header.numportals = numportals;
+    memcpy(header.checksum, cache_checksum, sizeof(cache_checksum));
+
+    sprintf(tmppath, "%s.tmp", cache_path);
+    f = SafeOpenWrite(tmppath);
+    SafeWrite(f, &header, sizeof(header));
+    SafeWrite(f, portalkeys, numportals * 2 * sizeof(uint64_t));
+
+    buffer = malloc(portalbytes * 2);
+    for (i = 0; i < numportals * 2; i++)
+        WriteBits(f, portals[i].portalvis, buffer);
+    free(buffer);
+    fclose(f);
+
+    remove(cache_path);
+    if (rename(tmppath, cache_path))
+        printf("WARNING: couldn't rename %s to %s\n", tmppath, cache_path);
+
+    free(portalkeys);
+    portalkeys = NULL;
+}
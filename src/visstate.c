@@ -0,0 +1,269 @@
+/*
+===========================================================================
+Copyright (C) 1997-2006 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+===========================================================================
+*/
+
+#include "vis.h"
+#include "threads.h"
+#include "mdfour.h"
+
+/*
+==============================================================================
+
+VIS STATE FILE
+
+While PortalFlow runs, every finished portal's portalvis is appended to
+name_vis.ckp next to the output bsp:
+
+    visstate_header_t
+    { int32_t portalnum; uint8_t portalvis[portalbytes]; } ...
+
+The header carries a checksum of the .prt file and the settings that change
+portalvis, so state from a different compile is ignored.  A record cut off
+by a kill is dropped on load.  -resume marks the saved portals done and
+only flows the rest.
+
+Finished portals are queued under ThreadLock.  Whichever thread finishes a
+portal after VISSTATE_INTERVAL seconds writes the whole batch outside the
+lock while the others keep flowing.  portalvis doesn't change once a
+portal is done, so the batch is written without a copy.
+
+The file is removed once the bsp has been written.
+==============================================================================
+*/
+
+#define VISSTATE_VERSION  1
+#define VISSTATE_ID       (('K' << 24) + ('C' << 16) + ('S' << 8) + 'V') // "VSCK"
+#define VISSTATE_INTERVAL 5.0
+
+typedef struct
+{
+    int32_t ident;
+    int32_t version;
+    uint8_t checksum[16];
+    int32_t numportals;
+    int32_t portalbytes;
+} visstate_header_t;
+
+extern bool checkpoint;
+
+static char visstate_path[1024];
+static uint8_t visstate_checksum[16];
+static FILE *visstate_file;
+
+static int32_t *visstate_queue; // portal numbers in the order they finished
+static int32_t visstate_queued, visstate_written;
+static bool visstate_flushing;
+static double visstate_lastflush;
+
+/*
+=============
+InitVisState
+
+bspname is the output bsp.  Without -resume an old state file is removed.
+=============
+*/
+void InitVisState(char *bspname, char *portalfile) {
+    struct mdfour md;
+    int32_t settings[4];
+    uint8_t *buffer;
+    int32_t length;
+
+    visstate_path[0] = 0;
+    if (!checkpoint || !strcmp(portalfile, "-"))
+        return;
+
+    strcpy(visstate_path, bspname);
+    StripExtension(visstate_path);
+    strcat(visstate_path, "_vis.ckp");
+
+    mdfour_begin(&md);
+    if (heldportals) // qb: -chain, the portals never went to disk
+        mdfour_update(&md, heldportals, heldportalsize);
+    else {
+        length = LoadFile(portalfile, (void **)&buffer);
+        mdfour_update(&md, buffer, length);
+        free(buffer);
+    }
+
+    settings[0] = vislevel;
+    settings[1] = better_depth;
+    settings[2] = reuse_vis;
+    settings[3] = 0;
+    mdfour_update(&md, (uint8_t *)settings, sizeof(settings));
+    mdfour_result(&md, visstate_checksum);
+
+    if (!resume)
+        remove(visstate_path);
+}
+
+static void InitHeader(visstate_header_t *header) {
+    memset(header, 0, sizeof(*header));
+    header->ident       = VISSTATE_ID;
+    header->version     = VISSTATE_VERSION;
+    header->numportals  = numportals;
+    header->portalbytes = portalbytes;
+    memcpy(header->checksum, visstate_checksum, sizeof(visstate_checksum));
+}
+
+static void WriteRecord(FILE *f, int32_t portalnum) {
+    SafeWrite(f, &portalnum, sizeof(int32_t));
+    SafeWrite(f, portals[portalnum].portalvis, portalbytes);
+}
+
+/*
+=============
+LoadVisState
+
+Marks the portals saved by an interrupted run done, then starts a fresh
+state file holding them.  Returns the number of portals restored.
+=============
+*/
+int32_t LoadVisState(void) {
+    visstate_header_t header, want;
+    char tmppath[1040];
+    int32_t i, portalnum, loaded;
+    FILE *f;
+
+    if (!visstate_path[0])
+        return 0;
+
+    visstate_queue     = malloc(numportals * 2 * sizeof(int32_t));
+    visstate_queued    = visstate_written = 0;
+    visstate_flushing  = false;
+    visstate_lastflush = I_FloatTime();
+
+    InitHeader(&want);
+    f = resume ? fopen(visstate_path, "rb") : NULL;
+    if (f) {
+        if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(&header, &want, sizeof(header))) {
+            printf("%s does not match this portal file or its settings, ignored\n", visstate_path);
+        } else {
+            while (fread(&portalnum, sizeof(int32_t), 1, f) == 1) {
+                if (portalnum < 0 || portalnum >= numportals * 2 ||
+                    portals[portalnum].status == stat_done)
+                    break;
+                if (fread(portals[portalnum].portalvis, portalbytes, 1, f) != 1)
+                    break; // cut off mid-record
+                portals[portalnum].status         = stat_done;
+                visstate_queue[visstate_queued++] = portalnum;
+            }
+        }
+        fclose(f);
+    }
+    loaded = visstate_queued;
+
+    // rewrite what was kept, so the appends don't land after a torn record
+    sprintf(tmppath, "%s.tmp", visstate_path);
+    f = SafeOpenWrite(tmppath);
+    SafeWrite(f, &want, sizeof(want));
+    for (i = 0; i < loaded; i++)
+        WriteRecord(f, visstate_queue[i]);
+    fclose(f);
+
+    remove(visstate_path); // rename won't replace an existing file on win32
+    if (rename(tmppath, visstate_path))
+        Error("LoadVisState: couldn't rename %s to %s", tmppath, visstate_path);
+
+    visstate_written = loaded;
+    visstate_file    = fopen(visstate_path, "ab");
+    if (!visstate_file)
+        Error("LoadVisState: couldn't append to %s", visstate_path);
+
+    if (loaded)
+        printf("resumed %i of %i portals from %s\n", loaded, numportals * 2, visstate_path);
+    return loaded;
+}
+
+/*
+=============
+FlushVisState
+
+Only one thread writes at a time, the caller owns [start, end).
+=============
+*/
+static void FlushVisState(int32_t start, int32_t end) {
+    int32_t i;
+
+    for (i = start; i < end; i++)
+        WriteRecord(visstate_file, visstate_queue[i]);
+    fflush(visstate_file);
+
+    ThreadLock();
+    visstate_written   = end;
+    visstate_lastflush = I_FloatTime();
+    visstate_flushing  = false;
+    ThreadUnlock();
+}
+
+/*
+=============
+SaveVisPortal
+
+Called by PortalFlow once p is done.
+=============
+*/
+void SaveVisPortal(portal_t *p) {
+    int32_t start, end;
+
+    if (!visstate_file)
+        return;
+
+    end = 0;
+    ThreadLock();
+    visstate_queue[visstate_queued++] = p - portals;
+    if (!visstate_flushing && I_FloatTime() - visstate_lastflush >= VISSTATE_INTERVAL) {
+        visstate_flushing = true;
+        start             = visstate_written;
+        end               = visstate_queued;
+    }
+    ThreadUnlock();
+
+    if (end)
+        FlushVisState(start, end);
+}
+
+/*
+=============
+FinishVisState
+
+Writes what is still queued once the flow is over.
+=============
+*/
+void FinishVisState(void) {
+    if (!visstate_file)
+        return;
+
+    FlushVisState(visstate_written, visstate_queued);
+    fclose(visstate_file);
+    visstate_file = NULL;
+    free(visstate_queue);
+    visstate_queue = NULL;
+}
+
+/*
+=============
+RemoveVisState
+
+Called once the bsp has been written.
+=============
+*/
+void RemoveVisState(void) {
+    if (visstate_path[0])
+        remove(visstate_path);
+}
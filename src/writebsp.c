@@ -639,7 +639,7 @@ void EndBSPFile(void) {
 
     // write the map
     sprintf(path, "%s.bsp", source);
-    WriteBSPFile(path);
+    WriteChainedBSPFile(path);
 }
 
 /*